@@ -45,6 +45,8 @@
 
 #include <amino.h>
 #include <reflex.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "pir-frame.h"
 
@@ -168,6 +170,15 @@ struct pir_config {
     double dq[PIR_TF_CONFIG_MAX];
 };
 
+/**
+ * Filtered joint state.
+ */
+struct pir_joint_est {
+    double q[PIR_AXIS_CNT];
+    double dq[PIR_AXIS_CNT];
+    double ddq[PIR_AXIS_CNT];
+};
+
 struct pir_state {
     double q[PIR_AXIS_CNT];
     double dq[PIR_AXIS_CNT];
@@ -176,8 +187,41 @@ struct pir_state {
     double S_wp[2][8];
     double J_wp[2][7*6];
     double S_eer[2][8];
+
+    struct pir_joint_est est;
+
+    double dx_wp[2][6];     ///< wrist twist, frame of S_wp
+    double dx_ee[2][6];     ///< twist of S_wp * S_eer, frame of S_wp
+};
+
+/*--- Joint Estimation ---*/
+
+#define PIR_ABG_THETA .75   ///< fading-memory factor, larger smooths more
+#define PIR_ABG_GAP   .1    ///< restart after this long without a sample, s
+
+/**
+ * Constant-acceleration estimator for every axis, structure of arrays.
+ */
+struct pir_abg {
+    double q[PIR_AXIS_CNT];
+    double dq[PIR_AXIS_CNT];
+    double ddq[PIR_AXIS_CNT];
+    int64_t t_ns[PIR_AXIS_CNT];     ///< time of the last sample of each axis
 };
 
+/**
+ * Correct each axis whose sample time z_t_ns is newer than its last.
+ *
+ * z_dq is used only to start an axis.
+ */
+void pir_abg_update( struct pir_abg *E, const double *z_q, const double *z_dq,
+                     const int64_t *z_t_ns );
+
+/**
+ * Predict all axes to t_ns.
+ */
+void pir_abg_get( const struct pir_abg *E, int64_t t_ns, struct pir_joint_est *X );
+
 void lwa4_kin_( const double *q, const double *T0, const double *Tee, double *T, double *J );
 void lwa4_tf_( const double *q, double *TT );
 void lwa4_tf_abs_( const double *q, const double *T0, double *TT );
@@ -192,11 +236,446 @@ void lwa4_duqu( const double *q, double *S_rel );
 int pir_kin_solve( double q0[7], double S1[8], double q1[7] );
 
 int pir_kin_arm( struct pir_state *X );
-int pir_kin_ft( double *tf_abs, struct pir_state *X, double F_raw[2][6], double r_ft[2][4] );
+/**
+ * Wrist and end-effector twists of both arms from J_wp, S_wp, S_eer,
+ * and the estimated joint velocities.
+ */
+int pir_kin_twist( struct pir_state *X );
+/**
+ * Pose and Jacobian of frame See on the wrist of one arm at q.
+ */
+int pir_kin_arm_side( int side, const double q[7], const double See[8],
+                      double S[8], double J[6*7] );
+struct pir_payload;
+/**
+ * External wrenches from raw F/T readings, compensated for the
+ * payloads P of both sides.
+ */
+int pir_kin_ft( double *tf_abs, struct pir_state *X, const struct pir_payload *P,
+                double F_raw[2][6], double r_ft[2][4] );
 
 void pir_kin( const double *q, double **tf_rel, double **tf_abs );
 
 
+/*------ SOURCE HEALTH --------*/
+
+/**
+ * Driver channels fused by pirfilt.
+ */
+enum pir_source {
+    PIR_SRC_LEFT,
+    PIR_SRC_RIGHT,
+    PIR_SRC_SDH_LEFT,
+    PIR_SRC_SDH_RIGHT,
+    PIR_SRC_TORSO,
+    PIR_SRC_FT_LEFT,
+    PIR_SRC_FT_RIGHT,
+    PIR_SRC_CNT
+};
+
+#define PIR_SRC_BIT(src) (1u << (src))
+
+#define PIR_HEALTH_AGE_NS (250 * 1000 * 1000)  ///< older health means pirfilt itself stopped
+
+/**
+ * Freshness of each source as last checked by pirfilt.
+ */
+struct pir_health {
+    int64_t time_ns;            ///< when the sources were checked
+    uint32_t stale;             ///< bit for each source without a recent sample
+    uint32_t seen;              ///< bit for each source heard from since start
+    uint32_t anom;              ///< bit for each axis whose jump was accepted, see pir_anom
+};
+
+/**
+ * Sources in mask that are stale at now_ns, or all of mask if the
+ * health itself is too old.
+ */
+static inline unsigned pir_health_stale( const struct pir_health *H, int64_t now_ns,
+                                         unsigned mask )
+{
+    if( now_ns - H->time_ns > PIR_HEALTH_AGE_NS ) return mask;
+    return (H->stale | ~H->seen) & mask;
+}
+
+/*------ STATE MESSAGE --------*/
+
+#define PIR_STATE_MSG_VERSION 5
+
+/**
+ * Sections of the state message, in the order they are packed.
+ */
+enum pir_state_section {
+    PIR_STATE_SEC_JOINTS,     ///< q, dq
+    PIR_STATE_SEC_FT,         ///< F
+    PIR_STATE_SEC_WRIST,      ///< S_wp
+    PIR_STATE_SEC_JACOBIAN,   ///< J_wp
+    PIR_STATE_SEC_EER,        ///< S_eer
+    PIR_STATE_SEC_EST,        ///< est
+    PIR_STATE_SEC_TWIST,      ///< dx_wp, dx_ee
+    PIR_STATE_SEC_CNT
+};
+
+#define PIR_STATE_SEC_BIT(sec) (1u << (sec))
+#define PIR_STATE_SEC_ALL ((1u << PIR_STATE_SEC_CNT) - 1)
+
+/**
+ * Source time of an sns message header in nanoseconds.
+ */
+#define PIR_MSG_TIME_NS(header) \
+    ((int64_t)(header).time.sec * 1000000000 + (int64_t)(header).time.nsec)
+
+/**
+ * A timespec in nanoseconds.
+ */
+#define PIR_TIMESPEC_NS(ts) \
+    ((int64_t)(ts).tv_sec * 1000000000 + (int64_t)(ts).tv_nsec)
+
+/**
+ * State message on the pir-state channel.
+ *
+ * Only the sections in the bitmap are present, packed in section
+ * order after the header.  Each section carries the time of the
+ * sensor message it was computed from.
+ */
+struct pir_state_msg {
+    uint32_t version;
+    uint32_t sections;                      ///< bitmap of present sections
+    uint64_t seq;
+    struct pir_health health;               ///< carried by every message
+    int64_t time_ns[PIR_STATE_SEC_CNT];     ///< source time per section
+    double data[1];
+};
+
+size_t pir_state_msg_size( unsigned sections );
+
+/**
+ * Fill msg with the given sections of X.
+ */
+void pir_state_msg_pack( struct pir_state_msg *msg, const struct pir_state *X,
+                         unsigned sections,
+                         const int64_t time_ns[PIR_STATE_SEC_CNT] );
+
+/**
+ * Returns zero if msg is a valid state message of frame_size bytes.
+ */
+int pir_state_msg_check( const struct pir_state_msg *msg, size_t frame_size );
+
+/**
+ * Pointer to a section in the message, or NULL if not present.
+ */
+const double *pir_state_msg_section( const struct pir_state_msg *msg,
+                                     enum pir_state_section sec );
+
+/**
+ * Copy present sections into X, returning the section bitmap.
+ */
+unsigned pir_state_msg_unpack( const struct pir_state_msg *msg, struct pir_state *X );
+
+/**
+ * Map joint positions to the kinematic configuration.
+ */
+void pir_state_config( const double q[PIR_AXIS_CNT], struct pir_config *Q );
+
+
+/*------ SHARED MEMORY STATE --------*/
+
+#define PIR_SHM_NAME "/pir-state"
+
+/**
+ * Separately versioned fields of the shared state.
+ */
+enum pir_shm_field {
+    PIR_SHM_Q,
+    PIR_SHM_DQ,
+    PIR_SHM_F,
+    PIR_SHM_S_WP,
+    PIR_SHM_J_WP,
+    PIR_SHM_S_EER,
+    PIR_SHM_CONFIG,
+    PIR_SHM_EST,
+    PIR_SHM_DX_WP,
+    PIR_SHM_DX_EE,
+    PIR_SHM_FIELD_CNT
+};
+
+#define PIR_SHM_BIT(field) (1u << (field))
+#define PIR_SHM_ALL ((1u << PIR_SHM_FIELD_CNT) - 1)
+#define PIR_SHM_JOINTS (PIR_SHM_BIT(PIR_SHM_Q) | PIR_SHM_BIT(PIR_SHM_DQ) | \
+                        PIR_SHM_BIT(PIR_SHM_EST))
+
+/**
+ * Seqlock-protected state snapshot.
+ *
+ * The sequence number is odd while pirfilt is writing.  Each field
+ * also carries the write count at which it last changed, so readers
+ * copy only fields that are both wanted and new.
+ */
+struct pir_shm {
+    uint64_t size;                      ///< sizeof(struct pir_shm)
+    uint64_t seq;                       ///< seqlock sequence number
+    uint64_t gen[PIR_SHM_FIELD_CNT];    ///< per-field generation
+    int64_t time_ns[PIR_SHM_FIELD_CNT]; ///< source time of each field
+    struct pir_health health;           ///< rewritten on every put
+    struct pir_state state;
+    struct pir_config config;
+};
+
+/**
+ * Map the shared state, creating it if create is nonzero.
+ */
+struct pir_shm *pir_shm_open( const char *name, int create );
+
+void pir_shm_close( struct pir_shm *shm );
+
+/**
+ * Publish health H and the given fields of X and Q, each with the
+ * source time of its state section.
+ */
+void pir_shm_put( struct pir_shm *shm, const struct pir_health *H,
+                  const struct pir_state *X, const struct pir_config *Q,
+                  const int64_t time_ns[PIR_STATE_SEC_CNT], unsigned fields );
+
+/**
+ * Copy health into H and the given fields that changed since gen
+ * into X and Q, and their section times into time_ns.
+ *
+ * Returns the mask of copied fields, or -1 if a put did not finish
+ * within a short bound, in which case X, Q and time_ns are untouched.
+ */
+int pir_shm_get( const struct pir_shm *shm, struct pir_health *H,
+                 struct pir_state *X, struct pir_config *Q,
+                 int64_t time_ns[PIR_STATE_SEC_CNT], unsigned fields,
+                 uint64_t gen[PIR_SHM_FIELD_CNT] );
+
+
+/*------ STREAMED TRAJECTORIES --------*/
+
+struct pir_trajx_seg {
+    double t0;        ///< segment start time
+    double t1;        ///< segment end time
+    double r0[4];     ///< orientation at t0
+    double c[4][6];   ///< cubic coefficients, translation and rotation vector
+};
+
+/**
+ * Cubic Hermite segment from pose E0 and twist dx0 at t0 to E1 and dx1
+ * at t1, poses as quaternion-translation.
+ */
+void pir_trajx_seg_fill( struct pir_trajx_seg *seg,
+                         double t0, const double E0[7], const double dx0[6],
+                         double t1, const double E1[7], const double dx1[6] );
+
+/**
+ * Pose and twist of seg at t.
+ */
+void pir_trajx_seg_get( const struct pir_trajx_seg *seg, double t,
+                        double E[7], double dx[6] );
+
+#define PIR_TRAJX_STREAM_RING 256   ///< queued stream segments, power of 2
+
+struct pir_trajx_stream {
+    struct pir_trajx_seg seg[PIR_TRAJX_STREAM_RING];  ///< segment k at k % RING
+    size_t n;                   ///< segments appended
+    size_t cur;                 ///< cursor segment
+
+    int side;
+
+    double t_f;       ///< time of last waypoint
+    double E_f[7];    ///< last waypoint
+    double dx_f[6];   ///< velocity at last waypoint
+};
+
+void pir_trajx_stream_init( struct pir_trajx_stream *T, const double S0[8] );
+
+/**
+ * Append a waypoint S dt after the current end, or after t_now if the
+ * stream already ran dry.  Returns nonzero when the ring is full.
+ */
+int pir_trajx_stream_add( struct pir_trajx_stream *T, double t_now,
+                          double dt, const double S[8] );
+
+/**
+ * Append a segment ending at time t1 at pose S with velocity dx.
+ * Returns nonzero when the ring is full.
+ */
+int pir_trajx_stream_push( struct pir_trajx_stream *T, double t1,
+                           const double S[8], const double dx[6] );
+
+/**
+ * Returns nonzero when t is past the final waypoint.
+ */
+int pir_trajx_stream_get( struct pir_trajx_stream *T, double t,
+                          double S[8], double dx[6] );
+
+
+/*------ TABULATED TRAJECTORIES --------*/
+
+#define PIR_TRAJ_TAB_H .01     ///< longest piece of a tabulated trajectory, s
+
+/**
+ * Joint trajectory resampled into uniform cubic Hermite pieces.
+ *
+ * Piece i covers [i*h, (i+1)*h], so evaluation indexes straight into
+ * one contiguous coefficient array.
+ */
+struct pir_trajq_tab {
+    size_t n_q;       ///< number of joints
+    size_t n;         ///< number of pieces
+    double h;         ///< piece duration
+    double t_f;       ///< final time
+    double *c;        ///< 4*n_q coefficients per piece
+    double *q_f;      ///< final position
+};
+
+/**
+ * Cartesian trajectory resampled into uniform cubic Hermite segments.
+ */
+struct pir_trajx_tab {
+    size_t n;                   ///< number of segments
+    double h;                   ///< segment duration
+    double t_f;                 ///< final time
+    struct pir_trajx_seg *seg;  ///< segment i covers [i*h, (i+1)*h]
+    double E_f[7];              ///< final pose
+};
+
+/**
+ * Resample a Cartesian spline into T, in pieces of at most
+ * PIR_TRAJ_TAB_H.
+ */
+void pir_trajx_tab_init( struct pir_trajx_tab *T, aa_mem_region_t *reg,
+                         struct rfx_trajx_seg_list *segs );
+
+/**
+ * Returns nonzero when t is past the end.
+ */
+int pir_trajx_tab_get( const struct pir_trajx_tab *T, double t,
+                       double S[8], double dx[6] );
+
+/**
+ * Build from n+1 knots q and dq at times i*h.  With n zero, hold at q.
+ */
+void pir_trajq_tab_init( struct pir_trajq_tab *T, aa_mem_region_t *reg,
+                         size_t n_q, size_t n, double h,
+                         const double *q, const double *dq );
+
+/**
+ * Returns nonzero when t is past the end.
+ */
+int pir_trajq_tab_get( const struct pir_trajq_tab *T, double t,
+                       double *q, double *dq );
+
+
+/*------ TIME OPTIMAL JOINT TRAJECTORIES --------*/
+
+/**
+ * Straight lines between joint waypoints, coming to rest at each.
+ *
+ * Each segment scales one trapezoidal profile of the path parameter
+ * to all joints, which is the minimum time rest-to-rest motion along a
+ * line under per-joint velocity and acceleration limits.  The whole
+ * trajectory is not time optimal, since it does not blend through the
+ * interior waypoints.  These back the trajq-stop modes.
+ */
+struct pir_trajq_topt {
+    size_t n_q;       ///< number of joints
+    size_t n_seg;     ///< number of segments
+    double *q;        ///< n_q * (n_seg+1) waypoints
+    double *t;        ///< n_seg+1 waypoint times
+    double *t_a;      ///< acceleration time of each segment
+    double *a;        ///< path acceleration of each segment
+    size_t cur;       ///< cursor segment
+};
+
+/**
+ * Time n_pts waypoints q, the first being the start.
+ *
+ * Returns nonzero if a limit is not positive.
+ */
+int pir_trajq_topt_gen( struct pir_trajq_topt *T, aa_mem_region_t *reg,
+                        size_t n_q, size_t n_pts, const double *q,
+                        const double *dq_max, const double *ddq_max );
+
+/**
+ * Returns nonzero when t is past the final waypoint.
+ */
+int pir_trajq_topt_get( struct pir_trajq_topt *T, double t,
+                        double *q, double *dq );
+
+/**
+ * Joint waypoints timed along the whole path.
+ *
+ * A natural cubic spline through the waypoints is parameterized in
+ * minimum time under per-joint velocity and acceleration limits,
+ * starting and ending at rest.  Interior waypoints are passed through
+ * at whatever speed the limits allow.  These back the trajq modes.
+ */
+struct pir_trajq_path {
+    size_t n_q;       ///< number of joints
+    size_t n_k;       ///< number of spline knots
+    double *s_k;      ///< knot path lengths
+    double *q_k;      ///< n_q * n_k knot positions
+    double *M_k;      ///< n_q * n_k knot second derivatives
+    size_t n_grid;    ///< number of path grid steps
+    double ds;        ///< grid step
+    double *x;        ///< squared path velocity at each grid point
+    double *t;        ///< time at each grid point
+    double t_scale;   ///< time stretch, at least 1
+    size_t cur;       ///< cursor grid step
+    size_t kn;        ///< cursor knot
+};
+
+/**
+ * Time n_pts waypoints q, the first being the start.
+ *
+ * Returns nonzero if a limit is not positive or the path cannot be
+ * timed.
+ */
+int pir_trajq_path_gen( struct pir_trajq_path *T, aa_mem_region_t *reg,
+                        size_t n_q, size_t n_pts, const double *q,
+                        const double *dq_max, const double *ddq_max );
+
+/**
+ * Duration of the path, including t_scale.
+ */
+double pir_trajq_path_t_f( const struct pir_trajq_path *T );
+
+/**
+ * Returns nonzero when t is past the end.
+ */
+int pir_trajq_path_get( struct pir_trajq_path *T, double t,
+                        double *q, double *dq );
+
+
+/*------ CARTESIAN TRAJECTORY TIMING --------*/
+
+#define PIR_TRAJX_V_MAX   .2      ///< default Cartesian speed limit, m/s
+#define PIR_TRAJX_W_MAX   .8      ///< default Cartesian angular speed limit, rad/s
+
+/**
+ * Spline through n_pts poses S with segment durations dt[i] (dt[0] is
+ * unused).
+ */
+struct rfx_trajx_seg_list *
+pir_trajx_spline( aa_mem_region_t *reg, size_t n_pts, const double *S, const double *dt );
+
+/**
+ * Spline through n_pts poses S, the first being the start, and time
+ * every segment with dt[i] <= 0 (dt[0] is unused).
+ *
+ * The spline is followed through the arm's inverse kinematics from
+ * q0, and each automatic segment is scaled until its peak joint
+ * speed reaches dq_max or its peak Cartesian speed reaches x_max,
+ * linear then angular, or the PIR_TRAJX limits when x_max is NULL.
+ * dt holds the final timing.
+ */
+struct rfx_trajx_seg_list *
+pir_trajx_gen_auto( aa_mem_region_t *reg, int side,
+                    const double q0[7], const double See[8],
+                    size_t n_pts, const double *S, double *dt,
+                    const double dq_max[7], const double x_max[2] );
+
+
 struct pir_msg {
     char mode[64];
     uint64_t salt;
@@ -213,18 +692,317 @@ struct pir_msg_complete {
     uint64_t seq_no;
 };
 
+/*------ CONTACT --------*/
+
+enum pir_contact_cause {
+    PIR_CONTACT_FORCE  = 0x1,   ///< force magnitude
+    PIR_CONTACT_TORQUE = 0x2,   ///< torque magnitude
+    PIR_CONTACT_RATE   = 0x4    ///< force rate
+};
+
+/**
+ * Contact event, sent by pirfilt when a side enters contact.
+ */
+struct pir_msg_contact {
+    uint64_t seq_no;
+    int64_t time_ns;            ///< F/T sample time
+    uint32_t sides;             ///< bit (1<<side) for each side entering contact
+    uint32_t cause[2];          ///< pir_contact_cause bits of each side
+    double F[2][6];             ///< wrench at detection
+};
+
+struct pir_contact_limits {
+    double F_max;               ///< force magnitude, N
+    double M_max;               ///< torque magnitude, Nm
+    double dF_max;              ///< force rate, N/s
+};
+
+/**
+ * Contact detector of one side.
+ */
+struct pir_contact {
+    double F[6];                ///< previous wrench
+    int64_t time_ns;            ///< previous sample time
+    int active;                 ///< currently in contact
+};
+
+/**
+ * Update detector C with a new wrench.
+ *
+ * Returns the pir_contact_cause bits when contact begins, else 0.
+ * Contact ends once all measures fall below half their limits.
+ * Zero limits are disabled.
+ */
+unsigned pir_contact_update( struct pir_contact *C, const struct pir_contact_limits *lim,
+                             const double F[6], int64_t time_ns );
+
+/*------ JOINT ANOMALIES --------*/
+
+#define PIR_ANOM_RING 256       ///< queued events, power of 2
+#define PIR_ANOM_PERSIST 5      ///< rejected samples before a jump is accepted
+
+/**
+ * One implausible joint sample.
+ */
+struct pir_anom_event {
+    int64_t time_ns;
+    uint32_t axis;
+    int32_t rejected;           ///< nonzero if the sample was discarded
+    double q_expect;            ///< position predicted from the last sample
+    double q;                   ///< reported position
+};
+
+/**
+ * Zero limits are disabled.
+ */
+struct pir_anom_limits {
+    double jump;                ///< log a deviation beyond this, rad
+    double reject;              ///< discard a deviation beyond this, rad
+};
+
+/**
+ * Per-axis jump detector with a single-producer, single-consumer
+ * event ring, so the sensor loop never blocks on logging.
+ */
+struct pir_anom {
+    struct pir_anom_limits lim;
+    uint64_t n_jump[PIR_AXIS_CNT];
+    uint64_t n_reject[PIR_AXIS_CNT];
+    uint32_t n_persist[PIR_AXIS_CNT];  ///< consecutive rejected samples
+    uint32_t accepted;                 ///< bit for each axis with an accepted jump
+    uint64_t n_lost;                   ///< events dropped on a full ring
+    struct pir_anom_event ring[PIR_ANOM_RING];
+    uint64_t head;              ///< written by the producer
+    uint64_t tail;              ///< written by the consumer
+};
+
+/**
+ * Check sample q of axis against q_expect.
+ *
+ * Returns nonzero if the sample should be discarded.  A deviation that
+ * persists for PIR_ANOM_PERSIST samples, such as a lost encoder
+ * offset, is then accepted so the axis does not stay frozen, and the
+ * axis is flagged in A->accepted until pir_anom_reset.
+ */
+int pir_anom_check( struct pir_anom *A, int64_t time_ns, size_t axis,
+                    double q_expect, double q );
+
+/**
+ * Clear the accepted flags once the axes have been checked.
+ */
+void pir_anom_reset( struct pir_anom *A );
+
+/**
+ * Take the oldest event, returns zero when there is none.
+ */
+int pir_anom_pop( struct pir_anom *A, struct pir_anom_event *e );
+
+/*------ PAYLOAD --------*/
+
+/**
+ * Rigid body hanging from an F/T sensor.
+ */
+struct pir_payload_body {
+    double mass;                ///< kg
+    double com[3];              ///< center of mass in the F/T frame, m
+};
+
+/**
+ * Everything one F/T sensor carries.
+ */
+struct pir_payload {
+    struct pir_payload_body hand;    ///< F/T flange and SDH
+    struct pir_payload_body object;  ///< grasped object, zero mass when empty
+    double bias[6];                  ///< residual sensor offset, F/T frame
+};
+
+enum pir_payload_part {
+    PIR_PAYLOAD_HAND   = 0x1,
+    PIR_PAYLOAD_OBJECT = 0x2,
+    PIR_PAYLOAD_BIAS   = 0x4,
+    PIR_PAYLOAD_IDENT  = 0x8    ///< identify hand and bias from motion
+};
+
+/**
+ * Payload change, read by pirfilt from the pir-payload channel.
+ */
+struct pir_msg_payload {
+    uint32_t sides;             ///< bit (1<<side) for each side to change
+    uint32_t parts;             ///< pir_payload_part bits to change
+    struct pir_payload payload[2];
+};
+
+/**
+ * The hand alone: F/T flange and SDH weight at the sensor origin.
+ */
+void pir_payload_default( struct pir_payload *P );
+
+/**
+ * Apply the parts of msg to P.
+ */
+void pir_payload_set( struct pir_payload P[2], const struct pir_msg_payload *msg );
+
+/**
+ * Expected wrench of the payloads, for both sides, with F/T frame
+ * rotations r_ft.
+ *
+ * W is in the F/T frame with the sign of the F/T driver, suitable
+ * for biasing the sensor.
+ */
+void pir_payload_wrench( const struct pir_payload P[2], double r_ft[2][4],
+                         double W[2][6] );
+
+/**
+ * Compensate raw wrenches F_raw for bias and payload gravity, giving
+ * the external wrench F in the base frame.
+ */
+void pir_payload_comp( const struct pir_payload P[2], double r_ft[2][4],
+                       double F_raw[2][6], double F[2][6] );
+
+/*------ PAYLOAD IDENTIFICATION --------*/
+
+#define PIR_FTID_P0  1e6        ///< initial covariance
+#define PIR_FTID_TOL 1e-3       ///< converged once every covariance is below this
+#define PIR_FTID_MIN 500        ///< fewest samples before converging
+
+/**
+ * Recursive least-squares estimate of one sensor's bias and payload.
+ *
+ * Force and torque separate into two linear problems, each updated
+ * one scalar row at a time, so a sample costs constant time.
+ */
+struct pir_ftid {
+    double theta_f[4];          ///< force bias, mass
+    double P_f[4*4];
+    double theta_t[6];          ///< torque bias, first moment of mass
+    double P_t[6*6];
+    uint64_t n;                 ///< samples taken
+};
+
+void pir_ftid_init( struct pir_ftid *E );
+
+/**
+ * Add raw wrench F_raw taken at F/T frame rotation r_ft.
+ */
+void pir_ftid_update( struct pir_ftid *E, const double r_ft[4], const double F_raw[6] );
+
+/**
+ * Nonzero once the motion so far has determined every parameter.
+ */
+int pir_ftid_converged( const struct pir_ftid *E );
+
+/**
+ * Identified payload B and sensor bias.
+ */
+void pir_ftid_get( const struct pir_ftid *E, struct pir_payload_body *B, double bias[6] );
+
 struct pir_mode_desc;
 struct pir_mode;
 
+/*------ MODE DATA --------*/
+
+#define PIR_MODE_DATA_CNT 4
+
+/**
+ * Ownership of a mode data buffer.
+ *
+ * FREE, ACTIVE, and DONE buffers belong to the control thread, BUSY
+ * buffers to the generator thread.  REQ buffers are claimed by
+ * whichever thread first swaps the status.
+ */
+enum pir_mode_data_status {
+    PIR_MD_FREE,
+    PIR_MD_REQ,
+    PIR_MD_BUSY,
+    PIR_MD_DONE,
+    PIR_MD_ACTIVE
+};
+
+struct pir_mode_data {
+    int status;                  ///< enum pir_mode_data_status, atomic
+    uint64_t seq;                ///< request sequence number
+    int result;                  ///< generator result
+
+    struct pir_mode_desc *desc;  ///< requested mode
+    struct pir_msg *msg;         ///< copy of the request
+    size_t msg_size;             ///< allocated size of msg
+    struct pir_state X;          ///< state when the request arrived
+    double dq_max[PIR_AXIS_CNT];  ///< controller limits when the request arrived
+    double ddq_max[PIR_AXIS_CNT];
+
+    aa_mem_region_t reg;
+    void *mode_cx;
+};
+
+/*------ QP --------*/
+
+#define PIR_QP_MAX 15
+#define PIR_QP_WARN_NS (1000 * 1000 * 1000)  ///< shortest gap between iteration limit warnings
+
+/**
+ * Velocity solver used by workspace modes.
+ */
+enum pir_ctrl_backend {
+    PIR_BACKEND_DLS = 0,        ///< damped least squares (reflex)
+    PIR_BACKEND_QP              ///< box QP with hard joint limits
+};
+
+/**
+ * Warm start for the box QP, kept across control cycles.
+ */
+struct pir_qp_ws {
+    int8_t active[PIR_QP_MAX];  ///< -1 at lower, 1 at upper bound, 0 free
+    double dq[PIR_QP_MAX];      ///< last solution
+    int64_t t_warn;             ///< last iteration limit warning
+    unsigned long n_quiet;      ///< iteration limits since t_warn
+};
+
+/*--- Kinematic History ---*/
+
+#define PIR_HIST_MAX 128    ///< snapshots kept, half a second at 250 Hz
+
+/**
+ * Wrist poses at one control tick.
+ */
+struct pir_hist_snap {
+    int64_t t_ns;
+    double bEw[2][7];
+};
+
+/**
+ * Ring buffer of recent wrist poses, to match registrations to the
+ * kinematics at their capture time.
+ */
+struct pir_hist {
+    struct pir_hist_snap snap[PIR_HIST_MAX];
+    size_t i;   ///< newest snapshot
+    size_t n;   ///< snapshot count
+};
+
+/**
+ * Record the wrist poses from tf_abs at t_ns.
+ */
+void pir_hist_push( struct pir_hist *H, int64_t t_ns, const double *tf_abs );
+
+/**
+ * Wrist pose of side nearest to t_ns.
+ *
+ * Returns -1 if t_ns is older than the history.
+ */
+int pir_hist_get( const struct pir_hist *H, int64_t t_ns, int side, double bEw[7] );
+
 #define JS_AXES 8
 typedef struct {
     ach_channel_t chan_js;
     ach_channel_t chan_ref_torso;
     ach_channel_t chan_ref_left;
     ach_channel_t chan_ref_right;
+    int64_t ref_ns[3];             ///< last ref put on torso, left, right
     ach_channel_t chan_state_pir;
     ach_channel_t chan_ctrl;
     ach_channel_t chan_complete;
+    ach_channel_t chan_contact;
+    int contact_hold;              ///< on contact, hold compliantly instead of halting
     ach_channel_t chan_config;
     ach_channel_t chan_reg;
 
@@ -251,20 +1029,31 @@ typedef struct {
     double *tf_abs;
     double bEc[7];
 
+    struct pir_shm *shm;
+    uint64_t shm_gen[PIR_SHM_FIELD_CNT];
+
+    struct pir_state_msg *msg_state;
+    int64_t state_time_ns[PIR_STATE_SEC_CNT];   ///< source time of each section
+    struct pir_health health;                   ///< newest source health from pirfilt
+
     double *bEc2;
     size_t n_bEc2;
 
     double lElp[7];
     double rErp[7];
 
+    struct pir_hist hist;
+
     struct pir_mode_desc *mode;
-    void *mode_cx;
     struct timespec t0;
-    aa_mem_region_t modereg;
-    struct rfx_trajx_seg_list *trajx_segs;
 
-    rfx_trajq_t *trajq;
-    struct rfx_trajq_seg_list *trajq_segs;
+    struct pir_mode_data md_buf[PIR_MODE_DATA_CNT];
+    struct pir_mode_data *md;       ///< data of the running mode
+    struct pir_mode_data *md_init;  ///< data for a synchronous init
+
+    uint64_t gen_seq;               ///< latest generator request
+    sem_t gen_sem;
+    pthread_t gen_thread;
 
     struct timespec now;
     rfx_ctrl_t G[2];
@@ -276,6 +1065,11 @@ typedef struct {
     rfx_ctrlq_lin_k_t Kq_T;
     double q_min[PIR_AXIS_CNT];
     double q_max[PIR_AXIS_CNT];
+    double dq_max[PIR_AXIS_CNT];
+    double ddq_max[PIR_AXIS_CNT];
+
+    struct pir_qp_ws qp[2];
+    struct pir_qp_ws qp_body;
 
     double sint;
 
@@ -289,14 +1083,67 @@ static inline double *pir_tfa( pirctrl_cx_t *cx, size_t i ) {
 typedef void (*pir_mode_run_fun_t)( pirctrl_cx_t *);
 typedef int (*pir_mode_init_fun_t)(pirctrl_cx_t *, struct pir_msg *);
 typedef int (*pir_mode_terminate_fun_t)(pirctrl_cx_t *);
+/**
+ * Generate mode data off the control thread.
+ *
+ * Only md->msg and md->X may be read, and only md may be written.
+ */
+typedef int (*pir_mode_gen_fun_t)(struct pir_mode_data *md);
 
 struct pir_mode_desc {
     const char *name;
     pir_mode_init_fun_t init;
     pir_mode_run_fun_t run;
     pir_mode_terminate_fun_t term;
+    pir_mode_gen_fun_t gen;
+    unsigned state_fields;      ///< shared state fields used, 0 for all; config is always read
+    enum pir_ctrl_backend backend;
+    unsigned wake_sections;     ///< state sections that also run the mode between ticks
+    unsigned sources;           ///< PIR_SRC bits the mode reads or commands, held if stale
+    pir_mode_init_fun_t append; ///< extends the running mode's data instead of init
 };
 
+void pir_modegen_start( pirctrl_cx_t *cx );
+void pir_modegen_stop( pirctrl_cx_t *cx );
+
+/**
+ * Return a free mode data buffer with a released region.
+ */
+struct pir_mode_data *pir_modegen_take( pirctrl_cx_t *cx );
+
+/**
+ * Make md the data of the running mode.
+ */
+void pir_modegen_activate( pirctrl_cx_t *cx, struct pir_mode_data *md );
+
+/**
+ * Queue mode generation, superseding any earlier request.
+ */
+int pir_modegen_submit( pirctrl_cx_t *cx, struct pir_mode_desc *desc,
+                        const struct pir_msg *msg, size_t size );
+
+/**
+ * Swap in finished mode data.  Call once per control cycle.
+ */
+void pir_modegen_poll( pirctrl_cx_t *cx );
+
+/*------ PROCESS STAGES --------*/
+
+/*
+ * pirfilt and pirctrl each parse arguments, open channels, then run
+ * until shutdown.  The fused build runs both in one process, handing
+ * state from the pirfilt thread to pirctrl through shm without
+ * mapping it.  A NULL shm keeps each program's own -s behavior.
+ */
+
+void pirfilt_args( int argc, char **argv );
+void pirfilt_init( struct pir_shm *shm );
+void *pirfilt_run( void *arg );
+
+void pirctrl_args( int argc, char **argv );
+void pirctrl_init( struct pir_shm *shm );
+void pirctrl_run( void );
+
 /* struct pir_mode { */
 /*     struct pir_mode_desc *desc; */
 /*     // more data */
@@ -309,20 +1156,34 @@ int set_mode_k_pt(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
 int set_mode_k_pr(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
 int set_mode_k_q(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
 int set_mode_k_f(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
+/**
+ * Set dq_max or ddq_max, for every axis but the torso from one value
+ * or for each axis from PIR_AXIS_CNT values.
+ */
+int set_mode_lim_dq(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
+int set_mode_lim_ddq(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
 int set_mode_cpy(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
 int set_mode_ws_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
 int set_mode_ws_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
 int set_mode_ws_left_finger(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
 int set_mode_ws_right_finger(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
 int set_mode_sin(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
-int set_mode_trajx_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
-int set_mode_trajx_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
-int set_mode_trajx_w_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
-int set_mode_trajx_w_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
-int set_mode_trajq_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
-int set_mode_trajq_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
-int set_mode_trajq_lr(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
-int set_mode_trajq_torso(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
+int gen_mode_trajx_left( struct pir_mode_data *md );
+int gen_mode_trajx_right( struct pir_mode_data *md );
+int gen_mode_trajx_w_left( struct pir_mode_data *md );
+int gen_mode_trajx_w_right( struct pir_mode_data *md );
+int set_mode_trajx_stream_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
+int set_mode_trajx_stream_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
+int set_mode_trajx_append_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
+int set_mode_trajx_append_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
+int gen_mode_trajq_left( struct pir_mode_data *md );
+int gen_mode_trajq_right( struct pir_mode_data *md );
+int gen_mode_trajq_lr( struct pir_mode_data *md );
+int gen_mode_trajq_torso( struct pir_mode_data *md );
+int gen_mode_trajq_topt_left( struct pir_mode_data *md );
+int gen_mode_trajq_topt_right( struct pir_mode_data *md );
+int gen_mode_trajq_topt_lr( struct pir_mode_data *md );
+int gen_mode_trajq_topt_torso( struct pir_mode_data *md );
 
 
 // all the different control modes
@@ -342,19 +1203,75 @@ void ctrl_trajx_left( pirctrl_cx_t *cx );
 void ctrl_trajx_right( pirctrl_cx_t *cx );
 void ctrl_trajx_w_left( pirctrl_cx_t *cx );
 void ctrl_trajx_w_right( pirctrl_cx_t *cx );
+void ctrl_trajx_stream_left( pirctrl_cx_t *cx );
+void ctrl_trajx_stream_right( pirctrl_cx_t *cx );
 void ctrl_trajq_left( pirctrl_cx_t *cx );
 void ctrl_trajq_right( pirctrl_cx_t *cx );
 void ctrl_trajq_lr( pirctrl_cx_t *cx );
 void ctrl_trajq_torso( pirctrl_cx_t *cx );
+void ctrl_trajq_topt_left( pirctrl_cx_t *cx );
+void ctrl_trajq_topt_right( pirctrl_cx_t *cx );
+void ctrl_trajq_topt_lr( pirctrl_cx_t *cx );
+void ctrl_trajq_topt_torso( pirctrl_cx_t *cx );
+
+/**
+ * Track pose S_traj with twist dx, given at the end-effector when eer
+ * is set and at the wrist otherwise.
+ */
+void ctrl_trajx_ref( pirctrl_cx_t *cx, int side, int eer,
+                     const double S_traj[8], const double dx[6] );
+
+/**
+ * Report completion of the current command.
+ */
+void pir_complete( pirctrl_cx_t *cx );
 
 struct servo_cam_cx {
     double cEo[7];
     double bEe[7];
 };
+
+/*--- Online Trajectory Generation ---*/
+
+#define PIR_OTG_OMEGA       10.0   ///< filter bandwidth, rad/s
+#define PIR_OTG_A_MAX       1.0    ///< translational acceleration limit, m/s^2
+#define PIR_OTG_ALPHA_MAX   4.0    ///< rotational acceleration limit, rad/s^2
+#define PIR_OTG_J_MAX       10.0   ///< translational jerk limit, m/s^3
+
+/**
+ * Jerk-limited second-order filter of a pose target.
+ *
+ * Velocity limits are PIR_TRAJX_V_MAX and PIR_TRAJX_W_MAX.
+ */
+struct pir_otg {
+    double E[7];    ///< filtered pose, quaternion-translation
+    double dx[6];   ///< filtered twist
+    double ddx[6];  ///< filtered acceleration
+};
+
+/**
+ * Start the filter at rest at E.
+ */
+void pir_otg_init( struct pir_otg *O, const double E[7] );
+
+/**
+ * Advance the filter by dt toward E_ref, constant time.
+ */
+void pir_otg_step( struct pir_otg *O, const double E_ref[7], double dt );
+
+struct servo_cam_mode {
+    struct servo_cam_cx p;
+    struct pir_otg otg;
+    int started;
+};
 int set_mode_servo_cam(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
 void ctrl_servo_cam( pirctrl_cx_t *cx );
 
 
+int gen_mode_bisplend( struct pir_mode_data *md );
+int gen_mode_bisplend_rel( struct pir_mode_data *md );
+void ctrl_bisplend( pirctrl_cx_t *cx );
+
 struct biservo_rel_cx {
     double rElt[7];
     double b_q_lt[4];
@@ -363,6 +1280,91 @@ int set_mode_biservo_rel(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
 void ctrl_biservo_rel( pirctrl_cx_t *cx );
 
 
+/**
+ * Twist toward S_ref: dx = dx_ref + k * error.
+ *
+ * dx_ref may be NULL.
+ */
+void pir_ctrl_pose_twist( const double S_act[8], const double S_ref[8],
+                          const double dx_ref[6], const double k[6],
+                          double dx[6] );
+
+/**
+ * Damped least squares for both wrists and the torso.
+ *
+ * J are the arm Jacobians and t the torso columns of both wrist
+ * tasks, all in the base frame.  dq is left arm, right arm, torso.
+ */
+int pir_body_solve( const double J[2][6*7], const double t[12], double k,
+                    const double dx[12], double dq[15] );
+
+/**
+ * Solve min 1/2 x'Hx - g'x subject to lb <= x <= ub.
+ *
+ * H is n*n column major and positive definite.  Primal-dual active
+ * set, started from and updating the bound set in active.
+ *
+ * Returns 0 when solved, 1 when x was clamped after the iteration
+ * limit, and -1 on factorization failure.
+ */
+int pir_qp_box( size_t n, const double *H, const double *g,
+                const double *lb, const double *ub,
+                int8_t *active, double *x );
+
+/**
+ * Velocity bounds on one axis from the position, velocity, and
+ * acceleration limits, given the last commanded velocity.
+ */
+void pir_qp_bound( pirctrl_cx_t *cx, size_t axis, double dq_prev,
+                   double *lb, double *ub );
+
+/**
+ * Reset the QP warm starts to the measured velocities.
+ */
+void pir_qp_reset( pirctrl_cx_t *cx );
+
+/**
+ * Note that a QP stopped at its iteration limit, warning at most once
+ * per PIR_QP_WARN_NS.
+ */
+void pir_qp_warn_limit( pirctrl_cx_t *cx, struct pir_qp_ws *W, const char *name );
+
+/**
+ * Workspace velocity control of one arm toward G[side].ref with the
+ * backend of the current mode.
+ */
+int pir_ctrl_ws( pirctrl_cx_t *cx, int side );
+
+struct body_cx {
+    double S[2][8];     ///< fingertip targets, torso frame on the wire, base frame once set
+};
+int set_mode_body(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
+void ctrl_body( pirctrl_cx_t *cx );
+
+
+/**
+ * Admittance command, one value per twist axis.
+ */
+struct pir_admit_param {
+    double sel[6];      ///< nonzero for force, zero for position control
+    double F_ref[6];    ///< desired measured wrench
+    double M[6];        ///< virtual mass
+    double B[6];        ///< virtual damping
+};
+
+struct admit_cx {
+    struct pir_admit_param p;
+    double v[2][6];     ///< admittance velocity of each side
+    struct timespec t;  ///< time of last step
+};
+int set_mode_admit_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
+int set_mode_admit_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
+int set_mode_admit_lr(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
+void ctrl_admit_left( pirctrl_cx_t *cx );
+void ctrl_admit_right( pirctrl_cx_t *cx );
+void ctrl_admit_lr( pirctrl_cx_t *cx );
+
+
 int sdh_pinch_left( pirctrl_cx_t *cx, struct pir_msg * );
 int sdh_pinch_right( pirctrl_cx_t *cx, struct pir_msg * );
 int sdh_set_left( pirctrl_cx_t *cx, struct pir_msg * );
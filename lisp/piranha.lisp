@@ -47,6 +47,7 @@
 (defvar *state-channel* nil)
 (defvar *config-channel* nil)
 (defvar *complete-channel* nil)
+(defvar *payload-channel* nil)
 
 (defvar *message-seq-no* 0)
 (defvar *message-salt*)
@@ -78,12 +79,14 @@
                             (vec3 (+ +lwa4-l-e+ +lwa4-ft-l+ +sdh-l-b+)
                                   0 0)))
 
-(defun pir-start ()
+(defun pir-start (&key (state-channel "pir-state"))
+  "Open channels; STATE-CHANNEL may name a decimated pirfilt stream."
   (assert (null *ctrl-channel*))
   (setq *ctrl-channel* (ach::open-channel "pir-ctrl"))
   (setq *config-channel* (ach::open-channel "pir-config"))
-  (setq *state-channel* (ach::open-channel "pir-state"))
-  (setq *complete-channel* (ach::open-channel "pir-complete")))
+  (setq *state-channel* (ach::open-channel state-channel))
+  (setq *complete-channel* (ach::open-channel "pir-complete"))
+  (setq *payload-channel* (ach::open-channel "pir-payload")))
 
 (defun pir-stop ()
   (ach::close-channel *ctrl-channel*)
@@ -101,23 +104,28 @@
   (seq-no :uint64))
 
 
-(cffi:defcstruct pir-cstate
-  (q :double :count 29)
-  (dq :double :count 29)
+;; Layout of struct pir_state_msg, see piranha.h
+(cffi:defcstruct pir-state-header
+  (version :uint32)
+  (sections :uint32)
+  (seq :uint64)
+  (health-time-ns :int64)
+  (stale :uint32)
+  (seen :uint32)
+  (anom :uint32)
+  (time-ns :int64 :count 7))
 
-  (f-l :double :count 6)
-  (f-r :double :count 6)
+(defconstant +pir-state-msg-version+ 5)
 
-  (s-l :double :count 8)
-  (s-r :double :count 8)
-
-  (j-l :double :count #.(* 7 6))
-  (j-r :double :count #.(* 7 6))
-
-  (s-eer-l :double :count 8)
-  (s-eer-r :double :count 8)
-
-  )
+;; Sections in packing order with their length in doubles
+(defparameter +pir-state-sections+
+  '((:joints . #.(* 2 29))
+    (:ft . #.(* 2 6))
+    (:wrist . #.(* 2 8))
+    (:jacobian . #.(* 2 7 6))
+    (:eer . #.(* 2 8))
+    (:est . #.(* 3 29))
+    (:twist . #.(* 2 2 6))))
 
 
 (defstruct pir-state
@@ -148,6 +156,11 @@
 
   f-l
   f-r
+
+  dx-l      ; left wrist twist
+  dx-r      ; right wrist twist
+  dx-f-l    ; left finger twist
+  dx-f-r    ; right finger twist
   )
 
 
@@ -165,50 +178,81 @@
         (ach::get-pointer *config-channel* ptr size :wait t :last t)))
     config))
 
+(defun read-state-sections (&key (want (mapcar #'car +pir-state-sections+))
+                                 (sections (make-hash-table))
+                                 (max-repeat 10))
+  "Read state messages into SECTIONS until every section in WANT has been seen.
+Reduced streams, e.g. from pirfilt -o, may never carry some sections, so
+also stop once any section has been seen MAX-REPEAT times."
+  (let* ((header-size (foreign-type-size '(:struct pir-state-header)))
+         (size (+ header-size
+                  (* 8 (reduce #'+ +pir-state-sections+ :key #'cdr))))
+         (want-mask (loop for (name) in +pir-state-sections+
+                       for i from 0
+                       when (find name want)
+                       sum (ash 1 i))))
+    (with-foreign-pointer (msg size)
+      (loop
+         with seen = 0
+         with counts = (make-array (length +pir-state-sections+) :initial-element 0)
+         for last = t then nil
+         until (or (>= (reduce #'max counts) max-repeat)
+                   (= want-mask (logand seen want-mask)))
+         do
+           (ach:get-pointer *state-channel* msg size :wait t :last last)
+           (assert (= +pir-state-msg-version+
+                      (foreign-slot-value msg '(:struct pir-state-header) 'version)))
+           (loop
+              with present = (foreign-slot-value msg '(:struct pir-state-header) 'sections)
+              with data = (inc-pointer msg header-size)
+              with offset = 0
+              for (name . n) in +pir-state-sections+
+              for i from 0
+              when (logbitp i present)
+              do (incf (aref counts i))
+                 (setf (gethash name sections) (read-doubles data n offset)
+                       seen (logior seen (ash 1 i))
+                       offset (+ offset n)))))
+    sections))
+
 (defun get-state ()
-  (with-foreign-object (state '(:struct pir-cstate))
-    (ach:get-pointer *state-channel* state (foreign-type-size '(:struct pir-cstate))
-                     :wait t :last t)
-    (labels ((extract (x n)
-               (read-doubles (foreign-slot-pointer state '(:struct pir-cstate) x) n))
-             (extract-qutr (x)
-               (quaternion-translation (dual-quaternion (extract x 8)))))
-      (let ((e-l (extract-qutr 's-l))
-            (e-r (extract-qutr 's-r))
-            (e-eer-l (extract-qutr 's-eer-l))
-            (e-eer-r (extract-qutr 's-eer-r))
-            (q (extract 'q 29)))
+  (let* ((want '(:joints :ft :wrist :eer :twist))
+         (sections (read-state-sections :want want)))
+    (dolist (name want)
+      (unless (gethash name sections)
+        (error "State stream does not carry section ~A" name)))
+    (labels ((extract (section start end)
+               (subseq (gethash section sections) start end))
+             (extract-qutr (section side)
+               (let ((start (ecase side (:left 0) (:right 8))))
+                 (quaternion-translation
+                  (dual-quaternion (extract section start (+ start 8)))))))
+      (let ((e-l (extract-qutr :wrist :left))
+            (e-r (extract-qutr :wrist :right))
+            (e-eer-l (extract-qutr :eer :left))
+            (e-eer-r (extract-qutr :eer :right))
+            (q (extract :joints 0 29)))
         (setq *state*
               (make-pir-state
                    :q q
-                   :dq (extract 'dq 29)
+                   :dq (extract :joints 29 58)
                    :q-l (amino::vec-copy q :start 1 :end 8)
                    :q-r (amino::vec-copy q :start 8 :end 15)
                    :q-sdh-l (amino::vec-copy q :start 15 :end 22)
                    :q-sdh-r (amino::vec-copy q :start 22 :end 28)
-                   :f-l (extract 'f-l 6)
-                   :f-r (extract 'f-r 6)
+                   :f-l (extract :ft 0 6)
+                   :f-r (extract :ft 6 12)
+                   :dx-l (extract :twist 0 6)
+                   :dx-r (extract :twist 6 12)
+                   :dx-f-l (extract :twist 12 18)
+                   :dx-f-r (extract :twist 18 24)
 
                    :e-l e-l
                    :e-r e-r
                    :e-eer-l e-eer-l
                    :e-eer-r e-eer-r
                    :e-f-l (g* e-l e-eer-l)
-                   :e-f-r (g* e-r e-eer-r)
-
-                   ;; :s-l s-l
-                   ;; :s-r s-r
-                   ;; :s-eer-l s-eer-l
-                   ;; :s-eer-r s-eer-r
-                   ;; :s-f-l (aa::tf-duqu-mul s-l s-eer-l)
-                   ;; :s-f-r (aa::tf-duqu-mul s-r s-eer-r)
-
-                   ;; :r-l r-l
-                   ;; :r-r r-r
-                   ;; :x-l x-l
-                   ;; :x-r x-r
-
-                   ))))))
+                   :e-f-r (g* e-r e-eer-r)))))))
 
 (defun print-state (&optional (state (get-state)))
   (labels ((print-e (name e)
@@ -265,6 +309,41 @@
            (setf (mem-aref pointer :double) x)))))
     (ach::put-pointer *ctrl-channel* msg msg-size)))
 
+;; Layout of struct pir_msg_payload, see piranha.h
+(cffi:defcstruct pir-msg-payload
+  (sides :uint32)
+  (parts :uint32)
+  (payload :double :count #.(* 2 14)))
+
+(defun pir-payload (side &key hand object bias identify)
+  "Change the payload of SIDE in pirfilt.
+HAND and OBJECT are lists (mass com-x com-y com-z) in the F/T frame,
+BIAS a sequence of 6 sensor offsets.  Omitted parts are unchanged.
+With IDENTIFY, pirfilt estimates hand and bias as the arm moves."
+  (with-foreign-object (msg '(:struct pir-msg-payload))
+    (let ((start (ecase side (:left 0) (:right 14)))
+          (x (foreign-slot-pointer msg '(:struct pir-msg-payload) 'payload))
+          (parts 0))
+      (dotimes (i (* 2 14))
+        (setf (mem-aref x :double i) 0d0))
+      (flet ((part (bit offset values)
+               (when values
+                 (setq parts (logior parts bit))
+                 (loop for v in (coerce values 'list)
+                    for i from (+ start offset)
+                    do (setf (mem-aref x :double i) (coerce v 'double-float))))))
+        (part 1 0 hand)
+        (part 2 4 object)
+        (part 4 8 bias)
+        (when identify
+          (setq parts (logior parts 8))))
+      (setf (foreign-slot-value msg '(:struct pir-msg-payload) 'sides)
+            (ecase side (:left 1) (:right 2))
+            (foreign-slot-value msg '(:struct pir-msg-payload) 'parts)
+            parts))
+    (ach::put-pointer *payload-channel* msg
+                      (foreign-type-size '(:struct pir-msg-payload)))))
+
 (defun pir-wait (&key (seq-no *message-seq-no*) (salt *message-salt*))
   (labels ((get-msg ()
              (with-foreign-object (msg '(:struct pir-message-complete))
@@ -292,7 +371,8 @@
   pose
   time)
 
-(defun trajx-point (pose time)
+(defun trajx-point (pose &optional (time 0d0))
+  "Waypoint reached TIME after the previous one; zero times it automatically."
   (make-trajx-point :pose (dual-quaternion pose)
                     :time time))
 
@@ -310,14 +390,50 @@
 
 (defun pir-go (side points &key
                (point :finger)
-               (state (get-state)))
+               (state (get-state))
+               v-max w-max)
+  "Move SIDE through POINTS.  V-MAX and W-MAX limit the linear and
+angular speed of automatically timed segments."
   (let ((thing (ecase point
                  (:finger "trajx")
                  (:wrist "trajx-w"))))
     (setq *last-traj* (append (list (trajx-point (pir-state-e-l state)
                                                  0d0))
                               points))
-    (pir-message (side-case side thing) (trajx-point-data points))))
+    (pir-message (side-case side thing)
+                 (if (or v-max w-max)
+                     (aa::veccat (aa::vec (or v-max 0d0) (or w-max 0d0))
+                                 (trajx-point-data points))
+                     (trajx-point-data points)))))
+
+(defun pir-bisplend (left-points right-points)
+  "Move both fingers through paired waypoints; times come from LEFT-POINTS."
+  (assert (= (length left-points) (length right-points)))
+  (let* ((n (length left-points))
+         (data (amino::make-vec (* 17 n))))
+    (dotimes (i n)
+      (let ((left (elt left-points i))
+            (right (elt right-points i))
+            (offset (* i 17)))
+        (setf (aref data offset) (trajx-point-time left))
+        (replace data (amino::dual-quaternion-data (trajx-point-pose left))
+                 :start1 (+ 1 offset) :end1 (+ 9 offset))
+        (replace data (amino::dual-quaternion-data (trajx-point-pose right))
+                 :start1 (+ 9 offset) :end1 (+ 17 offset))))
+    (pir-message "bisplend" data)))
+
+(defun pir-bisplend-rel (left-points e-rel)
+  "Bring the right finger to E-REL in the left, then move the left finger
+through waypoints with the right held at E-REL from it."
+  (pir-message "bisplend-rel"
+               (concatenate 'list
+                            (amino::dual-quaternion-data (dual-quaternion e-rel))
+                            (trajx-point-data left-points))))
+
+(defun pir-stream (side points &key append)
+  "Stream finger waypoints; with APPEND, extend the running stream."
+  (pir-message (side-case side (if append "trajx-append" "trajx-stream"))
+               (trajx-point-data points)))
 
 (defun pir-go-1 (side s &key (point :finger) (time 10d0))
   (pir-go side (list (trajx-point s time))
@@ -386,10 +502,13 @@
   (concatenate 'string base "-"
                (ecase side
                  (:lr "lr")
+                 (:torso "torso")
                  (:left "left")
                  (:right "right"))))
 
 (defun pir-trajq (side points)
+  "Move SIDE through the joint POINTS without stopping, as fast as the
+controller limits allow.  The sum of point times is a minimum duration."
   (pir-message (side-case side "trajq")
                (trajq-point-data points)))
 
@@ -413,8 +532,20 @@
     (pir-set side q1 :time time)))
 
 (defun pir-torso (q &key (time 10d0))
+  "Move the torso to Q under the controller limits, taking at least TIME."
   (pir-message "trajq-torso" (aa::vec time q)))
 
+(defun pir-trajq-stop (side points &key dq-max ddq-max)
+  "Move SIDE through joint POINTS, stopping at each, with every segment
+as fast as the limits allow.  DQ-MAX and DDQ-MAX are per-joint vectors;
+omitted limits use the controller's."
+  (let ((n (length (car points))))
+    (pir-message (side-case side "trajq-stop")
+                 (apply #'aa::veccat
+                        (or dq-max (amino::make-vec n))
+                        (or ddq-max (amino::make-vec n))
+                        points))))
+
 (defun pir-sdh-set (side q)
   (check-type q (simple-array double-float (7)))
   (pir-message (side-case side "sdh-set")
@@ -556,3 +687,30 @@
   (pir-message "servo-cam"
                (aa::veccat (aa::vec-array e-obj)
                            (aa::vec-array e-e))))
+
+(defun pir-limits (&key dq ddq)
+  "Set joint velocity and acceleration limits.
+Each is a number for every axis but the torso, or a vector with one
+value per axis."
+  (flet ((send (mode x)
+           (when x
+             (pir-message mode (if (numberp x) (aa::vec x) x)))))
+    (send "lim-dq" dq)
+    (send "lim-ddq" ddq)))
+
+(defun pir-body (e-left e-right)
+  "Servo both fingertips to poses in the frame GET-STATE reports using arms and torso."
+  (pir-message "ws-body"
+               (aa::veccat (amino::dual-quaternion-data (dual-quaternion e-left))
+                           (amino::dual-quaternion-data (dual-quaternion e-right)))))
+
+(defun pir-admit (side &key
+                         (select (aa::vec 0 0 0 0 0 0))
+                         (force (aa::vec 0 0 0 0 0 0))
+                         (mass (aa::vec 1 1 1 .1 .1 .1))
+                         (damping (aa::vec 50 50 50 5 5 5)))
+  "Admittance control of SIDE.
+Nonzero SELECT axes yield to the measured wrench and settle at FORCE;
+the others hold the current pose."
+  (pir-message (side-case side "admit")
+               (aa::veccat select force mass damping)))
@@ -0,0 +1,102 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <amino.h>
+#include <ach.h>
+#include "piranha.h"
+
+/*
+ * Fading-memory alpha-beta-gamma filter, one per axis, stored as
+ * arrays so each step is one branch-free loop over all axes that the
+ * compiler vectorizes.  Axes without a new sample keep their state.
+ * The gains follow from PIR_ABG_THETA:
+ *
+ *      alpha = 1 - theta^3
+ *      beta  = 1.5 (1 - theta^2) (1 - theta)
+ *      gamma = 0.5 (1 - theta)^3
+ */
+
+#define ABG_T    (PIR_ABG_THETA)
+#define ABG_A    (1 - ABG_T*ABG_T*ABG_T)
+#define ABG_B    (1.5 * (1 - ABG_T*ABG_T) * (1 - ABG_T))
+#define ABG_G    (0.5 * (1 - ABG_T) * (1 - ABG_T) * (1 - ABG_T))
+
+void pir_abg_update( struct pir_abg *E, const double *z_q, const double *z_dq,
+                     const int64_t *z_t_ns )
+{
+    for( size_t i = 0; i < PIR_AXIS_CNT; i ++ ) {
+        double dt = (double)(z_t_ns[i] - E->t_ns[i]) / 1e9;
+        int fresh = dt > 0;
+        // (re)start from the raw sample after a gap
+        int start = fresh && !(dt < PIR_ABG_GAP);
+        dt = fresh ? dt : 1;
+
+        // predict
+        double q = E->q[i] + dt*E->dq[i] + .5*dt*dt*E->ddq[i];
+        double dq = E->dq[i] + dt*E->ddq[i];
+        double ddq = E->ddq[i];
+
+        // correct
+        double r = z_q[i] - q;
+        q += ABG_A * r;
+        dq += ABG_B / dt * r;
+        ddq += 2 * ABG_G / (dt*dt) * r;
+
+        E->q[i] = start ? z_q[i] : (fresh ? q : E->q[i]);
+        E->dq[i] = start ? z_dq[i] : (fresh ? dq : E->dq[i]);
+        E->ddq[i] = start ? 0 : (fresh ? ddq : E->ddq[i]);
+        E->t_ns[i] = fresh ? z_t_ns[i] : E->t_ns[i];
+    }
+}
+
+void pir_abg_get( const struct pir_abg *E, int64_t t_ns, struct pir_joint_est *X )
+{
+    for( size_t i = 0; i < PIR_AXIS_CNT; i ++ ) {
+        double dt = AA_MIN( PIR_ABG_GAP, (double)(t_ns - E->t_ns[i]) / 1e9 );
+        X->q[i] = E->q[i] + dt*E->dq[i] + .5*dt*dt*E->ddq[i];
+        X->dq[i] = E->dq[i] + dt*E->ddq[i];
+        X->ddq[i] = E->ddq[i];
+    }
+}
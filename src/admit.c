@@ -0,0 +1,149 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <syslog.h>
+#include <sns.h>
+#include <amino.h>
+#include <reflex.h>
+#include "piranha.h"
+
+/*
+ * Admittance control of one or both wrists.
+ *
+ * Selected axes follow the virtual mass-damper
+ *
+ *      M dv + B v = F - F_ref
+ *
+ * driven by the measured wrench, so they yield to contact and settle
+ * where the measured wrench equals F_ref.  The admittance velocity
+ * moves the pose reference, which the workspace controller tracks, and
+ * the remaining axes hold the pose at mode start.  The mode wakes on
+ * each F/T section, so the reference reacts to one sensor sample
+ * rather than the next control tick.
+ */
+
+/* Limit on the admittance velocity, m/s and rad/s */
+#define ADMIT_V_MAX   .1
+#define ADMIT_W_MAX   .5
+
+static int set_mode_admit( pirctrl_cx_t *cx, struct pir_msg *msg_ctrl )
+{
+    if( msg_ctrl->n*sizeof(double) != sizeof(struct pir_admit_param) ) return -1;
+
+    struct admit_cx *A = AA_MEM_REGION_NEW( &cx->md_init->reg, struct admit_cx );
+    memset( A, 0, sizeof(*A) );
+    memcpy( &A->p, &msg_ctrl->x[0].f, sizeof(A->p) );
+    for( size_t i = 0; i < 6; i ++ ) {
+        if( A->p.sel[i] && !(A->p.M[i] > 0 && A->p.B[i] >= 0) ) {
+            SNS_LOG( LOG_ERR, "Invalid admittance on axis %zu\n", i );
+            return -1;
+        }
+    }
+    A->t = cx->now;
+    cx->md_init->mode_cx = A;
+
+    pir_zero_refs(cx);
+    return 0;
+}
+
+int set_mode_admit_left( pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
+    return set_mode_admit( cx, msg_ctrl );
+}
+
+int set_mode_admit_right( pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
+    return set_mode_admit( cx, msg_ctrl );
+}
+
+int set_mode_admit_lr( pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
+    return set_mode_admit( cx, msg_ctrl );
+}
+
+static void ctrl_admit_side( pirctrl_cx_t *cx, struct admit_cx *A, int side, double dt )
+{
+    rfx_ctrl_ws_t *G = &cx->G[side];
+    double *v = A->v[side];
+
+    for( size_t i = 0; i < 6; i ++ ) {
+        if( A->p.sel[i] ) {
+            // implicit Euler on the mass-damper
+            double e = cx->state.F[side][i] - A->p.F_ref[i];
+            double v_i = ( A->p.M[i] * v[i] + dt * e ) / ( A->p.M[i] + dt * A->p.B[i] );
+            double v_max = (i < 3) ? ADMIT_V_MAX : ADMIT_W_MAX;
+            v[i] = AA_MAX( -v_max, AA_MIN( v_max, v_i ) );
+        } else {
+            v[i] = 0;
+        }
+    }
+
+    AA_MEM_CPY( G->ref.dx, v, 6 );
+    pir_ctrl_ws( cx, side );
+    rfx_ctrl_ws_sdx( G, dt );
+}
+
+static void ctrl_admit( pirctrl_cx_t *cx, unsigned sides )
+{
+    struct admit_cx *A = (struct admit_cx*)cx->md->mode_cx;
+
+    // sub-tick steps are shorter than cx->dt, never integrate over a gap
+    double dt = aa_tm_timespec2sec( aa_tm_sub( cx->now, A->t ) );
+    dt = AA_MAX( 0, AA_MIN( dt, 2*cx->dt ) );
+    A->t = cx->now;
+
+    for( int side = 0; side < 2; side ++ ) {
+        if( sides & (1u << side) ) ctrl_admit_side( cx, A, side, dt );
+    }
+}
+
+void ctrl_admit_left( pirctrl_cx_t *cx ) {
+    ctrl_admit( cx, 1u << PIR_LEFT );
+}
+
+void ctrl_admit_right( pirctrl_cx_t *cx ) {
+    ctrl_admit( cx, 1u << PIR_RIGHT );
+}
+
+void ctrl_admit_lr( pirctrl_cx_t *cx ) {
+    ctrl_admit( cx, (1u << PIR_LEFT) | (1u << PIR_RIGHT) );
+}
@@ -0,0 +1,99 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <amino.h>
+#include <ach.h>
+#include "piranha.h"
+
+static void anom_push( struct pir_anom *A, const struct pir_anom_event *e )
+{
+    uint64_t head = A->head;
+    if( head - __atomic_load_n( &A->tail, __ATOMIC_ACQUIRE ) >= PIR_ANOM_RING ) {
+        __atomic_fetch_add( &A->n_lost, 1, __ATOMIC_RELAXED );
+        return;
+    }
+    A->ring[head % PIR_ANOM_RING] = *e;
+    __atomic_store_n( &A->head, head + 1, __ATOMIC_RELEASE );
+}
+
+int pir_anom_check( struct pir_anom *A, int64_t time_ns, size_t axis,
+                    double q_expect, double q )
+{
+    double d = fabs( q - q_expect );
+    int jump = A->lim.jump > 0 && d > A->lim.jump;
+    int reject = A->lim.reject > 0 && d > A->lim.reject &&
+        A->n_persist[axis] < PIR_ANOM_PERSIST;
+
+    if( !reject && A->lim.reject > 0 && d > A->lim.reject ) {
+        A->accepted |= 1u << axis;
+    }
+    A->n_persist[axis] = reject ? A->n_persist[axis] + 1 : 0;
+    if( !jump && !reject ) return 0;
+
+    if( jump ) A->n_jump[axis]++;
+    if( reject ) A->n_reject[axis]++;
+
+    struct pir_anom_event e = { .time_ns = time_ns,
+                                .axis = (uint32_t)axis,
+                                .rejected = reject,
+                                .q_expect = q_expect,
+                                .q = q };
+    anom_push( A, &e );
+    return reject;
+}
+
+void pir_anom_reset( struct pir_anom *A )
+{
+    A->accepted = 0;
+}
+
+int pir_anom_pop( struct pir_anom *A, struct pir_anom_event *e )
+{
+    uint64_t tail = A->tail;
+    if( tail == __atomic_load_n( &A->head, __ATOMIC_ACQUIRE ) ) return 0;
+    *e = A->ring[tail % PIR_ANOM_RING];
+    __atomic_store_n( &A->tail, tail + 1, __ATOMIC_RELEASE );
+    return 1;
+}
@@ -0,0 +1,283 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <argp.h>
+#include <syslog.h>
+#include <sns.h>
+#include <inttypes.h>
+#include <amino.h>
+#include <reflex.h>
+#include "piranha.h"
+
+/*
+ * Whole-body workspace control.
+ *
+ * Both wrists are controlled in the base frame, which is the torso
+ * frame at zero torso angle.  Targets arrive in the torso frame and
+ * are moved to the base frame when the mode starts.  The torso rotates the arm bases about
+ * the base z axis, so the stacked 12x15 Jacobian is
+ *
+ *      [ J_l   0    t_l ]
+ *      [ 0     J_r  t_r ]
+ *
+ * with the 6x7 arm Jacobians rotated into the base frame and the
+ * torso column t = [ z x p ; z ] for wrist position p.  The damped
+ * least squares solution needs (J J' + k I)^{-1}, and J J' is block
+ * diagonal plus the rank one term t t', so two 6x6 Cholesky factors
+ * and a Sherman-Morrison update replace a dense 12x12 solve.
+ */
+
+static const double torso_axis[3] = {0,0,1};
+
+void pir_ctrl_pose_twist( const double S_act[8], const double S_ref[8],
+                          const double dx_ref[6], const double k[6],
+                          double dx[6] )
+{
+    double q_act[4], v_act[3], q_ref[4], v_ref[3];
+    aa_tf_duqu2qv( S_act, q_act, v_act );
+    aa_tf_duqu2qv( S_ref, q_ref, v_ref );
+
+    // rotation error in the base frame
+    double q_err[4], w_err[3];
+    aa_tf_qmulc( q_ref, q_act, q_err );
+    aa_tf_qminimize( q_err );
+    aa_tf_quat2rotvec( q_err, w_err );
+
+    for( size_t i = 0; i < 3; i ++ ) {
+        dx[i]   = (dx_ref ? dx_ref[i]   : 0) + k[i]   * (v_ref[i] - v_act[i]);
+        dx[3+i] = (dx_ref ? dx_ref[3+i] : 0) + k[3+i] * w_err[i];
+    }
+}
+
+/* In-place Cholesky factor of symmetric positive definite 6x6 A */
+static int chol6( double A[36] ) {
+    for( size_t j = 0; j < 6; j ++ ) {
+        double d = AA_MATREF(A,6,j,j);
+        for( size_t k = 0; k < j; k ++ ) d -= AA_MATREF(A,6,j,k) * AA_MATREF(A,6,j,k);
+        if( !(d > 0) ) return -1;
+        d = sqrt(d);
+        AA_MATREF(A,6,j,j) = d;
+        for( size_t i = j+1; i < 6; i ++ ) {
+            double s = AA_MATREF(A,6,i,j);
+            for( size_t k = 0; k < j; k ++ ) s -= AA_MATREF(A,6,i,k) * AA_MATREF(A,6,j,k);
+            AA_MATREF(A,6,i,j) = s / d;
+        }
+    }
+    return 0;
+}
+
+/* Solve L L' x = b with the factor from chol6 */
+static void chol6_solve( const double L[36], const double b[6], double x[6] ) {
+    for( size_t i = 0; i < 6; i ++ ) {
+        double s = b[i];
+        for( size_t k = 0; k < i; k ++ ) s -= AA_MATREF(L,6,i,k) * x[k];
+        x[i] = s / AA_MATREF(L,6,i,i);
+    }
+    for( size_t i = 6; i-- > 0; ) {
+        double s = x[i];
+        for( size_t k = i+1; k < 6; k ++ ) s -= AA_MATREF(L,6,k,i) * x[k];
+        x[i] = s / AA_MATREF(L,6,i,i);
+    }
+}
+
+int pir_body_solve( const double J[2][6*7], const double t[12], double k,
+                    const double dx[12], double dq[15] )
+{
+    // D = blockdiag( J_l J_l' + k I, J_r J_r' + k I )
+    double L[2][36];
+    double u[12], v[12];
+    for( size_t side = 0; side < 2; side ++ ) {
+        const double *Js = J[side];
+        double *A = L[side];
+        for( size_t i = 0; i < 6; i ++ ) {
+            for( size_t j = 0; j <= i; j ++ ) {
+                double s = (i == j) ? k : 0;
+                for( size_t c = 0; c < 7; c ++ )
+                    s += AA_MATREF(Js,6,i,c) * AA_MATREF(Js,6,j,c);
+                AA_MATREF(A,6,i,j) = s;
+            }
+        }
+        if( chol6(A) ) return -1;
+        chol6_solve( A, dx + 6*side, u + 6*side );   // u = D^{-1} dx
+        chol6_solve( A, t + 6*side, v + 6*side );    // v = D^{-1} t
+    }
+
+    // y = (D + t t')^{-1} dx = u - v (t'u) / (1 + t'v)
+    double tu = aa_la_dot( 12, t, u );
+    double tv = aa_la_dot( 12, t, v );
+    double y[12];
+    for( size_t i = 0; i < 12; i ++ ) y[i] = u[i] - v[i] * tu / (1 + tv);
+
+    // dq = J' y
+    for( size_t side = 0; side < 2; side ++ ) {
+        for( size_t c = 0; c < 7; c ++ ) {
+            dq[7*side + c] = aa_la_dot( 6, AA_MATCOL(J[side],6,c), y + 6*side );
+        }
+    }
+    dq[14] = aa_la_dot( 12, t, y );
+
+    return 0;
+}
+
+int set_mode_body(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl )
+{
+    if( msg_ctrl->n*sizeof(double) != sizeof( struct body_cx) ) return -1;
+    pir_zero_refs(cx);
+
+    // copy target poses
+    struct body_cx *mode_cx = (struct body_cx*)
+        aa_mem_region_dup( &cx->md_init->reg, &msg_ctrl->x[0].f, sizeof(struct body_cx) );
+    cx->md_init->mode_cx = mode_cx;
+
+    // targets come in the torso frame, as get-state reports them; fix
+    // them in the base frame at the current torso angle
+    double q_T[4], S_T[8], S_t[8], v0[3] = {0,0,0};
+    aa_tf_zangle2quat( cx->state.q[PIR_AXIS_T], q_T );
+    aa_tf_qv2duqu( q_T, v0, S_T );
+    for( int side = 0; side < 2; side ++ ) {
+        AA_MEM_CPY( S_t, mode_cx->S[side], 8 );
+        aa_tf_duqu_mul( S_T, S_t, mode_cx->S[side] );
+    }
+
+    return 0;
+}
+
+/* Whole-body step as a box QP over all 15 joints */
+static int body_qp( pirctrl_cx_t *cx, const double J[2][6*7], const double t[12],
+                    const double dx[12], double dq[15] )
+{
+    struct pir_qp_ws *W = &cx->qp_body;
+
+    // dense 12x15 Jacobian
+    double Jb[12*15];
+    AA_MEM_ZERO( Jb, 12*15 );
+    for( size_t side = 0; side < 2; side ++ ) {
+        for( size_t c = 0; c < 7; c ++ ) {
+            AA_MEM_CPY( AA_MATCOL(Jb,12,7*side+c) + 6*side, AA_MATCOL(J[side],6,c), 6 );
+        }
+    }
+    AA_MEM_CPY( AA_MATCOL(Jb,12,14), t, 12 );
+
+    double H[15*15], g[15], lb[15], ub[15];
+    for( size_t i = 0; i < 15; i ++ ) {
+        const double *Ji = AA_MATCOL(Jb,12,i);
+        for( size_t j = 0; j < 15; j ++ ) {
+            AA_MATREF(H,15,i,j) = aa_la_dot( 12, Ji, AA_MATCOL(Jb,12,j) );
+        }
+        AA_MATREF(H,15,i,i) += cx->Kx.dls;
+        g[i] = aa_la_dot( 12, Ji, dx );
+        pir_qp_bound( cx, (i < 14) ? PIR_AXIS_L0 + i : PIR_AXIS_T,
+                      W->dq[i], lb+i, ub+i );
+    }
+
+    int r = pir_qp_box( 15, H, g, lb, ub, W->active, W->dq );
+    if( r < 0 ) {
+        pir_qp_reset( cx );
+        return -1;
+    } else if( 1 == r ) {
+        pir_qp_warn_limit( cx, W, "body" );
+    }
+    AA_MEM_CPY( dq, W->dq, 15 );
+    return 0;
+}
+
+void ctrl_body( pirctrl_cx_t *cx )
+{
+    struct body_cx *mode_cx = (struct body_cx*)cx->md->mode_cx;
+
+    double q_T[4];
+    aa_tf_zangle2quat( cx->state.q[PIR_AXIS_T], q_T );
+
+    double J[2][6*7], t[12], dx[12];
+    for( int side = 0; side < 2; side ++ ) {
+        // wrist ref from fingertip ref
+        double S_ref[8];
+        aa_tf_duqu_mulc( mode_cx->S[side], cx->state.S_eer[side], S_ref );
+
+        // wrist in base frame
+        double q_wp[4], v_wp[3], q_b[4], v_b[3], S_act[8];
+        aa_tf_duqu2qv( cx->state.S_wp[side], q_wp, v_wp );
+        aa_tf_qmul( q_T, q_wp, q_b );
+        aa_tf_qrot( q_T, v_wp, v_b );
+        aa_tf_qv2duqu( q_b, v_b, S_act );
+
+        pir_ctrl_pose_twist( S_act, S_ref, NULL, cx->Kx.p, dx + 6*side );
+
+        // arm Jacobian in base frame
+        for( size_t c = 0; c < 7; c ++ ) {
+            const double *Jc = AA_MATCOL(cx->state.J_wp[side],6,c);
+            aa_tf_qrot( q_T, Jc,   AA_MATCOL(J[side],6,c) );
+            aa_tf_qrot( q_T, Jc+3, AA_MATCOL(J[side],6,c)+3 );
+        }
+
+        // torso column
+        aa_tf_cross( torso_axis, v_b, t + 6*side );
+        AA_MEM_CPY( t + 6*side + 3, torso_axis, 3 );
+    }
+
+    double dq[15];
+    if( cx->mode && PIR_BACKEND_QP == cx->mode->backend ) {
+        if( body_qp( cx, J, t, dx, dq ) ) {
+            SNS_LOG( LOG_ERR, "body qp failed\n" );
+            return;
+        }
+    } else if( pir_body_solve( J, t, cx->Kx.dls, dx, dq ) ) {
+        SNS_LOG( LOG_ERR, "body solve failed\n" );
+        return;
+    } else {
+        // saturate to the same joint bounds the QP enforces
+        for( size_t i = 0; i < 15; i ++ ) {
+            double lb, ub;
+            pir_qp_bound( cx, (i < 14) ? PIR_AXIS_L0 + i : PIR_AXIS_T,
+                          cx->qp_body.dq[i], &lb, &ub );
+            dq[i] = AA_MAX( lb, AA_MIN(ub, dq[i]) );
+        }
+        AA_MEM_CPY( cx->qp_body.dq, dq, 15 );
+    }
+
+    _Static_assert( PIR_AXIS_L0 + 7 == PIR_AXIS_R0, "Invalid axis ordering" );
+    AA_MEM_CPY( &cx->ref.dq[PIR_AXIS_L0], dq, 14 );
+    cx->ref.dq[PIR_AXIS_T] = dq[14];
+}
@@ -0,0 +1,82 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <amino.h>
+#include <ach.h>
+#include "piranha.h"
+
+static int over( double x, double limit ) {
+    return limit > 0 && x > limit;
+}
+
+unsigned pir_contact_update( struct pir_contact *C, const struct pir_contact_limits *lim,
+                             const double F[6], int64_t time_ns )
+{
+    double f = aa_la_norm( 3, F );
+    double m = aa_la_norm( 3, F+3 );
+    double df = 0;
+    if( C->time_ns > 0 && time_ns > C->time_ns ) {
+        double d[3];
+        for( size_t i = 0; i < 3; i ++ ) d[i] = F[i] - C->F[i];
+        df = aa_la_norm( 3, d ) / ((double)(time_ns - C->time_ns) / 1e9);
+    }
+    AA_MEM_CPY( C->F, F, 6 );
+    C->time_ns = time_ns;
+
+    if( C->active ) {
+        // hysteresis, rearm once everything has settled
+        if( !over(f, lim->F_max/2) && !over(m, lim->M_max/2) && !over(df, lim->dF_max/2) ) {
+            C->active = 0;
+        }
+        return 0;
+    }
+
+    unsigned cause = 0;
+    if( over(f, lim->F_max) )   cause |= PIR_CONTACT_FORCE;
+    if( over(m, lim->M_max) )   cause |= PIR_CONTACT_TORQUE;
+    if( over(df, lim->dF_max) ) cause |= PIR_CONTACT_RATE;
+    C->active = (0 != cause);
+    return cause;
+}
@@ -5,7 +5,7 @@
 // 20 deg/s
 #define MAXVEL_FACTOR 20 * M_PI/180
 
-static void pir_complete( pirctrl_cx_t *cx ) {
+void pir_complete( pirctrl_cx_t *cx ) {
     struct pir_msg_complete msg = { .salt = cx->msg_ctrl.salt,
                                     .seq_no = cx->msg_ctrl.seq_no };
     msg.seq_no = cx->msg_ctrl.seq_no;
@@ -62,7 +62,7 @@ void ctrl_zero( pirctrl_cx_t *cx ) {
 }
 
 
-static void servo_cam( pirctrl_cx_t *cx, struct servo_cam_cx *mode_cx )
+static void servo_cam( pirctrl_cx_t *cx, struct servo_cam_mode *S )
 {
     //printf("--\n");
     double wEe[7];
@@ -73,31 +73,36 @@ static void servo_cam( pirctrl_cx_t *cx, struct servo_cam_cx *mode_cx )
 
     // finger ref in body frame
     double bEer[7];
-    aa_tf_qutr_mul( cx->bEc, mode_cx->cEo, bEer );
-    AA_MEM_CPY( bEer, mode_cx->bEe, 4 );
+    aa_tf_qutr_mul( cx->bEc, S->p.cEo, bEer );
+    AA_MEM_CPY( bEer, S->p.bEe, 4 );
     //printf("bEe: "); aa_dump_vec(stdout,bEer,7);
-    for( size_t i = 0; i < 3; i++ ) bEer[4+i] += mode_cx->bEe[4+i];
+    for( size_t i = 0; i < 3; i++ ) bEer[4+i] += S->p.bEe[4+i];
 
     // wrist ref
     double bEwr[7];
     aa_tf_qutr_mulc( bEer, wEe, bEwr );
 
+    // smooth registration noise and camera-rate steps
+    if( ! S->started ) {
+        double bEw[7];
+        aa_tf_duqu2qutr( G->act.S, bEw );
+        pir_otg_init( &S->otg, bEw );
+        S->started = 1;
+    }
+    pir_otg_step( &S->otg, bEwr, cx->dt );
+
     // fill controller
-    aa_tf_qutr2duqu( bEwr, G->ref.S );
-    AA_MEM_ZERO( G->ref.dx, 6 );
+    aa_tf_qutr2duqu( S->otg.E, G->ref.S );
+    AA_MEM_CPY( G->ref.dx, S->otg.dx, 6 );
 
-    int r = rfx_ctrl_ws_lin_vfwd( G, &cx->Kx, &cx->ref.dq[PIR_AXIS_R0] );
-    if( RFX_OK != r ) {
-        SNS_LOG( LOG_ERR, "ws error: %s\n",
-                 rfx_status_string((rfx_status_t)r) );
-    }
+    pir_ctrl_ws( cx, PIR_RIGHT );
     //printf("--\n");
 }
 
 
 void ctrl_biservo_rel( pirctrl_cx_t *cx )
 {
-    struct biservo_rel_cx *mode_cx = (struct biservo_rel_cx *)cx->mode_cx;
+    struct biservo_rel_cx *mode_cx = (struct biservo_rel_cx *)cx->md->mode_cx;
     // fixup end-effector pose
     double bElwp[7], bErwp[7];
     aa_tf_qutr_mul( AA_MATCOL(cx->tf_abs, 7, PIR_TF_LEFT_WRIST2 ),
@@ -139,21 +144,17 @@ void ctrl_biservo_rel( pirctrl_cx_t *cx )
     //printf("act: "); aa_dump_vec( stdout, bElwp, 7 );
     //printf("ref: "); aa_dump_vec( stdout, bElwtp, 7 );
 
-    int r = rfx_ctrl_ws_lin_vfwd( G, &cx->Kx, &cx->ref.dq[PIR_AXIS_L0] );
-    if( RFX_OK != r ) {
-        SNS_LOG( LOG_ERR, "ws error: %s\n",
-                 rfx_status_string((rfx_status_t)r) );
-    }
+    pir_ctrl_ws( cx, PIR_LEFT );
     //printf("--\n");
 }
 
 
 void ctrl_servo_cam( pirctrl_cx_t *cx )
 {
-    servo_cam(cx, (struct servo_cam_cx*)cx->mode_cx);
+    servo_cam(cx, (struct servo_cam_mode*)cx->md->mode_cx);
 }
 
-void ctrl_ws( pirctrl_cx_t *cx, size_t i, double S[8], double S_rel[8], int side ) {
+void ctrl_ws( pirctrl_cx_t *cx, double S[8], double S_rel[8], int side ) {
     rfx_ctrl_ws_t *G = &cx->G[side];
     // set refs
     AA_MEM_SET( G->ref.dx, 0, 6 );
@@ -180,29 +181,25 @@ void ctrl_ws( pirctrl_cx_t *cx, size_t i, double S[8], double S_rel[8], int side
     }
 
     // compute stuff
-    int r = rfx_ctrl_ws_lin_vfwd( G, &cx->Kx, &cx->ref.dq[i] );
-    if( RFX_OK != r ) {
-        SNS_LOG( LOG_ERR, "ws error: %s\n",
-                 rfx_status_string((rfx_status_t)r) );
-    }
+    pir_ctrl_ws( cx, side );
     // integrate
     rfx_ctrl_ws_sdx( G, cx->dt );
 }
 
 void ctrl_ws_left( pirctrl_cx_t *cx ) {
-    ctrl_ws( cx, PIR_AXIS_L0, NULL, NULL, PIR_LEFT );
+    ctrl_ws( cx, NULL, NULL, PIR_LEFT );
 }
 
 void ctrl_ws_right( pirctrl_cx_t *cx ) {
-    ctrl_ws( cx, PIR_AXIS_R0,  NULL, NULL, PIR_RIGHT );
+    ctrl_ws( cx, NULL, NULL, PIR_RIGHT );
 }
 
 void ctrl_ws_left_finger( pirctrl_cx_t *cx ) {
-    ctrl_ws( cx, PIR_AXIS_L0, cx->state.S_wp[PIR_LEFT], cx->state.S_eer[PIR_LEFT], PIR_LEFT );
+    ctrl_ws( cx, cx->state.S_wp[PIR_LEFT], cx->state.S_eer[PIR_LEFT], PIR_LEFT );
 }
 
 void ctrl_ws_right_finger( pirctrl_cx_t *cx ) {
-    ctrl_ws( cx, PIR_AXIS_R0, cx->state.S_wp[PIR_RIGHT], cx->state.S_eer[PIR_RIGHT], PIR_RIGHT );
+    ctrl_ws( cx, cx->state.S_wp[PIR_RIGHT], cx->state.S_eer[PIR_RIGHT], PIR_RIGHT );
 }
 
 void ctrl_sin( pirctrl_cx_t *cx ) {
@@ -238,36 +235,30 @@ void ctrl_step( pirctrl_cx_t *cx ) {
 
 
 void ctrl_trajx_side( pirctrl_cx_t *cx, int side, int eer ) {
-    int lwa, sdh;
-    PIR_SIDE_INDICES( side, lwa, sdh );
-    (void)sdh;
-
+    struct pir_trajx_tab *T = (struct pir_trajx_tab*)cx->md->mode_cx;
     double t = aa_tm_timespec2sec( aa_tm_sub( cx->now, cx->t0 ) );
-    double t_f = rfx_trajx_seg_list_get_t_f(cx->trajx_segs);
-    if( t > t_f ) {
-        t = t_f;
+
+    // get refs
+    double S_traj[8], dx[6];
+    if( pir_trajx_tab_get( T, t, S_traj, dx ) ) {
         pir_complete(cx);
     }
 
-    // get refs
-    double S_traj[8], dx[6] = {0};
-    rfx_trajx_seg_list_get_dx_duqu( cx->trajx_segs, t, S_traj, dx );
+    ctrl_trajx_ref( cx, side, eer, S_traj, dx );
+}
 
+void ctrl_trajx_ref( pirctrl_cx_t *cx, int side, int eer, const double S_traj[8], const double dx[6] ) {
     if( eer ) {
         // convert to wrist frame
         aa_tf_duqu_mulc( S_traj, cx->state.S_eer[side], cx->G[side].ref.S  );
         double S_tmp[8];
         rfx_kin_duqu_relvel( cx->G[side].ref.S, cx->state.S_eer[side], dx, S_tmp, cx->G[side].ref.dx );
     } else {
-        memcpy( cx->G[side].ref.S, S_traj, sizeof(S_traj) );
-        memcpy( cx->G[side].ref.dx, dx, sizeof(dx) );
+        AA_MEM_CPY( cx->G[side].ref.S, S_traj, 8 );
+        AA_MEM_CPY( cx->G[side].ref.dx, dx, 6 );
     }
 
-    int r = rfx_ctrl_ws_lin_vfwd( &cx->G[side], &cx->Kx, &cx->ref.dq[lwa] );
-    if( RFX_OK != r ) {
-        SNS_LOG( LOG_ERR, "ws error: %s\n",
-                 rfx_status_string((rfx_status_t)r) );
-    }
+    pir_ctrl_ws( cx, side );
 }
 
 void ctrl_trajx_w_left( pirctrl_cx_t *cx ) {
@@ -283,18 +274,33 @@ void ctrl_trajx_right( pirctrl_cx_t *cx ) {
     ctrl_trajx_side( cx, PIR_RIGHT, 1 );
 }
 
-static void ctrl_trajq_doit( pirctrl_cx_t *cx, rfx_ctrl_t *G, rfx_ctrlq_lin_k_t *K, size_t off ) {
+static void ctrl_trajx_stream( pirctrl_cx_t *cx, int side ) {
+    struct pir_trajx_stream *T = (struct pir_trajx_stream*)cx->md->mode_cx;
     double t = aa_tm_timespec2sec( aa_tm_sub( cx->now, cx->t0 ) );
 
-    // don't go past the end
-    double t_f = rfx_trajq_seg_list_get_t_f(cx->trajq_segs);
-    if( t >= t_f ) {
-        t = t_f;
+    double S_traj[8], dx[6];
+    if( pir_trajx_stream_get( T, t, S_traj, dx ) ) {
         pir_complete(cx);
     }
 
-    // get refs
-    rfx_trajq_seg_list_get_dq( cx->trajq_segs, t, G->ref.q,G->ref.dq );
+    ctrl_trajx_ref( cx, side, 1, S_traj, dx );
+}
+
+void ctrl_trajx_stream_left( pirctrl_cx_t *cx ) {
+    ctrl_trajx_stream( cx, PIR_LEFT );
+}
+void ctrl_trajx_stream_right( pirctrl_cx_t *cx ) {
+    ctrl_trajx_stream( cx, PIR_RIGHT );
+}
+
+static void ctrl_trajq_doit( pirctrl_cx_t *cx, rfx_ctrl_t *G, rfx_ctrlq_lin_k_t *K, size_t off ) {
+    struct pir_trajq_tab *T = (struct pir_trajq_tab*)cx->md->mode_cx;
+    double t = aa_tm_timespec2sec( aa_tm_sub( cx->now, cx->t0 ) );
+
+    // get refs, holding the end
+    if( pir_trajq_tab_get( T, t, G->ref.q, G->ref.dq ) ) {
+        pir_complete(cx);
+    }
 
     int r = rfx_ctrlq_lin_vfwd( G, K, &cx->ref.dq[off] );
     if( RFX_OK != r ) {
@@ -316,21 +322,37 @@ void ctrl_trajq_lr( pirctrl_cx_t *cx ) {
     ctrl_trajq_doit( cx, &cx->G_LR, &cx->Kq_lr, PIR_AXIS_L0 );
 }
 
-void ctrl_trajq_torso( pirctrl_cx_t *cx ) {
+static void ctrl_trajq_topt( pirctrl_cx_t *cx, rfx_ctrl_t *G, rfx_ctrlq_lin_k_t *K, size_t off ) {
+    struct pir_trajq_topt *T = (struct pir_trajq_topt*)cx->md->mode_cx;
     double t = aa_tm_timespec2sec( aa_tm_sub( cx->now, cx->t0 ) );
 
-    if( t >= cx->trajq->t_f ) {
-        AA_MEM_CPY( cx->G_T.ref.q, cx->trajq->q_f, 1 );
-        AA_MEM_SET( cx->G_T.ref.dq, 0, 1 );
+    if( pir_trajq_topt_get( T, t, G->ref.q, G->ref.dq ) ) {
         pir_complete(cx);
-    } else {
-        // get refs
-        rfx_trajq_get_q( cx->trajq, t, cx->G_T.ref.q );
-        rfx_trajq_get_dq( cx->trajq, t, cx->G_T.ref.dq );
     }
 
-    int r = rfx_ctrlq_lin_vfwd( &cx->G_T, &cx->Kq_T, &cx->ref.dq[PIR_AXIS_T] );
-    (void)r;
-    //printf("trajq: "); aa_dump_vec(stdout, &cx->ref.dq[PIR_AXIS_T], 1);
+    int r = rfx_ctrlq_lin_vfwd( G, K, &cx->ref.dq[off] );
+    if( RFX_OK != r ) {
+        SNS_LOG( LOG_ERR, "ws error: %s\n",
+                 rfx_status_string((rfx_status_t)r) );
+    }
+}
+
+void ctrl_trajq_topt_left( pirctrl_cx_t *cx ) {
+    ctrl_trajq_topt( cx, &cx->G[PIR_LEFT], &cx->Kq, PIR_AXIS_L0 );
+}
 
+void ctrl_trajq_topt_right( pirctrl_cx_t *cx ) {
+    ctrl_trajq_topt( cx, &cx->G[PIR_RIGHT], &cx->Kq, PIR_AXIS_R0 );
+}
+
+void ctrl_trajq_topt_lr( pirctrl_cx_t *cx ) {
+    ctrl_trajq_topt( cx, &cx->G_LR, &cx->Kq_lr, PIR_AXIS_L0 );
+}
+
+void ctrl_trajq_topt_torso( pirctrl_cx_t *cx ) {
+    ctrl_trajq_topt( cx, &cx->G_T, &cx->Kq_T, PIR_AXIS_T );
+}
+
+void ctrl_trajq_torso( pirctrl_cx_t *cx ) {
+    ctrl_trajq_doit( cx, &cx->G_T, &cx->Kq_T, PIR_AXIS_T );
 }
@@ -0,0 +1,144 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/** Author: Neil Dantam
+ */
+
+#include <amino.h>
+#include <ach.h>
+#include "piranha.h"
+
+/*
+ * With g the gravity vector in the F/T frame, the raw wrench of a
+ * sensor with bias (b_f, b_t) carrying mass m with first moment p is
+ *
+ *      f = b_f + m g
+ *      t = b_t + p x g
+ *
+ * which is linear in (b_f, m) and in (b_t, p).  Each axis gives one
+ * scalar row of the regressor.  A single pose leaves bias and payload
+ * ambiguous along g, so the covariance only shrinks in every direction
+ * once the sensor has been held at several orientations.
+ */
+
+/* One scalar recursive least-squares step */
+static void rls_row( size_t n, double *theta, double *P, const double *phi, double y )
+{
+    double Pphi[6];
+    double s = 1;
+    double e = y;
+    for( size_t i = 0; i < n; i ++ ) {
+        Pphi[i] = 0;
+        for( size_t j = 0; j < n; j ++ ) Pphi[i] += AA_MATREF(P,n,i,j) * phi[j];
+        s += phi[i] * Pphi[i];
+        e -= phi[i] * theta[i];
+    }
+    for( size_t i = 0; i < n; i ++ ) {
+        theta[i] += Pphi[i] * e / s;
+    }
+    // symmetric update keeps P from drifting
+    for( size_t j = 0; j < n; j ++ ) {
+        for( size_t i = 0; i <= j; i ++ ) {
+            double x = AA_MATREF(P,n,i,j) - Pphi[i]*Pphi[j] / s;
+            AA_MATREF(P,n,i,j) = x;
+            AA_MATREF(P,n,j,i) = x;
+        }
+    }
+}
+
+static void diag( size_t n, double *P, double x )
+{
+    AA_MEM_ZERO( P, n*n );
+    for( size_t i = 0; i < n; i ++ ) AA_MATREF(P,n,i,i) = x;
+}
+
+void pir_ftid_init( struct pir_ftid *E )
+{
+    memset( E, 0, sizeof(*E) );
+    diag( 4, E->P_f, PIR_FTID_P0 );
+    diag( 6, E->P_t, PIR_FTID_P0 );
+}
+
+void pir_ftid_update( struct pir_ftid *E, const double r_ft[4], const double F_raw[6] )
+{
+    // gravity in the F/T frame, with the sign of F_raw
+    double g[3], r_inv[4];
+    const double z[3] = {0, 0, AA_K_STD_G};
+    aa_tf_qconj( r_ft, r_inv );
+    aa_tf_qrot( r_inv, z, g );
+
+    for( size_t a = 0; a < 3; a ++ ) {
+        double phi[4] = {0, 0, 0, g[a]};
+        phi[a] = 1;
+        rls_row( 4, E->theta_f, E->P_f, phi, F_raw[a] );
+    }
+
+    const double phi_t[3][6] = { {1, 0, 0,     0,  g[2], -g[1]},
+                                 {0, 1, 0, -g[2],     0,  g[0]},
+                                 {0, 0, 1,  g[1], -g[0],     0} };
+    for( size_t a = 0; a < 3; a ++ ) {
+        rls_row( 6, E->theta_t, E->P_t, phi_t[a], F_raw[3+a] );
+    }
+
+    E->n++;
+}
+
+int pir_ftid_converged( const struct pir_ftid *E )
+{
+    if( E->n < PIR_FTID_MIN ) return 0;
+    for( size_t i = 0; i < 4; i ++ ) {
+        if( AA_MATREF(E->P_f,4,i,i) > PIR_FTID_TOL ) return 0;
+    }
+    for( size_t i = 0; i < 6; i ++ ) {
+        if( AA_MATREF(E->P_t,6,i,i) > PIR_FTID_TOL ) return 0;
+    }
+    return 1;
+}
+
+void pir_ftid_get( const struct pir_ftid *E, struct pir_payload_body *B, double bias[6] )
+{
+    AA_MEM_CPY( bias, E->theta_f, 3 );
+    AA_MEM_CPY( bias+3, E->theta_t, 3 );
+    B->mass = E->theta_f[3];
+    for( size_t i = 0; i < 3; i ++ ) {
+        B->com[i] = B->mass > 0 ? E->theta_t[3+i] / B->mass : 0;
+    }
+}
@@ -0,0 +1,92 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <amino.h>
+#include <ach.h>
+#include <reflex.h>
+#include "piranha.h"
+
+void pir_hist_push( struct pir_hist *H, int64_t t_ns, const double *tf_abs )
+{
+    // keep time order, a repeated tick replaces the newest snapshot
+    if( H->n && t_ns <= H->snap[H->i].t_ns ) {
+        if( t_ns < H->snap[H->i].t_ns ) return;
+    } else {
+        H->i = (H->i + 1) % PIR_HIST_MAX;
+        if( H->n < PIR_HIST_MAX ) H->n++;
+    }
+
+    struct pir_hist_snap *s = &H->snap[H->i];
+    s->t_ns = t_ns;
+    AA_MEM_CPY( s->bEw[PIR_LEFT], AA_MATCOL(tf_abs, 7, PIR_TF_LEFT_WRIST2), 7 );
+    AA_MEM_CPY( s->bEw[PIR_RIGHT], AA_MATCOL(tf_abs, 7, PIR_TF_RIGHT_WRIST2), 7 );
+}
+
+int pir_hist_get( const struct pir_hist *H, int64_t t_ns, int side, double bEw[7] )
+{
+    if( 0 == H->n ) return -1;
+
+    // k-th oldest snapshot
+#define SNAP(k) (&H->snap[(H->i + PIR_HIST_MAX + 1 - H->n + (k)) % PIR_HIST_MAX])
+    if( t_ns < SNAP(0)->t_ns ) return -1;
+
+    // latest snapshot at or before t_ns
+    size_t lo = 0, hi = H->n - 1;
+    while( lo < hi ) {
+        size_t mid = (lo + hi + 1) / 2;
+        if( SNAP(mid)->t_ns <= t_ns ) lo = mid;
+        else hi = mid - 1;
+    }
+
+    // take the nearer neighbor
+    const struct pir_hist_snap *s = SNAP(lo);
+    if( lo + 1 < H->n && SNAP(lo+1)->t_ns - t_ns < t_ns - s->t_ns ) {
+        s = SNAP(lo+1);
+    }
+#undef SNAP
+
+    AA_MEM_CPY( bEw, s->bEw[side], 7 );
+    return 0;
+}
@@ -225,22 +225,53 @@ int pir_kin_arm( struct pir_state *X ) {
     return 0;
 }
 
-int pir_kin_ft( double *tf_abs, struct pir_state *X, double F_raw[2][6], double r_ft[2][4] ) {
+int pir_kin_twist( struct pir_state *X ) {
+    for( size_t i = 0; i < 2; i ++ ) {
+        int j, k;
+        PIR_SIDE_INDICES(i, j, k);
+        (void)k;
+        // wrist, J*dq
+        const double *J = X->J_wp[i];
+        const double *dq = &X->est.dq[j];
+        double *dx = X->dx_wp[i];
+        for( size_t r = 0; r < 6; r ++ ) {
+            dx[r] = 0;
+            for( size_t c = 0; c < 7; c ++ ) dx[r] += AA_MATREF(J, 6, r, c) * dq[c];
+        }
+
+        // end-effector, same rotational velocity about a moved point
+        double S_ee[8], x_wp[3], x_ee[3], r[3], w_r[3];
+        aa_tf_duqu_mul( X->S_wp[i], X->S_eer[i], S_ee );
+        aa_tf_duqu_trans( X->S_wp[i], x_wp );
+        aa_tf_duqu_trans( S_ee, x_ee );
+        for( size_t a = 0; a < 3; a ++ ) r[a] = x_ee[a] - x_wp[a];
+        aa_tf_cross( dx+3, r, w_r );
+        for( size_t a = 0; a < 3; a ++ ) {
+            X->dx_ee[i][a] = dx[a] + w_r[a];
+            X->dx_ee[i][3+a] = dx[3+a];
+        }
+    }
+    return 0;
+}
+
+int pir_kin_arm_side( int side, const double q[7], const double See[8],
+                      double S[8], double J[6*7] ) {
+    if( !is_init) kin_init();
+    lwa4_kin_duqu( q, S0[side].data, See, S, J );
+    return 0;
+}
+
+int pir_kin_ft( double *tf_abs, struct pir_state *X, const struct pir_payload *P,
+                double F_raw[2][6], double r_ft[2][4] ) {
 
     if( !is_init) kin_init();
 
     memcpy( r_ft[PIR_LEFT], &tf_abs[ PIR_TF_LEFT_FT*7 ], 4*sizeof(double) );
     memcpy( r_ft[PIR_RIGHT], &tf_abs[ PIR_TF_RIGHT_FT*7 ], 4*sizeof(double) );
 
-    for( size_t i = 0; i < 2; i ++ ) {
-        int j, k;
-        PIR_SIDE_INDICES(i, j, k);
-        // rotate
-        aa_tf_qrot( r_ft[i], F_raw[i],   X->F[i]);
-        aa_tf_qrot( r_ft[i], F_raw[i]+3, X->F[i]+3 );
-        // subtract end-effector mass
-        X->F[i][2] = X->F[i][2] - PIR_FT_WEIGHT - SDH_WEIGHT;
-    }
+    // rotate and subtract payload
+    pir_payload_comp( P, r_ft, F_raw, X->F );
+    return 0;
 }
 
 void pir_kin( const double *q, double **tf_rel, double **tf_abs )
@@ -0,0 +1,250 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <syslog.h>
+#include <sns.h>
+#include <amino.h>
+#include <reflex.h>
+#include "piranha.h"
+
+/*
+ * Bimanual Cartesian splines.
+ *
+ * Both arms' waypoints share segment times, so each pair of waypoints
+ * is reached together.  Both splines are resampled on the same grid
+ * and evaluated from one clock each cycle.  Automatically timed
+ * segments (dt <= 0) take the slower of the two arms.
+ *
+ * bisplend:      dt, S_left[8], S_right[8] per waypoint
+ * bisplend-rel:  lSr[8], then dt, S_left[8] per waypoint, with the
+ *                right end-effector held at lSr in the left one
+ *
+ * For bisplend-rel, the right arm first approaches lSr in the left
+ * end-effector while the left holds still.  After that, only the left
+ * arm has a spline, and the right reference is S_left(t) * lSr each
+ * cycle, so the relative pose also holds between waypoints.
+ *
+ * Poses are of the end-effectors in the body frame.
+ */
+
+#define BI_PAIR 17
+#define BI_REL  9
+
+struct bisplend_cx {
+    struct pir_trajx_tab T[2];      ///< for rel, the left spline and the right approach
+    int rel;
+    double lSr[8];      ///< right end-effector in the left
+    double S_l0[8];     ///< left pose held during the approach
+    double t_rel;       ///< end of the approach
+};
+
+/* Fill dt[k] <= 0 with the slower arm's automatic timing */
+static void bisplend_time( struct pir_mode_data *md, size_t n_pts,
+                           double *S[2], double *dt )
+{
+    int is_auto = 0;
+    dt[0] = 0;
+    for( size_t k = 1; k < n_pts; k ++ ) {
+        is_auto = is_auto || !(dt[k] > 0);
+    }
+    if( !is_auto ) return;
+
+    double *dt_side = AA_MEM_REGION_NEW_N( &md->reg, double, n_pts );
+    double *dt_max = AA_MEM_REGION_NEW_N( &md->reg, double, n_pts );
+    AA_MEM_ZERO( dt_max, n_pts );
+    for( int side = 0; side < 2; side ++ ) {
+        int lwa, sdh;
+        PIR_SIDE_INDICES( side, lwa, sdh );
+        (void)sdh;
+        AA_MEM_CPY( dt_side, dt, n_pts );
+        pir_trajx_gen_auto( &md->reg, side, md->X.q + lwa, md->X.S_eer[side],
+                            n_pts, S[side], dt_side, md->dq_max + lwa, NULL );
+        for( size_t k = 1; k < n_pts; k ++ ) {
+            dt_max[k] = AA_MAX( dt_max[k], dt_side[k] );
+        }
+    }
+    for( size_t k = 1; k < n_pts; k ++ ) {
+        if( !(dt[k] > 0) ) dt[k] = dt_max[k];
+    }
+}
+
+static void bisplend_tab( struct pir_mode_data *md, struct pir_trajx_tab *T,
+                          size_t n_pts, const double *S, const double *dt )
+{
+    struct rfx_trajx_seg_list *segs = pir_trajx_spline( &md->reg, n_pts, S, dt );
+    pir_trajx_tab_init( T, &md->reg, segs );
+}
+
+static int bisplend_gen( struct pir_mode_data *md, size_t n_pts,
+                         double *S[2], double *dt )
+{
+    // initial points
+    for( int side = 0; side < 2; side ++ ) {
+        aa_tf_duqu_mul( md->X.S_wp[side], md->X.S_eer[side], S[side] );
+    }
+    bisplend_time( md, n_pts, S, dt );
+
+    struct bisplend_cx *B = AA_MEM_REGION_NEW( &md->reg, struct bisplend_cx );
+    memset( B, 0, sizeof(*B) );
+    for( int side = 0; side < 2; side ++ ) {
+        bisplend_tab( md, &B->T[side], n_pts, S[side], dt );
+    }
+    md->mode_cx = B;
+
+    return 0;
+}
+
+int gen_mode_bisplend( struct pir_mode_data *md )
+{
+    struct pir_msg *msg_ctrl = md->msg;
+    if( msg_ctrl->n < BI_PAIR || 0 != msg_ctrl->n % BI_PAIR ) return -1;
+
+    size_t n_pts = 1 + msg_ctrl->n / BI_PAIR;
+    double *S[2], *dt = AA_MEM_REGION_NEW_N( &md->reg, double, n_pts );
+    for( int side = 0; side < 2; side ++ ) {
+        S[side] = AA_MEM_REGION_NEW_N( &md->reg, double, 8*n_pts );
+    }
+    for( size_t k = 1; k < n_pts; k ++ ) {
+        const double *x = &msg_ctrl->x[BI_PAIR*(k-1)].f;
+        dt[k] = x[0];
+        AA_MEM_CPY( S[PIR_LEFT] + 8*k, x + 1, 8 );
+        AA_MEM_CPY( S[PIR_RIGHT] + 8*k, x + 9, 8 );
+    }
+
+    return bisplend_gen( md, n_pts, S, dt );
+}
+
+int gen_mode_bisplend_rel( struct pir_mode_data *md )
+{
+    struct pir_msg *msg_ctrl = md->msg;
+    if( msg_ctrl->n < 8 + BI_REL || 0 != (msg_ctrl->n - 8) % BI_REL ) return -1;
+
+    struct bisplend_cx *B = AA_MEM_REGION_NEW( &md->reg, struct bisplend_cx );
+    memset( B, 0, sizeof(*B) );
+    B->rel = 1;
+    AA_MEM_CPY( B->lSr, &msg_ctrl->x[0].f, 8 );
+
+    // the coupled motion, starting with the right arm already at lSr
+    size_t n_pts = 1 + (msg_ctrl->n - 8) / BI_REL;
+    double *S[2], *dt = AA_MEM_REGION_NEW_N( &md->reg, double, n_pts );
+    for( int side = 0; side < 2; side ++ ) {
+        S[side] = AA_MEM_REGION_NEW_N( &md->reg, double, 8*n_pts );
+    }
+    aa_tf_duqu_mul( md->X.S_wp[PIR_LEFT], md->X.S_eer[PIR_LEFT], S[PIR_LEFT] );
+    AA_MEM_CPY( B->S_l0, S[PIR_LEFT], 8 );
+    for( size_t k = 1; k < n_pts; k ++ ) {
+        const double *x = &msg_ctrl->x[8 + BI_REL*(k-1)].f;
+        dt[k] = x[0];
+        AA_MEM_CPY( S[PIR_LEFT] + 8*k, x + 1, 8 );
+    }
+    for( size_t k = 0; k < n_pts; k ++ ) {
+        aa_tf_duqu_mul( S[PIR_LEFT] + 8*k, B->lSr, S[PIR_RIGHT] + 8*k );
+    }
+    // the right arm spline only times the coupled motion
+    bisplend_time( md, n_pts, S, dt );
+    bisplend_tab( md, &B->T[PIR_LEFT], n_pts, S[PIR_LEFT], dt );
+
+    // approach, timed automatically
+    {
+        int lwa, sdh;
+        PIR_SIDE_INDICES( PIR_RIGHT, lwa, sdh );
+        (void)sdh;
+        double S_a[16], dt_a[2] = {0, 0};
+        aa_tf_duqu_mul( md->X.S_wp[PIR_RIGHT], md->X.S_eer[PIR_RIGHT], S_a );
+        AA_MEM_CPY( S_a + 8, S[PIR_RIGHT], 8 );
+        struct rfx_trajx_seg_list *segs =
+            pir_trajx_gen_auto( &md->reg, PIR_RIGHT, md->X.q + lwa, md->X.S_eer[PIR_RIGHT],
+                                2, S_a, dt_a, md->dq_max + lwa, NULL );
+        pir_trajx_tab_init( &B->T[PIR_RIGHT], &md->reg, segs );
+        B->t_rel = dt_a[1];
+    }
+
+    md->mode_cx = B;
+    return 0;
+}
+
+/* Right end-effector pose and twist rigidly attached at lSr to the left */
+static void bisplend_rel_right( const double S_l[8], const double dx_l[6], const double lSr[8],
+                                double S_r[8], double dx_r[6] )
+{
+    aa_tf_duqu_mul( S_l, lSr, S_r );
+
+    double q_l[4], p_l[3], q_r[4], p_r[3], d[3], w_d[3];
+    aa_tf_duqu2qv( S_l, q_l, p_l );
+    aa_tf_duqu2qv( S_r, q_r, p_r );
+    for( size_t i = 0; i < 3; i ++ ) d[i] = p_r[i] - p_l[i];
+    aa_tf_cross( dx_l + 3, d, w_d );
+    for( size_t i = 0; i < 3; i ++ ) {
+        dx_r[i] = dx_l[i] + w_d[i];
+        dx_r[3+i] = dx_l[3+i];
+    }
+}
+
+void ctrl_bisplend( pirctrl_cx_t *cx )
+{
+    struct bisplend_cx *B = (struct bisplend_cx*)cx->md->mode_cx;
+    double t = aa_tm_timespec2sec( aa_tm_sub( cx->now, cx->t0 ) );
+
+    double S[2][8], dx[2][6];
+    int done = 1;
+    if( !B->rel ) {
+        for( int side = 0; side < 2; side ++ ) {
+            done = pir_trajx_tab_get( &B->T[side], t, S[side], dx[side] ) && done;
+        }
+    } else if( t < B->t_rel ) {
+        // approach, left holds
+        AA_MEM_CPY( S[PIR_LEFT], B->S_l0, 8 );
+        AA_MEM_ZERO( dx[PIR_LEFT], 6 );
+        pir_trajx_tab_get( &B->T[PIR_RIGHT], t, S[PIR_RIGHT], dx[PIR_RIGHT] );
+        done = 0;
+    } else {
+        done = pir_trajx_tab_get( &B->T[PIR_LEFT], t - B->t_rel, S[PIR_LEFT], dx[PIR_LEFT] );
+        bisplend_rel_right( S[PIR_LEFT], dx[PIR_LEFT], B->lSr, S[PIR_RIGHT], dx[PIR_RIGHT] );
+    }
+    for( int side = 0; side < 2; side ++ ) {
+        ctrl_trajx_ref( cx, side, 1, S[side], dx[side] );
+    }
+    if( done ) pir_complete(cx);
+}
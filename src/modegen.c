@@ -0,0 +1,212 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <argp.h>
+#include <syslog.h>
+#include <sns.h>
+#include <inttypes.h>
+#include <amino.h>
+#include <reflex.h>
+#include "piranha.h"
+
+/*
+ * Mode generation thread.
+ *
+ * Trajectory generation may take longer than a control cycle, so
+ * modes with a generator are built here instead of in the control
+ * loop.  The control thread copies the request and current state
+ * into a free buffer, marks it REQ, and holds position.  The worker
+ * claims the buffer, generates into the buffer's own region, and
+ * marks it DONE.  The control thread then swaps it in at the start
+ * of a cycle.  Buffers change hands only through atomic status
+ * updates; neither thread ever blocks on the other.
+ */
+
+static int md_status( struct pir_mode_data *md ) {
+    return __atomic_load_n( &md->status, __ATOMIC_ACQUIRE );
+}
+
+static void md_set_status( struct pir_mode_data *md, int status ) {
+    __atomic_store_n( &md->status, status, __ATOMIC_RELEASE );
+}
+
+static int md_swap_status( struct pir_mode_data *md, int from, int to ) {
+    return __atomic_compare_exchange_n( &md->status, &from, to, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE );
+}
+
+static void *modegen_thread( void *arg ) {
+    pirctrl_cx_t *cx = (pirctrl_cx_t*)arg;
+
+    while( !sns_cx.shutdown ) {
+        if( sem_wait( &cx->gen_sem ) ) {
+            if( EINTR != errno )
+                SNS_LOG( LOG_ERR, "sem_wait failed: '%s'\n", strerror(errno) );
+            continue;
+        }
+
+        for( size_t i = 0; i < PIR_MODE_DATA_CNT; i ++ ) {
+            struct pir_mode_data *md = &cx->md_buf[i];
+            if( ! md_swap_status( md, PIR_MD_REQ, PIR_MD_BUSY ) ) continue;
+
+            aa_mem_region_release( &md->reg );
+            md->mode_cx = NULL;
+
+            md->result = md->desc->gen( md );
+
+            md_set_status( md, PIR_MD_DONE );
+        }
+    }
+
+    return NULL;
+}
+
+void pir_modegen_start( pirctrl_cx_t *cx ) {
+    for( size_t i = 0; i < PIR_MODE_DATA_CNT; i ++ ) {
+        struct pir_mode_data *md = &cx->md_buf[i];
+        memset( md, 0, sizeof(*md) );
+        aa_mem_region_init( &md->reg, 64 * 1024 );
+        md->status = PIR_MD_FREE;
+    }
+    cx->md = NULL;
+    cx->md_init = NULL;
+    cx->gen_seq = 0;
+
+    if( sem_init( &cx->gen_sem, 0, 0 ) )
+        SNS_DIE( "sem_init failed: '%s'\n", strerror(errno) );
+
+    int r = pthread_create( &cx->gen_thread, NULL, modegen_thread, cx );
+    if( r ) SNS_DIE( "pthread_create failed: '%s'\n", strerror(r) );
+}
+
+void pir_modegen_stop( pirctrl_cx_t *cx ) {
+    sem_post( &cx->gen_sem );
+    pthread_join( cx->gen_thread, NULL );
+    sem_destroy( &cx->gen_sem );
+
+    for( size_t i = 0; i < PIR_MODE_DATA_CNT; i ++ ) {
+        aa_mem_region_destroy( &cx->md_buf[i].reg );
+        free( cx->md_buf[i].msg );
+    }
+}
+
+static struct pir_mode_data *modegen_free( pirctrl_cx_t *cx ) {
+    for( size_t i = 0; i < PIR_MODE_DATA_CNT; i ++ ) {
+        if( PIR_MD_FREE == md_status(&cx->md_buf[i]) ) return &cx->md_buf[i];
+    }
+    SNS_LOG( LOG_ERR, "No free mode data\n" );
+    return NULL;
+}
+
+struct pir_mode_data *pir_modegen_take( pirctrl_cx_t *cx ) {
+    struct pir_mode_data *md = modegen_free( cx );
+    if( md ) {
+        aa_mem_region_release( &md->reg );
+        md->mode_cx = NULL;
+    }
+    return md;
+}
+
+void pir_modegen_activate( pirctrl_cx_t *cx, struct pir_mode_data *md ) {
+    if( md == cx->md ) return;
+    if( cx->md ) md_set_status( cx->md, PIR_MD_FREE );
+    md_set_status( md, PIR_MD_ACTIVE );
+    cx->md = md;
+}
+
+int pir_modegen_submit( pirctrl_cx_t *cx, struct pir_mode_desc *desc,
+                        const struct pir_msg *msg, size_t size )
+{
+    // supersede any pending request
+    cx->gen_seq++;
+    for( size_t i = 0; i < PIR_MODE_DATA_CNT; i ++ ) {
+        md_swap_status( &cx->md_buf[i], PIR_MD_REQ, PIR_MD_FREE );
+    }
+
+    struct pir_mode_data *md = modegen_free( cx );
+    if( NULL == md ) return -1;
+
+    size_t alloc = AA_MAX( size, sizeof(struct pir_msg) );
+    if( md->msg_size < alloc ) {
+        md->msg = (struct pir_msg*)realloc( md->msg, alloc );
+        md->msg_size = alloc;
+    }
+    memcpy( md->msg, msg, size );
+    memcpy( &md->X, &cx->state, sizeof(md->X) );
+    AA_MEM_CPY( md->dq_max, cx->dq_max, PIR_AXIS_CNT );
+    AA_MEM_CPY( md->ddq_max, cx->ddq_max, PIR_AXIS_CNT );
+    md->desc = desc;
+    md->seq = cx->gen_seq;
+
+    md_set_status( md, PIR_MD_REQ );
+    if( sem_post( &cx->gen_sem ) ) {
+        SNS_LOG( LOG_ERR, "sem_post failed: '%s'\n", strerror(errno) );
+        return -1;
+    }
+
+    return 0;
+}
+
+void pir_modegen_poll( pirctrl_cx_t *cx ) {
+    for( size_t i = 0; i < PIR_MODE_DATA_CNT; i ++ ) {
+        struct pir_mode_data *md = &cx->md_buf[i];
+        if( PIR_MD_DONE != md_status(md) ) continue;
+
+        if( md->seq != cx->gen_seq ) {
+            // superseded
+            md_set_status( md, PIR_MD_FREE );
+        } else if( md->result ) {
+            SNS_LOG( LOG_ERR, "Could not generate mode `%s'\n", md->desc->name );
+            md_set_status( md, PIR_MD_FREE );
+        } else {
+            SNS_LOG( LOG_DEBUG, "generated mode: %s\n", md->desc->name );
+            pir_zero_refs( cx );
+            memcpy( &cx->t0, &cx->now, sizeof(cx->t0) );
+            memcpy( &cx->msg_ctrl, md->msg, sizeof(cx->msg_ctrl) );
+            pir_modegen_activate( cx, md );
+            cx->mode = md->desc;
+        }
+    }
+}
@@ -0,0 +1,116 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <amino.h>
+#include <ach.h>
+#include <reflex.h>
+#include "piranha.h"
+
+/*
+ * Online trajectory generation toward a moving pose target.
+ *
+ * Each axis of the pose error runs through a cascade of saturated
+ * proportional stages,
+ *
+ *      v_d = sat( k_p e ),  a_d = sat( k_v (v_d - v) ),  j = sat( k_a (a_d - a) )
+ *
+ * with gains that place the three poles at -PIR_OTG_OMEGA, so the
+ * output is critically damped and velocity, acceleration, and jerk
+ * stay bounded whatever steps the target takes.  Near the target, the
+ * velocity demand is also limited to the braking velocity, so
+ * saturated approaches do not overshoot.  Rotation error is the
+ * rotation vector from the filtered to the target orientation, taken
+ * in the base frame like the translation.
+ */
+
+#define OTG_K_P ( PIR_OTG_OMEGA / 3 )
+#define OTG_K_V ( PIR_OTG_OMEGA )
+#define OTG_K_A ( 3 * PIR_OTG_OMEGA )
+
+static const double otg_v_max[2] = {PIR_TRAJX_V_MAX, PIR_TRAJX_W_MAX};
+static const double otg_a_max[2] = {PIR_OTG_A_MAX, PIR_OTG_ALPHA_MAX};
+static const double otg_j_max[2] = {PIR_OTG_J_MAX, PIR_OTG_J_MAX * PIR_OTG_ALPHA_MAX / PIR_OTG_A_MAX};
+
+static double sat( double x, double max ) {
+    return AA_MAX( -max, AA_MIN( max, x ) );
+}
+
+void pir_otg_init( struct pir_otg *O, const double E[7] )
+{
+    AA_MEM_CPY( O->E, E, 7 );
+    AA_MEM_ZERO( O->dx, 6 );
+    AA_MEM_ZERO( O->ddx, 6 );
+}
+
+void pir_otg_step( struct pir_otg *O, const double E_ref[7], double dt )
+{
+    // pose error
+    double e[6], q_e[4];
+    for( size_t i = 0; i < 3; i ++ ) e[i] = E_ref[4+i] - O->E[4+i];
+    aa_tf_qmulc( E_ref, O->E, q_e );
+    aa_tf_qminimize( q_e );
+    aa_tf_quat2rotvec( q_e, e+3 );
+
+    for( size_t i = 0; i < 6; i ++ ) {
+        size_t k = i / 3;
+        double v_brake = sqrt( 2 * otg_a_max[k] * fabs(e[i]) );
+        double v_d = sat( OTG_K_P * e[i], AA_MIN( otg_v_max[k], v_brake ) );
+        double a_d = sat( OTG_K_V * (v_d - O->dx[i]), otg_a_max[k] );
+        double j = sat( OTG_K_A * (a_d - O->ddx[i]), otg_j_max[k] );
+        O->ddx[i] = sat( O->ddx[i] + dt*j, otg_a_max[k] );
+        O->dx[i] = sat( O->dx[i] + dt*O->ddx[i], otg_v_max[k] );
+    }
+
+    // integrate the pose
+    double w[3], q_d[4];
+    for( size_t i = 0; i < 3; i ++ ) {
+        O->E[4+i] += dt * O->dx[i];
+        w[i] = dt * O->dx[3+i];
+    }
+    aa_tf_rotvec2quat( w, q_d );
+    aa_tf_qmul( q_d, O->E, e );
+    aa_tf_qnormalize( e );
+    AA_MEM_CPY( O->E, e, 4 );
+}
@@ -0,0 +1,145 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/** Author: Neil Dantam
+ */
+
+#include <amino.h>
+#include <ach.h>
+#include "piranha.h"
+
+/*
+ * Both sides are evaluated together, structure of arrays with the
+ * side as the inner index, so each step is one two-lane vector
+ * operation.
+ */
+
+void pir_payload_default( struct pir_payload *P )
+{
+    memset( P, 0, sizeof(*P) );
+    P->hand.mass = (PIR_FT_WEIGHT + SDH_WEIGHT) / AA_K_STD_G;
+}
+
+void pir_payload_set( struct pir_payload P[2], const struct pir_msg_payload *msg )
+{
+    for( size_t i = 0; i < 2; i ++ ) {
+        if( !(msg->sides & (1u << i)) ) continue;
+        if( msg->parts & PIR_PAYLOAD_HAND )   P[i].hand = msg->payload[i].hand;
+        if( msg->parts & PIR_PAYLOAD_OBJECT ) P[i].object = msg->payload[i].object;
+        if( msg->parts & PIR_PAYLOAD_BIAS )   AA_MEM_CPY( P[i].bias, msg->payload[i].bias, 6 );
+    }
+}
+
+/* Rotations and payload gravity wrenches in the F/T frames */
+static void payload_lanes( const struct pir_payload P[2], double r_ft[2][4],
+                           double R[9][2], double W[6][2] )
+{
+    for( size_t i = 0; i < 2; i ++ ) {
+        double R_i[9];
+        aa_tf_quat2rotmat( r_ft[i], R_i );
+        for( size_t k = 0; k < 9; k ++ ) R[k][i] = R_i[k];
+    }
+
+    // mass and first moment of hand plus object
+    double m[2], c[3][2];
+    for( size_t i = 0; i < 2; i ++ ) {
+        m[i] = P[i].hand.mass + P[i].object.mass;
+    }
+    for( size_t k = 0; k < 3; k ++ ) {
+        for( size_t i = 0; i < 2; i ++ ) {
+            c[k][i] = P[i].hand.mass * P[i].hand.com[k] + P[i].object.mass * P[i].object.com[k];
+        }
+    }
+
+    // F/T frame weight direction, R^T * z, with the sign of F_raw
+    double g[3][2];
+    for( size_t k = 0; k < 3; k ++ ) {
+        for( size_t i = 0; i < 2; i ++ ) {
+            g[k][i] = AA_K_STD_G * R[3*k+2][i];
+        }
+    }
+
+    for( size_t k = 0; k < 3; k ++ ) {
+        for( size_t i = 0; i < 2; i ++ ) W[k][i] = m[i] * g[k][i];
+    }
+    for( size_t i = 0; i < 2; i ++ ) {
+        W[3][i] = c[1][i]*g[2][i] - c[2][i]*g[1][i];
+        W[4][i] = c[2][i]*g[0][i] - c[0][i]*g[2][i];
+        W[5][i] = c[0][i]*g[1][i] - c[1][i]*g[0][i];
+    }
+}
+
+void pir_payload_wrench( const struct pir_payload P[2], double r_ft[2][4],
+                         double W[2][6] )
+{
+    double R[9][2], w[6][2];
+    payload_lanes( P, r_ft, R, w );
+    for( size_t k = 0; k < 6; k ++ ) {
+        for( size_t i = 0; i < 2; i ++ ) W[i][k] = -w[k][i];
+    }
+}
+
+void pir_payload_comp( const struct pir_payload P[2], double r_ft[2][4],
+                       double F_raw[2][6], double F[2][6] )
+{
+    double R[9][2], w[6][2];
+    payload_lanes( P, r_ft, R, w );
+
+    // external wrench, F/T frame
+    double e[6][2];
+    for( size_t k = 0; k < 6; k ++ ) {
+        for( size_t i = 0; i < 2; i ++ ) {
+            e[k][i] = F_raw[i][k] - P[i].bias[k] - w[k][i];
+        }
+    }
+
+    // rotate force and torque to the base frame
+    double f[6][2];
+    for( size_t k = 0; k < 3; k ++ ) {
+        for( size_t i = 0; i < 2; i ++ ) {
+            f[k][i]   = R[k][i]*e[0][i] + R[3+k][i]*e[1][i] + R[6+k][i]*e[2][i];
+            f[3+k][i] = R[k][i]*e[3][i] + R[3+k][i]*e[4][i] + R[6+k][i]*e[5][i];
+        }
+    }
+    for( size_t k = 0; k < 6; k ++ ) {
+        for( size_t i = 0; i < 2; i ++ ) F[i][k] = f[k][i];
+    }
+}
@@ -306,12 +306,12 @@ int main( int argc, char **argv )
                               ZZ.tf.data,
                               Pb, Wb );
 
-        // send message
+        // send message, stamped with the marker capture time
         {
             struct sns_msg_tf *tfmsg = sns_msg_tf_local_alloc(2);
-            struct timespec now;
-            clock_gettime( ACH_DEFAULT_CLOCK, &now );
-            sns_msg_set_time( &tfmsg->header, &now, 0 );
+            struct timespec t_capture = { .tv_sec = wt_tf->header.time.sec,
+                                          .tv_nsec = wt_tf->header.time.nsec };
+            sns_msg_set_time( &tfmsg->header, &t_capture, 0 );
             AA_MEM_CPY( tfmsg->tf[0].data, E_cor, 7 );
             AA_MEM_CPY( tfmsg->tf[1].data, XX_est.tf.data, 7 );
             enum ach_status r = sns_msg_tf_put(&chan_reg, tfmsg);
@@ -48,6 +48,9 @@
 #include "piranha.h"
 #include <sys/types.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
 
 #define N_MARKERS 64
 
@@ -117,6 +120,7 @@ struct madqg_state {
     size_t n;
     size_t max;
     size_t i;
+    int64_t t_ns;       ///< time of the estimate, 0 before the first
     double P[13*13];
 };
 
@@ -130,6 +134,7 @@ void init_state( struct madqg_state *state, size_t k ) {
     state->n = 0;
     state->max = opt_k;
     state->i = 0;
+    state->t_ns = 0;
     aa_la_diag( 13, state->P, 1 );
 }
 
@@ -137,6 +142,55 @@ struct madqg_state *state_bEc; ///< camera poses
 struct madqg_state *state_bEm; ///< fixed marker poses
 struct madqg_state state_rErp; ///< right-hand correction
 struct madqg_state state_lElp; ///< left-hand correction
+struct timespec t_capture;     ///< newest fused marker capture time
+
+
+/*
+ * The state channel and each camera channel have a reader thread that
+ * blocks on that channel alone and queues its messages to the main
+ * thread through a single-producer, single-consumer ring, as in
+ * pirfilt.  Joint samples go into a short history.  Each marker
+ * message is fused against the joints at its capture time, after
+ * predicting every state it touches forward to that time, so one
+ * camera's latency never holds up another.
+ */
+
+#define KF_RING 32              ///< messages per input ring, power of 2
+#define KF_HIST 256             ///< joint samples kept
+#define KF_WAIT_NS (100 * 1000 * 1000)
+#define KF_HOLD_NS (50 * 1000 * 1000)  ///< longest wait for joints to reach a capture time
+#define KF_EXTRAP_MAX .02       ///< longest joint extrapolation, s
+#define KF_DT_MAX 1.0           ///< longest single predict, s
+
+struct kf_joints {
+    int64_t t_ns;
+    double q[PIR_AXIS_CNT];
+    double dq[PIR_AXIS_CNT];
+};
+
+struct kf_state_in {
+    ach_channel_t chan;
+    pthread_t thread;
+    struct kf_joints ring[KF_RING];
+    size_t head;        ///< written by the reader
+    size_t tail;        ///< written by the main thread
+};
+
+struct kf_cam_in {
+    ach_channel_t chan;
+    pthread_t thread;
+    struct sns_msg_wt_tf *ring[KF_RING+1];  ///< spare last slot for drops
+    size_t head;        ///< written by the reader
+    size_t tail;        ///< written by the main thread
+};
+
+struct kf_state_in in_state;
+struct kf_cam_in *in_cam;
+sem_t in_sem;           ///< posted for each queued message
+
+struct kf_joints joint_hist[KF_HIST];   ///< ring of joint samples, time ordered
+size_t joint_hist_i;    ///< newest sample
+size_t joint_hist_n;    ///< sample count
 
 
 double state_tf_rel[7*PIR_TF_FRAME_MAX];
@@ -205,7 +259,18 @@ int predict( double dt, struct madqg_state *state )
     return rfx_lqg_qutr_predict( dt, state->E, state->dx, state->P, Vb );
 }
 
-void update_camera( double *tf_abs, size_t i_cam, struct sns_msg_wt_tf *wt_tf )
+/* Predict state forward to t_ns, earlier times leave it alone */
+void predict_to( struct madqg_state *state, int64_t t_ns )
+{
+    if( t_ns <= state->t_ns ) return;
+    if( state->t_ns ) {
+        double dt = (double)(t_ns - state->t_ns) / 1e9;
+        predict( AA_MIN(dt, KF_DT_MAX), state );
+    }
+    state->t_ns = t_ns;
+}
+
+void update_camera( double *tf_abs, size_t i_cam, int64_t t_ns, struct sns_msg_wt_tf *wt_tf )
 {
     // Can initialze camera pose off of arm position, since we know
     // approximate E.E. pose in body frame from kinematics alone
@@ -232,6 +297,10 @@ void update_camera( double *tf_abs, size_t i_cam, struct sns_msg_wt_tf *wt_tf )
     /* double *rElp = state_lElp.E; */
     /* double *rErp = state_rErp.E; */
 
+    predict_to( &state_bEc[i_cam], t_ns );
+    predict_to( &state_lElp, t_ns );
+    predict_to( &state_rErp, t_ns );
+
     // TODO: E.E. relative
     for( size_t j = 0; j < wt_tf->header.n; j ++ ) {
         if( wt_tf->wt_tf[j].weight < opt_wt_thresh ) continue;
@@ -287,6 +356,7 @@ void update_camera( double *tf_abs, size_t i_cam, struct sns_msg_wt_tf *wt_tf )
 
                     double E_obs[7];
                     aa_tf_qutr_mul( bEc, cEm, E_obs );
+                    predict_to( &state_bEm[k], t_ns );
                     correct1( &state_bEm[k], E_obs, 1 );
                 }
             }
@@ -302,84 +372,239 @@ void update_camera( double *tf_abs, size_t i_cam, struct sns_msg_wt_tf *wt_tf )
     if( i_rp ) correct1( &state_rErp, r_p, i_rp );
 }
 
-void update( ach_channel_t *chan_config, ach_channel_t *chan_cam, size_t n_cam )
+void *read_state( void *arg )
 {
-    SNS_LOG( LOG_DEBUG + 2, "update()\n");
-    /**** KINEMATICS ****/
-    /* Wait Sample */
-    double *config = NULL;
-    ach_status_t r_config;
-    {
+    (void)arg;
+    size_t max = pir_state_msg_size( PIR_STATE_SEC_ALL );
+    struct pir_state_msg *msg = (struct pir_state_msg*)malloc( max );
+
+    while( !sns_cx.shutdown ) {
+        struct timespec now;
+        if( clock_gettime( ACH_DEFAULT_CLOCK, &now ) )
+            SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
+        struct timespec timeout = sns_time_add_ns( now, KF_WAIT_NS );
+
         size_t frame_size;
-        r_config = sns_msg_local_get( chan_config, (void**)&config,
-                                      &frame_size, NULL, ACH_O_WAIT | ACH_O_LAST );
-        SNS_LOG( LOG_DEBUG + 2, "r_config: %s\n", ach_result_to_string(r_config));
-        switch( r_config ) {
+        ach_status_t r = ach_get( &in_state.chan, msg, max, &frame_size,
+                                  &timeout, ACH_O_WAIT );
+        switch( r ) {
         case ACH_OK:
         case ACH_MISSED_FRAME:
-        case ACH_STALE_FRAMES:
             break;
+        case ACH_TIMEOUT:
+        case ACH_STALE_FRAMES:
         case ACH_CANCELED:
-            SNS_LOG(LOG_NOTICE, "canceled\n");
-            return;
+            continue;
         default:
-            SNS_DIE( "Error getting config: %s\n", ach_result_to_string(r_config) );
+            SNS_LOG( LOG_ERR, "Error getting state: %s\n", ach_result_to_string(r) );
+            continue;
         }
-        /* Maybe update kinematics */
-        if( config ) {
-            SNS_LOG( LOG_DEBUG + 2, "got config\n");
-            size_t expected_size = 2*PIR_TF_CONFIG_MAX*sizeof(double);
-            SNS_REQUIRE( expected_size == frame_size,
-                         "Unexpected frame size: saw %lu, wanted %lu\n",
-                         frame_size, expected_size );
-            pir_tf_rel( config, state_tf_rel );
-            pir_tf_abs( state_tf_rel, state_tf_abs );
+        if( pir_state_msg_check(msg, frame_size) ) {
+            SNS_LOG( LOG_ERR, "Invalid state message of %lu bytes\n", frame_size );
+            continue;
         }
-    }
+        const double *q = pir_state_msg_section( msg, PIR_STATE_SEC_JOINTS );
+        if( NULL == q ) continue;
 
-    /* PREDICT */
-    SNS_LOG( LOG_DEBUG + 2, "update(): predict\n");
-    double dt = 1e-3; // FIXME
-    for( size_t i = 0; i < n_cam; i ++ ) {
-        predict( dt, state_bEc );
-    }
-    for( size_t i = 0; i < opt_n_fixed_markers; i ++ ) {
-        predict( dt, state_bEm );
+        size_t head = in_state.head;
+        if( head - __atomic_load_n( &in_state.tail, __ATOMIC_ACQUIRE ) >= KF_RING ) {
+            SNS_LOG( LOG_DEBUG, "Dropped joint sample\n" );
+            continue;
+        }
+        struct kf_joints *s = &in_state.ring[head % KF_RING];
+        s->t_ns = msg->time_ns[PIR_STATE_SEC_JOINTS];
+        AA_MEM_CPY( s->q, q, PIR_AXIS_CNT );
+        AA_MEM_CPY( s->dq, q + PIR_AXIS_CNT, PIR_AXIS_CNT );
+        __atomic_store_n( &in_state.head, head + 1, __ATOMIC_RELEASE );
+        if( sem_post( &in_sem ) ) {
+            SNS_LOG( LOG_ERR, "sem_post failed: '%s'\n", strerror(errno) );
+        }
     }
-    predict( dt, &state_rErp );
-    predict( dt, &state_lElp );
 
-    /**** CAMERAS ****/
-    SNS_LOG( LOG_DEBUG + 2, "update(): cam\n");
-    /* Get Sample */
-    for( size_t i = 0; i < n_cam; i ++ ) {
-        struct sns_msg_wt_tf *wt_tf = NULL;
-        /* Get message */
-        size_t marker_frame_size;
-        ach_status_t r = sns_msg_wt_tf_local_get( &chan_cam[i], &wt_tf,
-                                                  &marker_frame_size, NULL, ACH_O_LAST );
+    free( msg );
+    return NULL;
+}
+
+void *read_cam( void *arg )
+{
+    struct kf_cam_in *in = (struct kf_cam_in*)arg;
+    size_t i_cam = (size_t)(in - in_cam);
+    size_t max = sns_msg_wt_tf_size_n( N_MARKERS );
+
+    while( !sns_cx.shutdown ) {
+        struct timespec now;
+        if( clock_gettime( ACH_DEFAULT_CLOCK, &now ) )
+            SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
+        struct timespec timeout = sns_time_add_ns( now, KF_WAIT_NS );
+
+        // the slot past head is free until we publish it
+        size_t head = in->head;
+        int full = head - __atomic_load_n( &in->tail, __ATOMIC_ACQUIRE ) >= KF_RING;
+        struct sns_msg_wt_tf *wt_tf = in->ring[ full ? KF_RING : head % KF_RING ];
+
+        size_t frame_size;
+        ach_status_t r = ach_get( &in->chan, wt_tf, max, &frame_size,
+                                  &timeout, ACH_O_WAIT | ACH_O_LAST );
         switch( r ) {
         case ACH_OK:
         case ACH_MISSED_FRAME:
-        case ACH_STALE_FRAMES:
             break;
+        case ACH_TIMEOUT:
+        case ACH_STALE_FRAMES:
+        case ACH_CANCELED:
+            continue;
         default:
-            SNS_DIE( "Error getting marker: %s\n", ach_result_to_string(r) );
+            SNS_LOG( LOG_ERR, "Error getting marker: %s\n", ach_result_to_string(r) );
+            continue;
         }
-        /* CORRECT */
-        if( wt_tf ) {
-            ssize_t size_delta = sns_msg_wt_tf_check_size( wt_tf, marker_frame_size );
-            if( size_delta ) {
-                SNS_LOG( LOG_ERR, "Bad frame size, delta of %ld\n", size_delta);
-            } else {
-                SNS_LOG( LOG_DEBUG + 1, "got cam: %lu (%s)\n", i, ach_result_to_string(r));
-                update_camera( state_tf_abs, i, wt_tf );
+        ssize_t size_delta = sns_msg_wt_tf_check_size( wt_tf, frame_size );
+        if( size_delta ) {
+            SNS_LOG( LOG_ERR, "Bad frame size, delta of %ld\n", size_delta);
+        } else if( full ) {
+            SNS_LOG( LOG_WARNING, "Dropped markers from camera %lu\n", i_cam );
+        } else {
+            __atomic_store_n( &in->head, head + 1, __ATOMIC_RELEASE );
+            if( sem_post( &in_sem ) ) {
+                SNS_LOG( LOG_ERR, "sem_post failed: '%s'\n", strerror(errno) );
             }
         }
     }
+    return NULL;
+}
+
+/* Move queued joint samples into the history */
+void drain_joints( void )
+{
+    size_t tail = in_state.tail;
+    size_t head = __atomic_load_n( &in_state.head, __ATOMIC_ACQUIRE );
+    for( ; tail != head; tail ++ ) {
+        const struct kf_joints *s = &in_state.ring[tail % KF_RING];
+        // keep time order, a repeated time replaces the newest sample
+        if( joint_hist_n && s->t_ns <= joint_hist[joint_hist_i].t_ns ) {
+            if( s->t_ns < joint_hist[joint_hist_i].t_ns ) continue;
+        } else {
+            joint_hist_i = (joint_hist_i + 1) % KF_HIST;
+            if( joint_hist_n < KF_HIST ) joint_hist_n++;
+        }
+        joint_hist[joint_hist_i] = *s;
+    }
+    __atomic_store_n( &in_state.tail, tail, __ATOMIC_RELEASE );
+}
+
+/*
+ * Joint positions at t_ns, interpolated between the neighboring
+ * samples or briefly extrapolated past the newest.
+ *
+ * Returns -1 if t_ns is older than the history.
+ */
+int joints_at( int64_t t_ns, double q[PIR_AXIS_CNT] )
+{
+    if( 0 == joint_hist_n ) return -1;
+
+    // k-th oldest sample
+#define SAMPLE(k) (&joint_hist[(joint_hist_i + KF_HIST + 1 - joint_hist_n + (k)) % KF_HIST])
+    if( t_ns < SAMPLE(0)->t_ns ) return -1;
+
+    // latest sample at or before t_ns
+    size_t lo = 0, hi = joint_hist_n - 1;
+    while( lo < hi ) {
+        size_t mid = (lo + hi + 1) / 2;
+        if( SAMPLE(mid)->t_ns <= t_ns ) lo = mid;
+        else hi = mid - 1;
+    }
+
+    const struct kf_joints *s0 = SAMPLE(lo);
+    if( lo + 1 < joint_hist_n ) {
+        const struct kf_joints *s1 = SAMPLE(lo+1);
+        double u = (double)(t_ns - s0->t_ns) / (double)(s1->t_ns - s0->t_ns);
+        for( size_t j = 0; j < PIR_AXIS_CNT; j ++ ) {
+            q[j] = s0->q[j] + u * (s1->q[j] - s0->q[j]);
+        }
+    } else {
+        double dt = AA_MIN( (double)(t_ns - s0->t_ns) / 1e9, KF_EXTRAP_MAX );
+        for( size_t j = 0; j < PIR_AXIS_CNT; j ++ ) {
+            q[j] = s0->q[j] + dt * s0->dq[j];
+        }
+    }
+#undef SAMPLE
+    return 0;
+}
+
+/* Fuse the queued markers of camera i_cam, returns nonzero if any */
+int drain_cam( size_t i_cam, int64_t now_ns )
+{
+    struct kf_cam_in *in = &in_cam[i_cam];
+    int fused = 0;
+    size_t tail = in->tail;
+    size_t head = __atomic_load_n( &in->head, __ATOMIC_ACQUIRE );
+    for( ; tail != head; tail ++ ) {
+        struct sns_msg_wt_tf *wt_tf = in->ring[tail % KF_RING];
+        int64_t t_ns = PIR_MSG_TIME_NS( wt_tf->header );
+
+        // hold markers captured after the newest joints, but not for long
+        if( (0 == joint_hist_n || t_ns > joint_hist[joint_hist_i].t_ns) &&
+            now_ns - t_ns < KF_HOLD_NS )
+        {
+            break;
+        }
+
+        double q[PIR_AXIS_CNT];
+        if( joints_at( t_ns, q ) ) {
+            SNS_LOG( LOG_DEBUG, "No joints at capture time of camera %lu\n", i_cam );
+            continue;
+        }
+        struct pir_config config;
+        memset( &config, 0, sizeof(config) );
+        pir_state_config( q, &config );
+        pir_tf_rel( config.q, state_tf_rel );
+        pir_tf_abs( state_tf_rel, state_tf_abs );
+
+        SNS_LOG( LOG_DEBUG + 1, "got cam: %lu\n", i_cam );
+        update_camera( state_tf_abs, i_cam, t_ns, wt_tf );
+        struct timespec t = { .tv_sec = wt_tf->header.time.sec,
+                              .tv_nsec = wt_tf->header.time.nsec };
+        if( aa_tm_cmp( t, t_capture ) > 0 ) t_capture = t;
+        fused = 1;
+    }
+    __atomic_store_n( &in->tail, tail, __ATOMIC_RELEASE );
+    return fused;
+}
+
+int update( void )
+{
+    SNS_LOG( LOG_DEBUG + 2, "update()\n");
+    struct timespec now;
+    if( clock_gettime( ACH_DEFAULT_CLOCK, &now ) )
+        SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
+
+    /* Wait for a message from any input, sem_timedwait takes a realtime deadline */
+    struct timespec now_rt;
+    if( clock_gettime( CLOCK_REALTIME, &now_rt ) )
+        SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
+    struct timespec timeout = sns_time_add_ns( now_rt, KF_HOLD_NS );
+    int waited = 0;
+    if( sem_timedwait( &in_sem, &timeout ) ) {
+        if( ETIMEDOUT != errno && EINTR != errno )
+            SNS_LOG( LOG_ERR, "sem_timedwait failed: '%s'\n", strerror(errno) );
+    } else {
+        waited = 1;
+        while( 0 == sem_trywait( &in_sem ) );
+    }
+    if( clock_gettime( ACH_DEFAULT_CLOCK, &now ) )
+        SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
+
+    /**** KINEMATICS ****/
+    if( waited ) drain_joints();
+
+    /**** CAMERAS ****/
+    int fused = 0;
+    for( size_t i = 0; i < opt_n_cam; i ++ ) {
+        fused |= drain_cam( i, PIR_TIMESPEC_NS(now) );
+    }
 
     /* CLEANUP */
     aa_mem_region_local_release();
+    return fused;
 }
 
 int output_chan( struct timespec now,
@@ -398,17 +623,15 @@ int output_chan( struct timespec now,
 }
 
 int output( ach_channel_t *chan_reg_cam, ach_channel_t *chan_reg_marker, ach_channel_t *chan_reg_ee  ) {
-    struct timespec now;
-    clock_gettime( ACH_DEFAULT_CLOCK, &now );
     SNS_LOG( LOG_DEBUG+2, "output()\n");
-
-    output_chan( now, chan_reg_cam, state_bEc, opt_n_cam );
-    if( opt_n_fixed_markers ) output_chan( now, chan_reg_marker, state_bEm, opt_n_fixed_markers );
+    // registrations are stamped with the capture time of their markers
+    output_chan( t_capture, chan_reg_cam, state_bEc, opt_n_cam );
+    if( opt_n_fixed_markers ) output_chan( t_capture, chan_reg_marker, state_bEm, opt_n_fixed_markers );
 
 
     {
         struct sns_msg_tf *msg = sns_msg_tf_local_alloc( (uint32_t) 2 );
-        sns_msg_set_time( &msg->header, &now, 0 );
+        sns_msg_set_time( &msg->header, &t_capture, 0 );
         AA_MEM_CPY( msg->tf[PIR_LEFT].data, state_lElp.E, 7 );
         AA_MEM_CPY( msg->tf[PIR_RIGHT].data, state_rErp.E, 7 );
 
@@ -416,7 +639,7 @@ int output( ach_channel_t *chan_reg_cam, ach_channel_t *chan_reg_marker, ach_cha
         SNS_REQUIRE( ACH_OK == r, "Couldn't put message\n");
     }
 
-    //output_chan( now, chan_reg_e, state_bEc, opt_n_fixed_markers );
+    //output_chan( t_capture, chan_reg_e, state_bEc, opt_n_fixed_markers );
 
     /* struct sns_msg_tf *tf_cam = sns_msg_tf_local_alloc( (uint32_t) opt_n_cam ); */
     /* struct sns_msg_tf *tf_marker = sns_msg_tf_local_alloc( (uint32_t) opt_n_fixed_markers ); */
@@ -491,19 +714,23 @@ int main( int argc, char **argv )
     SNS_LOG( LOG_DEBUG, "%lu fixed markers\n", opt_n_fixed_markers);
 
     // init
-    ach_channel_t chan_config, *chan_marker, chan_reg_cam, chan_reg_marker, chan_reg_ee;
-    sns_chan_open( &chan_config, "pir-config", NULL );
+    ach_channel_t chan_reg_cam, chan_reg_marker, chan_reg_ee;
+    sns_chan_open( &in_state.chan, "pir-state", NULL );
     sns_chan_open( &chan_reg_cam, "pir-reg-cam", NULL );
     sns_chan_open( &chan_reg_marker, "pir-reg-marker", NULL );
     sns_chan_open( &chan_reg_ee, "pir-reg-ee", NULL );
 
-    chan_marker = (ach_channel_t*)malloc( sizeof(ach_channel_t) * opt_n_cam );
+    in_cam = AA_NEW0_AR( struct kf_cam_in, opt_n_cam );
     for( size_t i = 0; i < opt_n_cam; i ++ ) {
-        sns_chan_open( &chan_marker[i], opt_cam[i], NULL );
+        sns_chan_open( &in_cam[i].chan, opt_cam[i], NULL );
+        // one spare slot to drain the channel into when the ring is full
+        for( size_t j = 0; j <= KF_RING; j ++ ) {
+            in_cam[i].ring[j] = (struct sns_msg_wt_tf*)malloc( sns_msg_wt_tf_size_n(N_MARKERS) );
+        }
     }
 
     {
-        ach_channel_t *chans[] = {&chan_config, NULL, NULL};
+        ach_channel_t *chans[] = {&in_state.chan, NULL, NULL};
         sns_sigcancel( chans, sns_sig_term_default );
     }
 
@@ -524,15 +751,33 @@ int main( int argc, char **argv )
     aa_la_diag( 7, Wb, .1 );
     aa_la_diag( 13, Pb, 10 );
 
+    if( sem_init( &in_sem, 0, 0 ) ) {
+        SNS_DIE( "sem_init failed: '%s'\n", strerror(errno) );
+    }
+    {
+        int r = pthread_create( &in_state.thread, NULL, read_state, NULL );
+        if( r ) SNS_DIE( "pthread_create failed: '%s'\n", strerror(r) );
+    }
+    for( size_t i = 0; i < opt_n_cam; i ++ ) {
+        int r = pthread_create( &in_cam[i].thread, NULL, read_cam, &in_cam[i] );
+        if( r ) SNS_DIE( "pthread_create failed: '%s'\n", strerror(r) );
+    }
+
     SNS_LOG( LOG_INFO, "starting main loop\n");
     // run
     while( !sns_cx.shutdown ) {
 
-        update( &chan_config, chan_marker, opt_n_cam );
-        output( &chan_reg_cam, &chan_reg_marker, &chan_reg_ee );
+        if( update() ) {
+            output( &chan_reg_cam, &chan_reg_marker, &chan_reg_ee );
+        }
 
         aa_mem_region_local_release();
     }
+
+    pthread_join( in_state.thread, NULL );
+    for( size_t i = 0; i < opt_n_cam; i ++ ) {
+        pthread_join( in_cam[i].thread, NULL );
+    }
     SNS_LOG( LOG_NOTICE, "Exiting gracefully\n");
     return 0;
 }
@@ -59,155 +59,553 @@ pirctrl_cx_t cx;
 
 
 #define VALID_NS (1000000000 / 5)
+#define REF_PERIOD_MIN .9   ///< closest ref puts on one channel, in control periods
 
 static void set_mode(void);
+static void start_mode( struct pir_mode_desc *desc, struct pir_msg *msg, size_t size );
+static void halt(void);
+static unsigned stale_sources( const struct pir_mode_desc *desc );
+static unsigned anom_axes( const struct pir_mode_desc *desc );
+static void contact(void);
 static void update(void);
-static void control(void);
+static void update_js(void);
+static void update_shm( unsigned fields );
+static int merge_state( const struct timespec *deadline );
+static void wait_tick( const struct timespec *deadline );
+static void control( unsigned sources );
 
 
-static void control_n( uint32_t n, size_t i, ach_channel_t *chan );
+static void control_n( uint32_t n, size_t i, ach_channel_t *chan, int64_t *t_put );
 
-int set_mode_bisplend(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl );
-void ctrl_bisplend( pirctrl_cx_t *cx );
+#define SRC_LEFT      PIR_SRC_BIT(PIR_SRC_LEFT)
+#define SRC_RIGHT     PIR_SRC_BIT(PIR_SRC_RIGHT)
+#define SRC_LR        (SRC_LEFT | SRC_RIGHT)
+#define SRC_TORSO     PIR_SRC_BIT(PIR_SRC_TORSO)
+#define SRC_SDH_LEFT  PIR_SRC_BIT(PIR_SRC_SDH_LEFT)
+#define SRC_SDH_RIGHT PIR_SRC_BIT(PIR_SRC_SDH_RIGHT)
+#define SRC_FT_LEFT   PIR_SRC_BIT(PIR_SRC_FT_LEFT)
+#define SRC_FT_RIGHT  PIR_SRC_BIT(PIR_SRC_FT_RIGHT)
 
 struct pir_mode_desc mode_desc[] = {
     {"left-shoulder",
      set_mode_cpy,
      ctrl_joint_left_shoulder,
+     NULL,
+     NULL,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT,
      NULL},
     {"left-wrist",
      set_mode_cpy,
      ctrl_joint_left_wrist,
+     NULL,
+     NULL,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT,
      NULL},
     {"right-shoulder",
      set_mode_cpy,
      ctrl_joint_right_shoulder,
+     NULL,
+     NULL,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_RIGHT,
      NULL},
     {"right-wrist",
      set_mode_cpy,
      ctrl_joint_right_wrist,
+     NULL,
+     NULL,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_RIGHT,
      NULL},
     {"ws-left",
      set_mode_ws_left,
      ctrl_ws_left,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT,
      NULL},
     {"ws-left-finger",
      set_mode_ws_left_finger,
      ctrl_ws_left_finger,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT | SRC_SDH_LEFT,
      NULL},
     {"ws-right",
      set_mode_ws_right,
      ctrl_ws_right,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_RIGHT,
      NULL},
     {"ws-right-finger",
      set_mode_ws_right_finger,
      ctrl_ws_right_finger,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_RIGHT | SRC_SDH_RIGHT,
+     NULL},
+    {"ws-left-qp",
+     set_mode_ws_left,
+     ctrl_ws_left,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_QP,
+     0,
+     SRC_LEFT,
+     NULL},
+    {"ws-right-qp",
+     set_mode_ws_right,
+     ctrl_ws_right,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_QP,
+     0,
+     SRC_RIGHT,
      NULL},
     {"zero",
      set_mode_cpy,
      ctrl_zero,
+     NULL,
+     NULL,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LR,
      NULL},
     {"sin",
      set_mode_sin,
      ctrl_sin,
+     NULL,
+     NULL,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT,
      NULL},
     {"step",
      set_mode_cpy,
      ctrl_step,
+     NULL,
+     NULL,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT,
      NULL},
     {"trajx-left",
-     set_mode_trajx_left,
+     NULL,
      ctrl_trajx_left,
+     NULL,
+     gen_mode_trajx_left,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT,
      NULL},
     {"trajx-right",
-     set_mode_trajx_right,
+     NULL,
      ctrl_trajx_right,
+     NULL,
+     gen_mode_trajx_right,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_RIGHT,
      NULL},
     {"trajx-w-left",
-     set_mode_trajx_w_left,
+     NULL,
      ctrl_trajx_w_left,
+     NULL,
+     gen_mode_trajx_w_left,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT,
      NULL},
     {"trajx-w-right",
-     set_mode_trajx_w_right,
+     NULL,
      ctrl_trajx_w_right,
+     NULL,
+     gen_mode_trajx_w_right,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_RIGHT,
      NULL},
+    {"trajx-qp-left",
+     NULL,
+     ctrl_trajx_left,
+     NULL,
+     gen_mode_trajx_left,
+     0,
+     PIR_BACKEND_QP,
+     0,
+     SRC_LEFT,
+     NULL},
+    {"trajx-qp-right",
+     NULL,
+     ctrl_trajx_right,
+     NULL,
+     gen_mode_trajx_right,
+     0,
+     PIR_BACKEND_QP,
+     0,
+     SRC_RIGHT,
+     NULL},
+    {"trajx-stream-left",
+     set_mode_trajx_stream_left,
+     ctrl_trajx_stream_left,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT,
+     NULL},
+    {"trajx-stream-right",
+     set_mode_trajx_stream_right,
+     ctrl_trajx_stream_right,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_RIGHT,
+     NULL},
+    {"trajx-append-left",
+     NULL,
+     ctrl_trajx_stream_left,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT,
+     set_mode_trajx_append_left},
+    {"trajx-append-right",
+     NULL,
+     ctrl_trajx_stream_right,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_RIGHT,
+     set_mode_trajx_append_right},
     {"trajq-left",
-     set_mode_trajq_left,
+     NULL,
      ctrl_trajq_left,
+     NULL,
+     gen_mode_trajq_left,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT,
      NULL},
     {"trajq-right",
-     set_mode_trajq_right,
+     NULL,
      ctrl_trajq_right,
+     NULL,
+     gen_mode_trajq_right,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_RIGHT,
      NULL},
     {"trajq-lr",
-     set_mode_trajq_lr,
+     NULL,
      ctrl_trajq_lr,
+     NULL,
+     gen_mode_trajq_lr,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LR,
      NULL},
     {"trajq-torso",
-     set_mode_trajq_torso,
+     NULL,
      ctrl_trajq_torso,
+     NULL,
+     gen_mode_trajq_torso,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_TORSO,
+     NULL},
+    {"trajq-stop-left",
+     NULL,
+     ctrl_trajq_topt_left,
+     NULL,
+     gen_mode_trajq_topt_left,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LEFT,
+     NULL},
+    {"trajq-stop-right",
+     NULL,
+     ctrl_trajq_topt_right,
+     NULL,
+     gen_mode_trajq_topt_right,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_RIGHT,
+     NULL},
+    {"trajq-stop-lr",
+     NULL,
+     ctrl_trajq_topt_lr,
+     NULL,
+     gen_mode_trajq_topt_lr,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LR,
+     NULL},
+    {"trajq-stop-torso",
+     NULL,
+     ctrl_trajq_topt_torso,
+     NULL,
+     gen_mode_trajq_topt_torso,
+     PIR_SHM_JOINTS,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_TORSO,
      NULL},
     {"servo-cam",
      set_mode_servo_cam,
      ctrl_servo_cam,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_RIGHT | SRC_SDH_RIGHT,
      NULL},
     {"biservo-rel",
      set_mode_biservo_rel,
      ctrl_biservo_rel,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LR,
+     NULL},
+    {"admit-left",
+     set_mode_admit_left,
+     ctrl_admit_left,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     PIR_STATE_SEC_BIT(PIR_STATE_SEC_FT),
+     SRC_LEFT | SRC_FT_LEFT,
+     NULL},
+    {"admit-right",
+     set_mode_admit_right,
+     ctrl_admit_right,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     PIR_STATE_SEC_BIT(PIR_STATE_SEC_FT),
+     SRC_RIGHT | SRC_FT_RIGHT,
+     NULL},
+    {"admit-lr",
+     set_mode_admit_lr,
+     ctrl_admit_lr,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     PIR_STATE_SEC_BIT(PIR_STATE_SEC_FT),
+     SRC_LR | SRC_FT_LEFT | SRC_FT_RIGHT,
+     NULL},
+    {"ws-body",
+     set_mode_body,
+     ctrl_body,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LR | SRC_TORSO,
+     NULL},
+    {"ws-body-qp",
+     set_mode_body,
+     ctrl_body,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_QP,
+     0,
+     SRC_LR | SRC_TORSO,
      NULL},
     {"bisplend",
-     set_mode_bisplend,
+     NULL,
      ctrl_bisplend,
+     NULL,
+     gen_mode_bisplend,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LR,
+     NULL},
+    {"bisplend-rel",
+     NULL,
+     ctrl_bisplend,
+     NULL,
+     gen_mode_bisplend_rel,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_LR,
      NULL},
     {"sdh-set-left",
      sdh_set_left,
      NULL,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_SDH_LEFT,
      NULL},
     {"sdh-set-right",
      sdh_set_right,
      NULL,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_SDH_RIGHT,
      NULL},
     {"pinch-left",
      sdh_pinch_left,
      NULL,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_SDH_LEFT,
      NULL},
     {"pinch-right",
      sdh_pinch_right,
      NULL,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     SRC_SDH_RIGHT,
      NULL},
     {"k-pt",
      set_mode_k_pt,
      NULL,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     0,
      NULL},
     {"k-pr",
      set_mode_k_pr,
      NULL,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     0,
      NULL},
     {"k-f",
      set_mode_k_f,
      NULL,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     0,
+     NULL},
+    {"lim-dq",
+     set_mode_lim_dq,
+     NULL,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     0,
+     NULL},
+    {"lim-ddq",
+     set_mode_lim_ddq,
+     NULL,
+     NULL,
+     NULL,
+     0,
+     PIR_BACKEND_DLS,
+     0,
+     0,
      NULL},
-    {NULL, NULL, NULL, NULL} };
+    {NULL, NULL, NULL, NULL, NULL, 0, PIR_BACKEND_DLS, 0, 0, NULL} };
 
 
 static const double tf_ident[] = {1,0,0, 0,1,0, 0,0,1, 0,0,0};
 
-int main( int argc, char **argv ) {
-    sns_init();
+static int opt_shm;
+static int shm_own;             ///< shm mapped here rather than handed in
+
+void pirctrl_args( int argc, char **argv ) {
     memset(&cx, 0, sizeof(cx));
     cx.dt = 1.0 / 250;
 
     /*-- args --*/
-    for( int c; -1 != (c = getopt(argc, argv, "V?hH" SNS_OPTSTRING)); ) {
+    for( int c; -1 != (c = getopt(argc, argv, "scV?hH" SNS_OPTSTRING)); ) {
         switch(c) {
             SNS_OPTCASES;
+        case 's':
+            opt_shm = 1;
+            break;
+        case 'c':
+            cx.contact_hold = 1;
+            break;
         default:
             SNS_DIE( "Invalid argument: %s\n", optarg );
         }
     }
+}
 
-    sns_start();
-
+void pirctrl_init( struct pir_shm *shm ) {
     // open channel
     sns_chan_open( &cx.chan_js,           "joystick",     NULL );
     sns_chan_open( &cx.chan_ctrl,         "pir-ctrl",     NULL );
@@ -222,23 +620,38 @@ int main( int argc, char **argv ) {
     sns_chan_open( &cx.chan_reg_cam,      "pir-reg-cam",  NULL );
     sns_chan_open( &cx.chan_reg_ee,       "pir-reg-ee",   NULL );
     sns_chan_open( &cx.chan_complete,     "pir-complete", NULL );
+    sns_chan_open( &cx.chan_contact,      "pir-contact",  NULL );
+
+    if( shm ) {
+        // fused with pirfilt, which writes it from another thread
+        cx.shm = shm;
+    } else if( opt_shm ) {
+        cx.shm = pir_shm_open( PIR_SHM_NAME, 0 );
+        SNS_REQUIRE( cx.shm, "Could not open shared state\n" );
+        shm_own = 1;
+    }
     {
         ach_channel_t *chans[] = {&cx.chan_state_pir, &cx.chan_js, NULL};
         sns_sigcancel( chans, sns_sig_term_default );
     }
 
     // alloc messages
+    cx.msg_state = (struct pir_state_msg*)malloc( pir_state_msg_size(PIR_STATE_SEC_ALL) );
     cx.msg_ref = sns_msg_motor_ref_alloc( PIR_MAX_MSG_AXES );
     cx.msg_ref->mode = SNS_MOTOR_MODE_VEL;
 
-    // memory
-    aa_mem_region_init( &cx.modereg, 64 * 1024 );
+    // memory and mode generation
+    pir_modegen_start( &cx );
 
     // setup reflex controller
     for( size_t i = 0; i < PIR_AXIS_CNT; i ++ ) {
         cx.q_min[i] = -2*M_PI;
         cx.q_max[i] = M_PI;
+        cx.dq_max[i] = 1.0;
+        cx.ddq_max[i] = 4.0;
     }
+    cx.dq_max[PIR_AXIS_T] = 0.5;
+    cx.ddq_max[PIR_AXIS_T] = 1.0;
     // left/right controller
     for( int side = 0; side < 2; side++ ) {
         int lwa, sdh;
@@ -247,7 +660,7 @@ int main( int argc, char **argv ) {
         cx.G[side].n_q = 7;
         cx.G[side].J =  cx.state.J_wp[side];
         cx.G[side].act.q =  &cx.state.q[lwa];
-        cx.G[side].act.dq = &cx.state.dq[lwa];
+        cx.G[side].act.dq = &cx.state.est.dq[lwa];
         cx.G[side].act.S = cx.state.S_wp[side];
         cx.G[side].act.F = cx.state.F[side];
         cx.G[side].ref.q =  &cx.ref.q[lwa];
@@ -257,7 +670,7 @@ int main( int argc, char **argv ) {
         cx.G[side].ref.S = AA_NEW0_AR( double, 8 );
         cx.G[side].ref.F = AA_NEW0_AR( double, 6 );
         cx.G[side].ref.dx = AA_NEW0_AR( double, 6 );
-        cx.G[side].act.dx = AA_NEW0_AR( double, 6 );
+        cx.G[side].act.dx = cx.state.dx_wp[side];
         for( size_t i = 0; i < 3; i ++ ) {
             cx.G[side].x_min[i] = -10;
             cx.G[side].x_max[i] = 10;
@@ -270,7 +683,7 @@ int main( int argc, char **argv ) {
     cx.G_LR.n_q = 14;
     //cx.G_R.J =  cx.state.J_wp_R;
     cx.G_LR.act.q =  &cx.state.q[PIR_AXIS_L0];
-    cx.G_LR.act.dq = &cx.state.dq[PIR_AXIS_L0];
+    cx.G_LR.act.dq = &cx.state.est.dq[PIR_AXIS_L0];
     //cx.G_R.act.S = cx.state.S_wp_R;
     //cx.G_R.act.F = cx.state.F_R;
     cx.G_LR.ref.q =  &cx.ref.q[PIR_AXIS_L0];
@@ -291,7 +704,7 @@ int main( int argc, char **argv ) {
     cx.G_T.n_q = 1;
     cx.G_T.J =  NULL;
     cx.G_T.act.q =  &cx.state.q[PIR_AXIS_T];
-    cx.G_T.act.dq = &cx.state.dq[PIR_AXIS_T];
+    cx.G_T.act.dq = &cx.state.est.dq[PIR_AXIS_T];
     cx.G_T.act.S = NULL;
     cx.G_T.act.F = NULL;
     cx.G_T.ref.q =  &cx.ref.q[PIR_AXIS_T];
@@ -343,8 +756,10 @@ int main( int argc, char **argv ) {
 
     if( clock_gettime( ACH_DEFAULT_CLOCK, &cx.now ) )
         SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
+}
 
-    /* -- RUN -- */
+void pirctrl_run( void ) {
+    struct timespec tick = cx.now;
     while (!sns_cx.shutdown) {
 
         // get state
@@ -354,19 +769,33 @@ int main( int argc, char **argv ) {
             //SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
 
         // control
-        control();
+        control( ~0u );
 
-        cx.now = sns_time_add_ns(cx.now, (int64_t)(cx.dt*1e9) );
-        clock_nanosleep( ACH_DEFAULT_CLOCK, TIMER_ABSTIME,
-                         &cx.now, NULL );
+        tick = sns_time_add_ns(tick, (int64_t)(cx.dt*1e9) );
+        wait_tick( &tick );
+        cx.now = tick;
 
         aa_mem_region_local_release();
 
     }
 
+    pir_modegen_stop( &cx );
+    if( shm_own ) pir_shm_close( cx.shm );
+}
+
+#ifndef PIR_FUSED
+int main( int argc, char **argv ) {
+    sns_init();
+    pirctrl_args( argc, argv );
+    sns_start();
+
+    pirctrl_init( NULL );
+    pirctrl_run();
+
     sns_end();
     return 0;
 }
+#endif
 
 #define CASE_HAVE_MSG        \
     case ACH_OK: ;           \
@@ -378,34 +807,162 @@ int main( int argc, char **argv ) {
     case ACH_STALE_FRAMES: ; \
     case ACH_TIMEOUT         \
 
-static void update(void) {
-    // config
-    {
-        size_t frame_size;
-        ach_status_t r = ach_get( &cx.chan_config, &cx.config, sizeof(cx.config), &frame_size,
-                                  NULL, ACH_O_LAST );
-        switch(r) {
-        CASE_HAVE_MSG:
-            SNS_REQUIRE( frame_size == sizeof(cx.config), "Invalid config size: %lu\n", frame_size );
-            pir_kin( cx.config.q, &cx.tf_rel, &cx.tf_abs );
-            break;
-        CASE_NO_MSG: break;
-        default:
-            SNS_LOG(LOG_ERR, "Failed to get config: %s\n", ach_result_to_string(r) );
+static void update_shm( unsigned fields ) {
+    int r = pir_shm_get( cx.shm, &cx.health, &cx.state, &cx.config,
+                         cx.state_time_ns, fields, cx.shm_gen );
+    if( r < 0 ) {
+        SNS_LOG(LOG_ERR, "Failed to read shared state\n" );
+    } else if( r & PIR_SHM_BIT(PIR_SHM_CONFIG) ) {
+        pir_kin( cx.config.q, &cx.tf_rel, &cx.tf_abs );
+        pir_hist_push( &cx.hist, cx.state_time_ns[PIR_STATE_SEC_JOINTS], cx.tf_abs );
+    }
+}
+
+/*
+ * Shared-memory fields the running mode reads.  The config is always
+ * read, since the kinematic history and registration need it whatever
+ * the mode.
+ */
+static unsigned mode_fields( void ) {
+    unsigned fields = (cx.mode && cx.mode->state_fields) ? cx.mode->state_fields : PIR_SHM_ALL;
+    return fields | PIR_SHM_BIT(PIR_SHM_CONFIG);
+}
+
+/*
+ * Merge one state message, return its sections or -1 if none.
+ *
+ * With shared memory the message only signals new state, which is
+ * then copied from the shared snapshot.
+ */
+static int merge_state( const struct timespec *deadline ) {
+    // with shared memory, the channel only wakes us, so skip to the latest
+    int flags = (deadline ? ACH_O_WAIT : 0) | (cx.shm ? ACH_O_LAST : 0);
+    size_t frame_size;
+    ach_status_t r = ach_get( &cx.chan_state_pir, cx.msg_state,
+                              pir_state_msg_size(PIR_STATE_SEC_ALL), &frame_size,
+                              deadline, flags );
+    switch(r) {
+    CASE_HAVE_MSG:
+        if( 0 == pir_state_msg_check(cx.msg_state, frame_size) ) {
+            if( cx.shm ) {
+                update_shm( mode_fields() );
+                return (int)cx.msg_state->sections;
+            }
+            cx.health = cx.msg_state->health;
+            unsigned sections = pir_state_msg_unpack( cx.msg_state, &cx.state );
+            for( size_t i = 0; i < PIR_STATE_SEC_CNT; i ++ ) {
+                if( sections & PIR_STATE_SEC_BIT(i) )
+                    cx.state_time_ns[i] = cx.msg_state->time_ns[i];
+            }
+            return (int)sections;
+        } else {
+            SNS_LOG(LOG_ERR, "Invalid state message\n");
+            return 0;
         }
+    CASE_NO_MSG: break;
+    default:
+        SNS_LOG(LOG_ERR, "Failed to get frame: %s\n", ach_result_to_string(r) );
     }
+    return -1;
+}
 
-    // state
-    {
-        size_t frame_size;
-        ach_status_t r = ach_get( &cx.chan_state_pir, &cx.state, sizeof(cx.state), &frame_size,
-                                  NULL, ACH_O_LAST );
-        switch(r) {
-        CASE_HAVE_MSG: break;
-        CASE_NO_MSG: break;
-            break;
-        default:
-            SNS_LOG(LOG_ERR, "Failed to get frame: %s\n", ach_result_to_string(r) );
+/* Sleep until deadline, running the mode on each wake section */
+static void wait_tick( const struct timespec *deadline ) {
+    if( cx.mode && cx.mode->wake_sections ) {
+        int sections;
+        while( (sections = merge_state(deadline)) >= 0 ) {
+            if( (unsigned)sections & cx.mode->wake_sections ) {
+                if( clock_gettime( ACH_DEFAULT_CLOCK, &cx.now ) )
+                    SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
+                update_js();
+                if( !cx.mode ) break;
+                control( cx.mode->sources );
+                if( !cx.mode || !cx.mode->wake_sections ) break;
+            }
+        }
+    }
+    clock_nanosleep( ACH_DEFAULT_CLOCK, TIMER_ABSTIME, deadline, NULL );
+}
+
+/*
+ * Registrations carry the capture time of their markers, but were
+ * paired with the kinematics when they were computed, just before we
+ * receive them.  Find the wrist at capture and now so the registration
+ * can be moved to the kinematics at its capture time; composing it
+ * with the current kinematics then predicts it forward to this tick.
+ */
+static int reg_wrist( const struct sns_msg_header *header, int side,
+                      double bEw_c[7], double bEw[7] )
+{
+    int64_t t_c = PIR_MSG_TIME_NS(*header);
+    if( NULL == cx.tf_abs || t_c >= PIR_TIMESPEC_NS(cx.now) ) return -1;
+    if( pir_hist_get( &cx.hist, t_c, side, bEw_c ) ) {
+        SNS_LOG( LOG_DEBUG, "Registration older than kinematic history\n" );
+        return -1;
+    }
+    AA_MEM_CPY( bEw, AA_MATCOL(cx.tf_abs, 7,
+                               (PIR_LEFT == side) ? PIR_TF_LEFT_WRIST2 : PIR_TF_RIGHT_WRIST2), 7 );
+    return 0;
+}
+
+/* Joystick, whose B button halts */
+static void update_js(void) {
+    size_t frame_size;
+    struct sns_msg_joystick *msg = NULL;
+    ach_status_t r = sns_msg_local_get( &cx.chan_js, (void**)&msg,
+                                        &frame_size,
+                                        NULL, ACH_O_LAST );
+
+    // validate
+    switch(r) {
+    CASE_HAVE_MSG:
+        if( msg->header.n == JS_AXES &&
+            frame_size == sns_msg_joystick_size(msg) )
+        {
+            if( msg->buttons & GAMEPAD_BUTTON_B ) {
+                memset(cx.ref.user, 0, sizeof(cx.ref.user[0])*JS_AXES);
+                halt();
+            } else {
+                memcpy(cx.ref.user, msg->axis, sizeof(cx.ref.user[0])*msg->header.n);
+                cx.ref.user_button = msg->buttons;
+            }
+        }
+    break;
+    CASE_NO_MSG: break;
+    default:
+        SNS_LOG(LOG_ERR, "Error getting joystick message\n");
+    }
+}
+
+static void update(void) {
+    if( cx.shm ) {
+        // copy only what the running mode reads
+        update_shm( mode_fields() );
+    } else {
+        // config
+        int have_config = 0;
+        {
+            size_t frame_size;
+            ach_status_t r = ach_get( &cx.chan_config, &cx.config, sizeof(cx.config), &frame_size,
+                                      NULL, ACH_O_LAST );
+            switch(r) {
+            CASE_HAVE_MSG:
+                SNS_REQUIRE( frame_size == sizeof(cx.config), "Invalid config size: %lu\n", frame_size );
+                pir_kin( cx.config.q, &cx.tf_rel, &cx.tf_abs );
+                have_config = 1;
+                break;
+            CASE_NO_MSG: break;
+            default:
+                SNS_LOG(LOG_ERR, "Failed to get config: %s\n", ach_result_to_string(r) );
+            }
+        }
+
+        // state, messages carry only changed sections so merge each one
+        while( merge_state(NULL) >= 0 );
+
+        // the config is published with the joints section, key it by their time
+        if( have_config ) {
+            pir_hist_push( &cx.hist, cx.state_time_ns[PIR_STATE_SEC_JOINTS], cx.tf_abs );
         }
     }
 
@@ -418,7 +975,14 @@ static void update(void) {
         CASE_HAVE_MSG:
             if( 0 == sns_msg_tf_check_size(msg,frame_size) ) {
                 if( 2 == msg->header.n ) {
-                    AA_MEM_CPY( cx.bEc, msg->tf[1].data, 7 );
+                    // markers are on the right hand
+                    double bEw_c[7], bEw[7], D[7];
+                    if( 0 == reg_wrist( &msg->header, PIR_RIGHT, bEw_c, bEw ) ) {
+                        aa_tf_qutr_mulc( bEw_c, bEw, D );
+                        aa_tf_qutr_mul( D, msg->tf[1].data, cx.bEc );
+                    } else {
+                        AA_MEM_CPY( cx.bEc, msg->tf[1].data, 7 );
+                    }
                 } else {
                     SNS_LOG(LOG_ERR, "Unexpected registration count\n");
                 }
@@ -462,6 +1026,7 @@ static void update(void) {
         CASE_HAVE_MSG:
             if( 0 == sns_msg_tf_check_size(msg,frame_size) ) {
                 if( 2 == msg->header.n ) {
+                    // offsets are in the wrist frame, wrist motion since capture doesn't move them
                     AA_MEM_CPY( cx.lElp, msg->tf[PIR_LEFT].data, 7 );
                     AA_MEM_CPY( cx.rErp, msg->tf[PIR_RIGHT].data, 7 );
                 } else {
@@ -477,41 +1042,119 @@ static void update(void) {
         }
     }
 
-    // joystick
-    {
-        size_t frame_size;
-        struct sns_msg_joystick *msg = NULL;
-        ach_status_t r = sns_msg_local_get( &cx.chan_js, (void**)&msg,
-                                            &frame_size,
-                                            NULL, ACH_O_LAST );
+    update_js();
 
-        // validate
-        switch(r) {
-        CASE_HAVE_MSG:
-            if( msg->header.n == JS_AXES &&
-                frame_size == sns_msg_joystick_size(msg) )
-            {
-                if( msg->buttons & GAMEPAD_BUTTON_B ) {
-                    if( strcmp(cx.msg_ctrl.mode, "halt") ) {
-                        printf("HALT\n");
-                    }
-                    strcpy( cx.msg_ctrl.mode, "halt" );
-                    memset(cx.ref.user, 0, sizeof(cx.ref.user[0])*JS_AXES);
-                    cx.mode = NULL;
-                } else {
-                    memcpy(cx.ref.user, msg->axis, sizeof(cx.ref.user[0])*msg->header.n);
-                    cx.ref.user_button = msg->buttons;
-                }
-            }
+    // contact, before new modes so a stop is not overridden
+    contact();
+
+    //mode
+    set_mode();
+    pir_modegen_poll( &cx );
+}
+
+static void halt(void) {
+    if( strcmp(cx.msg_ctrl.mode, "halt") ) {
+        printf("HALT\n");
+    }
+    strcpy( cx.msg_ctrl.mode, "halt" );
+    cx.mode = NULL;
+    cx.gen_seq++; // drop pending generation
+}
+
+/* Sources that desc needs but that are stale */
+static unsigned stale_sources( const struct pir_mode_desc *desc ) {
+    return desc->sources ?
+        pir_health_stale( &cx.health, PIR_TIMESPEC_NS(cx.now), desc->sources ) : 0;
+}
+
+/* Axes of the mode that pirfilt flagged after accepting a jump */
+static unsigned anom_axes( const struct pir_mode_desc *desc ) {
+    static const struct { int src; size_t i; size_t n; } src_axes[] = {
+        {PIR_SRC_TORSO, PIR_AXIS_T, 1},
+        {PIR_SRC_LEFT, PIR_AXIS_L0, 7},
+        {PIR_SRC_RIGHT, PIR_AXIS_R0, 7},
+        {PIR_SRC_SDH_LEFT, PIR_AXIS_SDH_L0, 7},
+        {PIR_SRC_SDH_RIGHT, PIR_AXIS_SDH_R0, 7} };
+    unsigned axes = 0;
+    for( size_t k = 0; k < sizeof(src_axes)/sizeof(src_axes[0]); k ++ ) {
+        if( desc->sources & PIR_SRC_BIT(src_axes[k].src) ) {
+            axes |= ((1u << src_axes[k].n) - 1) << src_axes[k].i;
+        }
+    }
+    return cx.health.anom & axes;
+}
+
+static struct pir_mode_desc *find_mode( const char *name ) {
+    for( size_t i = 0; mode_desc[i].name != NULL; i ++ ) {
+        if( 0 == strcmp(name, mode_desc[i].name) ) {
+            return &mode_desc[i];
+        }
+    }
+    return NULL;
+}
+
+/* Compliant hold of a contacting arm */
+static const struct pir_admit_param contact_admit = {
+    .sel = {1, 1, 1, 1, 1, 1},
+    .F_ref = {0, 0, 0, 0, 0, 0},
+    .M = {1, 1, 1, .1, .1, .1},
+    .B = {50, 50, 50, 5, 5, 5}
+};
+
+static void contact(void) {
+    size_t frame_size;
+    struct pir_msg_contact msg;
+    ach_status_t r = ach_get( &cx.chan_contact, &msg, sizeof(msg), &frame_size,
+                              NULL, ACH_O_LAST );
+    switch(r) {
+    CASE_HAVE_MSG:
+        if( frame_size != sizeof(msg) ) {
+            SNS_LOG(LOG_ERR, "Invalid contact message size\n");
+            return;
+        }
         break;
-        CASE_NO_MSG: break;
-        default:
-            SNS_LOG(LOG_ERR, "Error getting joystick message\n");
+    CASE_NO_MSG: return;
+    default:
+        SNS_LOG(LOG_ERR, "Failed to get frame: %s\n", ach_result_to_string(r) );
+        return;
+    }
+
+    // force controlled modes expect contact
+    if( cx.mode && (cx.mode->wake_sections & PIR_STATE_SEC_BIT(PIR_STATE_SEC_FT)) )
+        return;
+
+    const unsigned both = (1u << PIR_LEFT) | (1u << PIR_RIGHT);
+    for( int side = 0; side < 2; side ++ ) {
+        if( msg.sides & (1u << side) ) {
+            SNS_LOG( LOG_WARNING, "contact on %s arm: 0x%x\n",
+                     PIR_LEFT == side ? "left" : "right", msg.cause[side] );
         }
     }
 
-    //mode
-    set_mode();
+    // no mode, but a generated trajectory may be about to start
+    if( !cx.mode ) {
+        halt();
+        return;
+    }
+
+    const char *hold = (both == (msg.sides & both)) ? "admit-lr" :
+        (msg.sides & (1u << PIR_LEFT)) ? "admit-left" : "admit-right";
+    struct pir_mode_desc *desc = cx.contact_hold ? find_mode( hold ) : NULL;
+    if( desc ) {
+        size_t n = sizeof(contact_admit) / sizeof(double);
+        size_t size = sizeof(struct pir_msg) + (n-1) * sizeof(double);
+        struct pir_msg *msg_ctrl = (struct pir_msg*)aa_mem_region_local_alloc( size );
+        memset( msg_ctrl, 0, size );
+        strcpy( msg_ctrl->mode, desc->name );
+        msg_ctrl->salt = cx.msg_ctrl.salt;
+        msg_ctrl->seq_no = cx.msg_ctrl.seq_no;
+        msg_ctrl->n = n;
+        memcpy( &msg_ctrl->x[0].f, &contact_admit, sizeof(contact_admit) );
+        start_mode( desc, msg_ctrl, size );
+    }
+    if( !desc || cx.mode != desc ) {
+        halt();
+    }
 }
 
 
@@ -523,36 +1166,81 @@ static void set_mode(void) {
                                         &frame_size, NULL, ACH_O_LAST );
     if( ACH_OK == r || ACH_MISSED_FRAME == r ) {
         msg_ctrl->mode[63] = '\0';
+        // new mode may read any field
+        if( cx.shm ) update_shm( PIR_SHM_ALL );
         printf( "ctrl_msg: `%s', seqno: %"PRIu64", salt: %"PRIu64", n: %"PRIu64"\n",
                 msg_ctrl->mode, msg_ctrl->seq_no, msg_ctrl->salt,
                 msg_ctrl->n
 		);
-        for( size_t i = 0; mode_desc[i].name != NULL; i ++ ) {
-            if( 0 == strcmp(msg_ctrl->mode, mode_desc[i].name) ) {
-                printf("found mode: %s\n", mode_desc[i].name);
-                if( mode_desc[i].init ) {
-                    if( 0 == mode_desc[i].init( &cx, msg_ctrl ) &&
-                        mode_desc[i].run )
-                    {
-                        memcpy( &cx.msg_ctrl, msg_ctrl, sizeof(cx.msg_ctrl) );
-                        cx.mode = &mode_desc[i];
-                    }
-                }
-                break;
-            }
+        struct pir_mode_desc *desc = find_mode( msg_ctrl->mode );
+        if( desc ) {
+            printf("found mode: %s\n", desc->name);
+            start_mode( desc, msg_ctrl, frame_size );
         }
     }
 
 }
 
-static void control(void) {
+static void start_mode( struct pir_mode_desc *desc, struct pir_msg *msg_ctrl, size_t size ) {
+    unsigned stale = stale_sources( desc );
+    if( stale ) {
+        SNS_LOG( LOG_ERR, "Not starting `%s', stale sources: 0x%x\n", desc->name, stale );
+        return;
+    }
+    unsigned anom = anom_axes( desc );
+    if( anom ) {
+        SNS_LOG( LOG_ERR, "Not starting `%s', joint anomalies on axes 0x%x\n", desc->name, anom );
+        return;
+    }
+    if( desc->append ) {
+        // the running mode keeps its data buffer
+        if( 0 == desc->append( &cx, msg_ctrl ) ) {
+            memcpy( &cx.msg_ctrl, msg_ctrl, sizeof(cx.msg_ctrl) );
+            cx.mode = desc;
+        }
+    } else if( desc->gen ) {
+        // hold until the generator finishes
+        if( 0 == pir_modegen_submit( &cx, desc, msg_ctrl, size ) ) {
+            cx.mode = NULL;
+        }
+    } else if( desc->init ) {
+        cx.md_init = pir_modegen_take( &cx );
+        if( cx.md_init &&
+            0 == desc->init( &cx, msg_ctrl ) &&
+            desc->run )
+        {
+            memcpy( &cx.msg_ctrl, msg_ctrl, sizeof(cx.msg_ctrl) );
+            pir_modegen_activate( &cx, cx.md_init );
+            cx.mode = desc;
+            cx.gen_seq++; // drop pending generation
+        }
+        cx.md_init = NULL;
+    }
+}
+
+/* Run the mode and send refs to the drivers among sources */
+static void control( unsigned sources ) {
     // dispatch
     memset( cx.ref.dq, 0, sizeof(cx.ref.dq[0])*PIR_AXIS_CNT );
+    // hold rather than control on frozen state
+    if( cx.mode ) {
+        unsigned stale = stale_sources( cx.mode );
+        if( stale ) {
+            SNS_LOG( LOG_ERR, "Stale sources 0x%x, holding\n", stale );
+            halt();
+        }
+    }
+    if( cx.mode ) {
+        unsigned anom = anom_axes( cx.mode );
+        if( anom ) {
+            SNS_LOG( LOG_ERR, "Joint anomalies on axes 0x%x, holding\n", anom );
+            halt();
+        }
+    }
     if( cx.mode ) {
         if( cx.mode->term&&
             cx.mode->term(&cx) )
         {
-            aa_mem_region_release(&cx.modereg);
             cx.mode = NULL;
         } else if ( cx.mode->run ) {
             cx.mode->run( &cx );
@@ -562,14 +1250,22 @@ static void control(void) {
     // send ref
     sns_msg_set_time( &cx.msg_ref->header, &cx.now, VALID_NS );
     // torso
-    control_n( 1, PIR_AXIS_T, &cx.chan_ref_torso );
+    if( sources & PIR_SRC_BIT(PIR_SRC_TORSO) )
+        control_n( 1, PIR_AXIS_T, &cx.chan_ref_torso, &cx.ref_ns[0] );
     // left
-    control_n( 7, PIR_AXIS_L0, &cx.chan_ref_left );
+    if( sources & PIR_SRC_BIT(PIR_SRC_LEFT) )
+        control_n( 7, PIR_AXIS_L0, &cx.chan_ref_left, &cx.ref_ns[1] );
     // right
-    control_n( 7, PIR_AXIS_R0, &cx.chan_ref_right );
+    if( sources & PIR_SRC_BIT(PIR_SRC_RIGHT) )
+        control_n( 7, PIR_AXIS_R0, &cx.chan_ref_right, &cx.ref_ns[2] );
 }
 
-static void control_n( uint32_t n, size_t i, ach_channel_t *chan ) {
+static void control_n( uint32_t n, size_t i, ach_channel_t *chan, int64_t *t_put ) {
+    // the drivers expect refs at the control rate, woken cycles add none
+    int64_t now = PIR_TIMESPEC_NS(cx.now);
+    if( *t_put && now - *t_put < (int64_t)(REF_PERIOD_MIN * cx.dt * 1e9) ) return;
+    *t_put = now;
+
     memcpy( &cx.msg_ref->u[0], &cx.ref.dq[i], sizeof(cx.msg_ref->u[0])*n );
     cx.msg_ref->mode = SNS_MOTOR_MODE_VEL;
     cx.msg_ref->header.n = n;
@@ -44,6 +44,7 @@
  */
 
 #include <argp.h>
+#include <getopt.h>
 #include <syslog.h>
 #include <sns.h>
 #include <signal.h>
@@ -54,15 +55,27 @@
 #include <reflex.h>
 #include "piranha.h"
 
-void dump(struct pir_state *state);
+void dump(const struct pir_state_msg *msg);
 
 int main( int argc, char **argv ) {
 
     ach_channel_t chan;
+    const char *opt_chan = "pir-state";
+    for( int c; -1 != (c = getopt(argc, argv, "c:?" SNS_OPTSTRING)); ) {
+        switch(c) {
+            SNS_OPTCASES;
+        case 'c':
+            // e.g. a decimated stream from pirfilt -o
+            opt_chan = optarg;
+            break;
+        default:
+            SNS_DIE( "Invalid argument: %s\n", optarg );
+        }
+    }
     sns_start();
 
     // open channel
-    sns_chan_open( &chan,   "pir-state",   NULL );
+    sns_chan_open( &chan,   opt_chan,   NULL );
     {
         ach_channel_t *chans[] = {&chan, NULL};
         sns_sigcancel( chans, sns_sig_term_default );
@@ -72,14 +85,18 @@ int main( int argc, char **argv ) {
     // state
     /* -- RUN -- */
     while (!sns_cx.shutdown) {
-        struct pir_state state;
+        struct pir_state_msg *msg;
         size_t frame_size;
-        ach_status_t r = ach_get( &chan, &state, sizeof(state), &frame_size,
-                                  NULL, ACH_O_LAST );
+        ach_status_t r = sns_msg_local_get( &chan, (void**)&msg, &frame_size,
+                                            NULL, ACH_O_LAST );
         switch(r) {
         case ACH_OK:
         case ACH_MISSED_FRAME:
-            dump(&state);
+            if( 0 == pir_state_msg_check(msg, frame_size) ) {
+                dump(msg);
+            } else {
+                SNS_LOG(LOG_ERR, "Invalid state message\n");
+            }
         case ACH_CANCELED:
         case ACH_TIMEOUT:
         case ACH_STALE_FRAMES:
@@ -87,12 +104,36 @@ int main( int argc, char **argv ) {
         default:
             SNS_LOG(LOG_ERR, "Failed to get frame: %s\n", ach_result_to_string(r) );
         }
+        aa_mem_region_local_release();
     }
 }
 
-void dump(struct pir_state *state) {
-    double ql[4], xl[3];
-    aa_tf_duqu2qv( state->S_wp[PIR_LEFT], ql, xl );
-    printf("xl: "); aa_dump_vec( stdout, xl, 3 );
+void dump(const struct pir_state_msg *msg) {
+    struct pir_state X;
+    unsigned sections = pir_state_msg_unpack( msg, &X );
+#define HAS(sec) (sections & PIR_STATE_SEC_BIT(PIR_STATE_SEC_ ## sec))
 
+    printf("seq: %"PRIu64"\n", msg->seq );
+    if( HAS(JOINTS) ) {
+        printf("q: "); aa_dump_vec( stdout, X.q, PIR_AXIS_CNT );
+    }
+    if( HAS(FT) ) {
+        printf("Fl: "); aa_dump_vec( stdout, X.F[PIR_LEFT], 6 );
+        printf("Fr: "); aa_dump_vec( stdout, X.F[PIR_RIGHT], 6 );
+    }
+    if( HAS(WRIST) ) {
+        double ql[4], xl[3], qr[4], xr[3];
+        aa_tf_duqu2qv( X.S_wp[PIR_LEFT], ql, xl );
+        aa_tf_duqu2qv( X.S_wp[PIR_RIGHT], qr, xr );
+        printf("xl: "); aa_dump_vec( stdout, xl, 3 );
+        printf("xr: "); aa_dump_vec( stdout, xr, 3 );
+    }
+    if( HAS(EST) ) {
+        printf("dq: "); aa_dump_vec( stdout, X.est.dq, PIR_AXIS_CNT );
+    }
+    if( HAS(TWIST) ) {
+        printf("dxl: "); aa_dump_vec( stdout, X.dx_wp[PIR_LEFT], 6 );
+        printf("dxr: "); aa_dump_vec( stdout, X.dx_wp[PIR_RIGHT], 6 );
+    }
+#undef HAS
 }
@@ -49,31 +49,107 @@
 #include <signal.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <gamepad.h>
 #include <amino.h>
 #include "piranha.h"
 
 
+/*
+ * Each input channel has a reader thread that blocks on it alone,
+ * validates each message into a sample, and passes it to the main
+ * thread through a single-producer, single-consumer ring.  The main
+ * thread wakes on the first sample from any input, so a quiet channel
+ * never delays a busy one.
+ */
+
+enum filt_in {
+    IN_LEFT      = PIR_SRC_LEFT,
+    IN_RIGHT     = PIR_SRC_RIGHT,
+    IN_SDH_LEFT  = PIR_SRC_SDH_LEFT,
+    IN_SDH_RIGHT = PIR_SRC_SDH_RIGHT,
+    IN_TORSO     = PIR_SRC_TORSO,
+    IN_FT_LEFT   = PIR_SRC_FT_LEFT,
+    IN_FT_RIGHT  = PIR_SRC_FT_RIGHT,
+    IN_CNT       = PIR_SRC_CNT
+};
+
+static const struct {
+    const char *name;
+    size_t n;           ///< joint count, 0 for F/T
+    size_t i;           ///< first axis, or side for F/T
+    double rate;        ///< expected sample rate, Hz
+} in_desc[IN_CNT] = {
+    {"state-left",     7, PIR_AXIS_L0,     100},
+    {"state-right",    7, PIR_AXIS_R0,     100},
+    {"sdhstate-left",  7, PIR_AXIS_SDH_L0, 10},
+    {"sdhstate-right", 7, PIR_AXIS_SDH_R0, 10},
+    {"state-torso",    1, PIR_AXIS_T,      100},
+    {"ft-left",        0, PIR_LEFT,        500},
+    {"ft-right",       0, PIR_RIGHT,       500}
+};
+
+#define FILT_RING 16            ///< samples per input ring, power of 2
+#define FILT_WAIT_NS (100 * 1000 * 1000)
+#define FILT_HEALTH_NS (10 * 1000 * 1000)   ///< longest main loop wait
+#define FILT_STALE_PERIODS 10   ///< missed samples before a source is stale
+#define FILT_EXTRAP_MAX .02     ///< longest joint extrapolation, s
+
+struct filt_sample {
+    int64_t time_ns;
+    double x[7];        ///< positions, or the F/T wrench
+    double dx[7];       ///< velocities
+};
+
+struct filt_input {
+    ach_channel_t chan;
+    pthread_t thread;
+    struct filt_sample ring[FILT_RING];
+    size_t head;        ///< written by the reader
+    size_t tail;        ///< written by the main thread
+    struct filt_sample last;    ///< newest applied sample
+    int has_last;
+    int64_t t_ns;               ///< newest sample time, 0 before the first
+};
+
+/*
+ * Decimated output streams, each on its own channel with its own rate
+ * and sections.  Sections updated between publications accumulate, so
+ * a slow stream still sees every kind of change.
+ */
+#define FILT_OUT_MAX 8
+
+struct filt_out {
+    ach_channel_t chan;
+    int64_t period_ns;
+    int64_t next_ns;            ///< earliest next publication
+    unsigned sections;          ///< sections carried
+    unsigned pending;           ///< sections updated since the last publication
+    struct pir_state_msg *msg;
+};
 
 typedef struct {
-    ach_channel_t chan_state_torso;
-    ach_channel_t chan_state_left;
-    ach_channel_t chan_state_right;
-    ach_channel_t chan_ft_left;
-    ach_channel_t chan_ft_right;
+    struct filt_input in[IN_CNT];
+    sem_t in_sem;       ///< posted for each queued sample
+
     ach_channel_t chan_ftbias[2];
     ach_channel_t chan_state_pir;
-    ach_channel_t chan_sdhstate_left;
-    ach_channel_t chan_sdhstate_right;
-    ach_channel_t chan_config;;
+    ach_channel_t chan_config;
+    ach_channel_t chan_contact;
+    ach_channel_t chan_payload;
 
 
     double F_raw[2][6]; ///< raw F/T reading, left
+    int64_t ft_ns[2];   ///< sample time of each F/T reading, 0 before the first
 
     double r_ft_rel[4];  ///< Rotation from E.E. to F/T
     double S_eer[2][8];   ///< Relative End-effector TF
 
     double r_ft[2][4];    ///< Absolute F/T rotation
+    struct pir_payload payload[2];
+    struct pir_ftid ftid[2];
+    unsigned ident;             ///< sides being identified
 
     struct pir_config Q;
     struct pir_state state;
@@ -81,54 +157,135 @@ typedef struct {
 
     double S0[2][8];
 
+    struct pir_shm *shm;  ///< optional shared memory state
+
+    struct pir_state_msg *msg_state;
+    int64_t time_ns[PIR_STATE_SEC_CNT];  ///< source time of each section
+    int64_t pub_ns;                       ///< last pir-state publication
+    struct pir_health health;
+
+    struct pir_abg abg;
+    struct pir_anom anom;
+    pthread_t anom_thread;
+
+    struct pir_contact_limits contact_lim;
+    struct pir_contact contact[2];
+    struct pir_msg_contact msg_contact;
+
+    struct filt_out out[FILT_OUT_MAX];
+    size_t n_out;
+
     sig_atomic_t rebias;
+    sig_atomic_t reident;
+    sig_atomic_t reanom;
+
+    int opt_shm;
+    int shm_own;                ///< shm mapped here rather than handed in
+    const char *opt_out[FILT_OUT_MAX];
+    size_t n_opt_out;
 } cx_t;
 
-cx_t cx;
+static cx_t cx;
 
 static void update(void);
-static int update_n(size_t n, size_t i, ach_channel_t *chan, struct timespec *ts);
+static void detect_contact( int u_f[2] );
+static void *filt_reader( void *arg );
+static void *filt_anom_log( void *arg );
+static void filt_out_open( const char *arg );
+static void filt_out_put( unsigned sections );
+static void filt_health( void );
 
 static void sighandler_hup ( int sig );
-static int bias_ft( void );
+static void sighandler_usr1 ( int sig );
+static void sighandler_usr2 ( int sig );
+static int bias_ft( unsigned sides );
+static void update_payload( void );
+static void ident_start( unsigned sides );
+static void ident_update( int u_f[2] );
 
 
 
-int main( int argc, char **argv ) {
+void pirfilt_args( int argc, char **argv ) {
     memset(&cx, 0, sizeof(cx));
 
-
     /*-- args --*/
-    for( int c; -1 != (c = getopt(argc, argv, "V?hH" SNS_OPTSTRING)); ) {
+    cx.contact_lim.F_max = 50;
+    cx.contact_lim.M_max = 6;
+    cx.contact_lim.dF_max = 500;
+    cx.anom.lim.jump = 1*M_PI/180;
+    cx.anom.lim.reject = 10*M_PI/180;
+    for( int c; -1 != (c = getopt(argc, argv, "sf:m:r:o:j:J:V?hH" SNS_OPTSTRING)); ) {
         switch(c) {
             SNS_OPTCASES;
+        case 's':
+            cx.opt_shm = 1;
+            break;
+        case 'f':
+            cx.contact_lim.F_max = atof(optarg);
+            break;
+        case 'm':
+            cx.contact_lim.M_max = atof(optarg);
+            break;
+        case 'r':
+            cx.contact_lim.dF_max = atof(optarg);
+            break;
+        case 'j':
+            cx.anom.lim.jump = atof(optarg) * M_PI/180;
+            break;
+        case 'J':
+            cx.anom.lim.reject = atof(optarg) * M_PI/180;
+            break;
+        case 'o':
+            SNS_REQUIRE( cx.n_opt_out < FILT_OUT_MAX, "Too many output streams\n" );
+            cx.opt_out[cx.n_opt_out++] = optarg;
+            break;
         default:
             SNS_DIE( "Invalid argument: %s\n", optarg );
         }
     }
+    // a jump limit above the reject limit would leave rejections unlogged
+    SNS_REQUIRE( !(cx.anom.lim.jump > 0 && cx.anom.lim.reject > 0) ||
+                 cx.anom.lim.jump <= cx.anom.lim.reject,
+                 "Jump limit -j exceeds the reject limit -J\n" );
+}
 
-    sns_init();
-    sns_start();
-
+void pirfilt_init( struct pir_shm *shm ) {
     // open channel
-    sns_chan_open( &cx.chan_state_torso, "state-torso", NULL );
-    sns_chan_open( &cx.chan_state_left,  "state-left",  NULL );
-    sns_chan_open( &cx.chan_state_right, "state-right", NULL );
-    sns_chan_open( &cx.chan_sdhstate_left,  "sdhstate-left",  NULL );
-    sns_chan_open( &cx.chan_sdhstate_right, "sdhstate-right", NULL );
-    sns_chan_open( &cx.chan_ft_left,      "ft-left",  NULL );
-    sns_chan_open( &cx.chan_ft_right,     "ft-right", NULL );
+    for( size_t i = 0; i < IN_CNT; i ++ ) {
+        sns_chan_open( &cx.in[i].chan, in_desc[i].name, NULL );
+    }
     sns_chan_open( &cx.chan_ftbias[PIR_LEFT],  "ft-bias-left",  NULL );
     sns_chan_open( &cx.chan_ftbias[PIR_RIGHT], "ft-bias-right", NULL );
     sns_chan_open( &cx.chan_state_pir,   "pir-state",  NULL );
     sns_chan_open( &cx.chan_config,   "pir-config",  NULL );
+    sns_chan_open( &cx.chan_contact,  "pir-contact", NULL );
+    sns_chan_open( &cx.chan_payload,  "pir-payload", NULL );
+    for( size_t i = 0; i < cx.n_opt_out; i ++ ) {
+        filt_out_open( cx.opt_out[i] );
+    }
 
-    {
-        ach_channel_t *chans[] = {&cx.chan_state_left, &cx.chan_state_torso, NULL};
+    cx.msg_state = (struct pir_state_msg*)calloc( 1, pir_state_msg_size(PIR_STATE_SEC_ALL) );
+
+    if( shm ) {
+        // fused with pirctrl, whose thread reads it directly
+        cx.shm = shm;
+    } else if( cx.opt_shm ) {
+        cx.shm = pir_shm_open( PIR_SHM_NAME, 1 );
+        SNS_REQUIRE( cx.shm, "Could not open shared state\n" );
+        cx.shm_own = 1;
+    }
+
+    // fused, pirctrl owns cancellation and the readers time out anyway
+    if( !shm ) {
+        ach_channel_t *chans[IN_CNT+1];
+        for( size_t i = 0; i < IN_CNT; i ++ ) chans[i] = &cx.in[i].chan;
+        chans[IN_CNT] = NULL;
         sns_sigcancel( chans, sns_sig_term_default );
     }
 
     /*-- Init constants --*/
+    pir_payload_default( &cx.payload[PIR_LEFT] );
+    pir_payload_default( &cx.payload[PIR_RIGHT] );
     {
         // F/T rotation
         double R0[9] = { 0, 1, 0,
@@ -156,62 +313,290 @@ int main( int argc, char **argv ) {
         if( sigaction(SIGHUP, &act, NULL) ) {
             SNS_DIE( "Could not install signal handler\n");
         }
+        act.sa_handler = &sighandler_usr1;
+        if( sigaction(SIGUSR1, &act, NULL) ) {
+            SNS_DIE( "Could not install signal handler\n");
+        }
+        act.sa_handler = &sighandler_usr2;
+        if( sigaction(SIGUSR2, &act, NULL) ) {
+            SNS_DIE( "Could not install signal handler\n");
+        }
     }
 
 
-    /* -- RUN -- */
+    /* -- THREADS -- */
+    if( sem_init( &cx.in_sem, 0, 0 ) ) {
+        SNS_DIE( "sem_init failed: '%s'\n", strerror(errno) );
+    }
+    for( size_t i = 0; i < IN_CNT; i ++ ) {
+        int r = pthread_create( &cx.in[i].thread, NULL, filt_reader, &cx.in[i] );
+        if( r ) SNS_DIE( "pthread_create failed: '%s'\n", strerror(r) );
+    }
+    {
+        int r = pthread_create( &cx.anom_thread, NULL, filt_anom_log, NULL );
+        if( r ) SNS_DIE( "pthread_create failed: '%s'\n", strerror(r) );
+    }
+}
+
+void *pirfilt_run( void *arg ) {
+    (void)arg;
     while (!sns_cx.shutdown) {
         update();
+        update_payload();
         if( cx.rebias ) {
-            bias_ft();
+            cx.rebias = 0;
+            bias_ft( 0x3 );
+        }
+        if( cx.reident ) {
+            cx.reident = 0;
+            ident_start( 0x3 );
+        }
+        if( cx.reanom ) {
+            cx.reanom = 0;
+            SNS_LOG( LOG_NOTICE, "Clearing joint anomalies 0x%x\n", cx.anom.accepted );
+            pir_anom_reset( &cx.anom );
         }
         aa_mem_region_local_release();
     }
 
-    sns_end();
-    return 0;
+    for( size_t i = 0; i < IN_CNT; i ++ ) {
+        pthread_join( cx.in[i].thread, NULL );
+    }
+    pthread_join( cx.anom_thread, NULL );
+
+    if( cx.shm_own ) pir_shm_close( cx.shm );
+    return NULL;
 }
 
-static int update_n(size_t n, size_t i, ach_channel_t *chan, struct timespec *ts ) {
-    size_t frame_size;
-    void *buf = NULL;
-    ach_status_t r = sns_msg_local_get( chan, &buf,
-                                        &frame_size,
-                                        ts, ACH_O_LAST | (ts ? ACH_O_WAIT : 0) );
+#ifndef PIR_FUSED
+int main( int argc, char **argv ) {
+    pirfilt_args( argc, argv );
 
-    switch(r) {
-    case ACH_OK:
-    case ACH_MISSED_FRAME:
-    {
-        struct sns_msg_motor_state *msg = (struct sns_msg_motor_state*)buf;
+    sns_init();
+    sns_start();
+
+    pirfilt_init( NULL );
+    pirfilt_run( NULL );
+
+    sns_end();
+    return 0;
+}
+#endif
+
+/* Validate a message from input k into a sample */
+static int filt_parse( size_t k, const void *buf, size_t frame_size, struct filt_sample *s )
+{
+    size_t n = in_desc[k].n;
+    if( n ) {
+        const struct sns_msg_motor_state *msg = (const struct sns_msg_motor_state*)buf;
         // TODO: better validation
-        if( n == msg->header.n &&
-            frame_size == sns_msg_motor_state_size_n((uint32_t)n) )
+        if( frame_size < sizeof(msg->header) ||
+            n != msg->header.n ||
+            frame_size != sns_msg_motor_state_size_n((uint32_t)n) )
+        {
+            SNS_LOG(LOG_ERR, "Invalid motor_state message\n");
+            return 0;
+        }
+        for( size_t j = 0; j < n; j++ ) {
+            s->x[j] = msg->X[j].pos;
+            s->dx[j] = msg->X[j].vel;
+        }
+        s->time_ns = PIR_MSG_TIME_NS(msg->header);
+    } else {
+        const struct sns_msg_vector *msg = (const struct sns_msg_vector*)buf;
+        // TODO: better validation
+        if( frame_size < sizeof(msg->header) ||
+            6 != msg->header.n ||
+            frame_size != sns_msg_vector_size_n(6) )
+        {
+            SNS_LOG(LOG_ERR, "Invalid F/T message\n");
+            return 0;
+        }
+        for( size_t i = 0; i < 6; i++ ) {
+            s->x[i] = -msg->x[i];
+        }
+        s->time_ns = PIR_MSG_TIME_NS(msg->header);
+    }
+    return 1;
+}
+
+static void *filt_reader( void *arg )
+{
+    struct filt_input *in = (struct filt_input*)arg;
+    size_t k = (size_t)(in - cx.in);
+    size_t max = AA_MAX( sns_msg_motor_state_size_n(7), sns_msg_vector_size_n(6) );
+    void *buf = malloc( max );
+
+    while( !sns_cx.shutdown ) {
+        struct timespec now;
+        if( clock_gettime( ACH_DEFAULT_CLOCK, &now ) )
+            SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
+        struct timespec timeout = sns_time_add_ns( now, FILT_WAIT_NS );
+
+        size_t frame_size;
+        ach_status_t r = ach_get( &in->chan, buf, max, &frame_size,
+                                  &timeout, ACH_O_WAIT | ACH_O_LAST );
+        switch(r) {
+        case ACH_OK:
+        case ACH_MISSED_FRAME:
         {
-            for( size_t j = 0; j < n; j++ ) {
-                if( fabs(cx.state.q[i+j] -  msg->X[j].pos) > 1*M_PI/180 ) {
-                    printf("delta %"PRIuPTR": %f -> %f (%f)\n",
-                           i+j,
-                           cx.state.q[i+j], msg->X[j].pos,
-                           cx.state.q[i+j] -  msg->X[j].pos);
+            size_t head = in->head;
+            if( head - __atomic_load_n( &in->tail, __ATOMIC_ACQUIRE ) >= FILT_RING ) {
+                SNS_LOG( LOG_WARNING, "Dropped sample from %s\n", in_desc[k].name );
+            } else if( filt_parse( k, buf, frame_size, &in->ring[head % FILT_RING] ) ) {
+                __atomic_store_n( &in->head, head + 1, __ATOMIC_RELEASE );
+                if( sem_post( &cx.in_sem ) ) {
+                    SNS_LOG( LOG_ERR, "sem_post failed: '%s'\n", strerror(errno) );
                 }
-                cx.state.q[i+j] =  msg->X[j].pos;
-                cx.state.dq[i+j] = msg->X[j].vel;
             }
-            return 1;
+            break;
+        }
+        case ACH_TIMEOUT:
+        case ACH_STALE_FRAMES:
+        case ACH_CANCELED:
+            break;
+        default:
+            SNS_LOG(LOG_ERR, "Failed ach_get: %s\n", ach_result_to_string(r) );
+        }
+    }
+
+    free( buf );
+    return NULL;
+}
+
+/* Log joint anomalies away from the sensor loop */
+static void *filt_anom_log( void *arg )
+{
+    (void)arg;
+    uint64_t n_lost = 0;
+    const struct timespec period = {0, FILT_WAIT_NS};
+    while( !sns_cx.shutdown ) {
+        struct pir_anom_event e;
+        while( pir_anom_pop( &cx.anom, &e ) ) {
+            SNS_LOG( LOG_WARNING, "joint %"PRIu32" jump: %f -> %f (%f)%s\n",
+                     e.axis, e.q_expect, e.q, e.q - e.q_expect,
+                     e.rejected ? ", rejected" : "" );
+        }
+        uint64_t lost = __atomic_load_n( &cx.anom.n_lost, __ATOMIC_RELAXED );
+        if( lost != n_lost ) {
+            SNS_LOG( LOG_WARNING, "%"PRIu64" joint anomalies not logged\n", lost - n_lost );
+            n_lost = lost;
+        }
+        clock_nanosleep( ACH_DEFAULT_CLOCK, 0, &period, NULL );
+    }
+    return NULL;
+}
+
+/* Queue the samples of input k, returns nonzero if any */
+static int filt_drain( size_t k )
+{
+    struct filt_input *in = &cx.in[k];
+    size_t tail = in->tail;
+    size_t head = __atomic_load_n( &in->head, __ATOMIC_ACQUIRE );
+    if( tail == head ) return 0;
+
+    size_t n = in_desc[k].n, i = in_desc[k].i;
+    for( ; tail != head; tail ++ ) {
+        const struct filt_sample *s = &in->ring[tail % FILT_RING];
+        in->t_ns = AA_MAX( in->t_ns, s->time_ns );
+        if( n ) {
+            if( in->has_last && s->time_ns < in->last.time_ns ) continue;
+            struct filt_sample z = *s;
+            if( in->has_last ) {
+                // jumps beyond what the velocity explains are anomalies
+                double dt = (double)(z.time_ns - in->last.time_ns) / 1e9;
+                for( size_t j = 0; j < n; j++ ) {
+                    double q_e = in->last.x[j] + dt * in->last.dx[j];
+                    if( pir_anom_check( &cx.anom, z.time_ns, i+j, q_e, z.x[j] ) ) {
+                        z.x[j] = q_e;
+                        z.dx[j] = in->last.dx[j];
+                    }
+                }
+            }
+            in->last = z;
+            in->has_last = 1;
         } else {
-            SNS_LOG(LOG_ERR, "Invalid motor_state message\n");
+            AA_MEM_CPY( cx.F_raw[i], s->x, 6 );
+            cx.ft_ns[i] = s->time_ns;
         }
-        break;
     }
-    case ACH_TIMEOUT:
-    case ACH_STALE_FRAMES:
-    case ACH_CANCELED:
-        break;
-    default:
-        SNS_LOG(LOG_ERR, "Failed ach_get: %s\n", ach_result_to_string(r) );
+    __atomic_store_n( &in->tail, tail, __ATOMIC_RELEASE );
+
+    // the section is only as new as its older sensor
+    if( 0 == n ) {
+        int64_t t = INT64_MAX;
+        for( size_t j = 0; j < 2; j ++ ) {
+            if( cx.ft_ns[j] ) t = AA_MIN( t, cx.ft_ns[j] );
+        }
+        cx.time_ns[PIR_STATE_SEC_FT] = t;
     }
-    return 0;
+    return 1;
+}
+
+/*
+ * The chains are sampled at different times, so move each one along
+ * its measured velocity to the newest joint sample, giving one
+ * coherent configuration.  A source more than FILT_EXTRAP_MAX behind is
+ * held at its last sample with zero velocity rather than extrapolated.
+ */
+static void filt_align( void )
+{
+    int64_t t_pub = INT64_MIN;
+    for( size_t k = 0; k < IN_CNT; k ++ ) {
+        if( in_desc[k].n && cx.in[k].has_last ) {
+            t_pub = AA_MAX( t_pub, cx.in[k].last.time_ns );
+        }
+    }
+    if( INT64_MIN == t_pub ) return;
+
+    for( size_t k = 0; k < IN_CNT; k ++ ) {
+        const struct filt_sample *s = &cx.in[k].last;
+        size_t n = in_desc[k].n, i = in_desc[k].i;
+        if( 0 == n || !cx.in[k].has_last ) continue;
+        double dt = (double)(t_pub - s->time_ns) / 1e9;
+        int hold = dt > FILT_EXTRAP_MAX;
+        for( size_t j = 0; j < n; j++ ) {
+            cx.state.q[i+j] = hold ? s->x[j] : s->x[j] + dt * s->dx[j];
+            cx.state.dq[i+j] = hold ? 0 : s->dx[j];
+        }
+    }
+    cx.time_ns[PIR_STATE_SEC_JOINTS] = t_pub;
+
+    // filter each axis at its own sample time, then predict to t_pub
+    double z_q[PIR_AXIS_CNT] = {0}, z_dq[PIR_AXIS_CNT] = {0};
+    int64_t z_t[PIR_AXIS_CNT] = {0};
+    for( size_t k = 0; k < IN_CNT; k ++ ) {
+        const struct filt_sample *s = &cx.in[k].last;
+        size_t n = in_desc[k].n, i = in_desc[k].i;
+        if( 0 == n || !cx.in[k].has_last ) continue;
+        for( size_t j = 0; j < n; j++ ) {
+            z_q[i+j] = s->x[j];
+            z_dq[i+j] = s->dx[j];
+            z_t[i+j] = s->time_ns;
+        }
+    }
+    pir_abg_update( &cx.abg, z_q, z_dq, z_t );
+    pir_abg_get( &cx.abg, t_pub, &cx.state.est );
+    cx.time_ns[PIR_STATE_SEC_EST] = t_pub;
+}
+
+/*
+ * Wrenches from the F/T readings.  Each sensor is read at its own
+ * time, so rotate its frame along the wrist angular velocity from the
+ * joint time to that sample before compensating the payload.
+ */
+static void filt_ft( double *tf_abs )
+{
+    for( size_t i = 0; i < 2; i ++ ) {
+        const double *r = tf_abs + 7*((PIR_LEFT == i) ? PIR_TF_LEFT_FT : PIR_TF_RIGHT_FT);
+        double dt = cx.ft_ns[i] ? (double)(cx.ft_ns[i] - cx.time_ns[PIR_STATE_SEC_JOINTS]) / 1e9 : 0;
+        dt = AA_MAX( -FILT_EXTRAP_MAX, AA_MIN(FILT_EXTRAP_MAX, dt) );
+        double w[3], r_w[4];
+        for( size_t j = 0; j < 3; j ++ ) w[j] = dt * cx.state.dx_wp[i][3+j];
+        aa_tf_rotvec2quat( w, r_w );
+        aa_tf_qmul( r_w, r, cx.r_ft[i] );
+    }
+    pir_payload_comp( cx.payload, cx.r_ft, cx.F_raw, cx.state.F );
 }
 
 /* static int update_sdh() { */
@@ -234,49 +619,6 @@ static int update_n(size_t n, size_t i, ach_channel_t *chan, struct timespec *ts
 /*     return 0; */
 /* } */
 
-static int update_ft(double *F, ach_channel_t *chan, struct timespec *ts ) {
-    size_t frame_size;
-    void *buf = NULL;
-    ach_status_t r = sns_msg_local_get( chan, &buf,
-                                        &frame_size,
-                                        ts, ACH_O_LAST | (ts ? ACH_O_WAIT : 0) );
-    switch(r) {
-    case ACH_OK:
-    case ACH_MISSED_FRAME:
-    {
-        struct sns_msg_vector *msg = (struct sns_msg_vector*)buf;
-        // TODO: better validation
-        if( 6 == msg->header.n &&
-            frame_size == sns_msg_vector_size_n(6) )
-        {
-            for( size_t i = 0; i < 6; i++ ) {
-                F[i] = -msg->x[i];
-            }
-            return 1;
-        } else {
-            SNS_LOG(LOG_ERR, "Invalid F/T message\n");
-        }
-        break;
-    }
-    case ACH_TIMEOUT:
-    case ACH_STALE_FRAMES:
-    case ACH_CANCELED:
-        break;
-    default:
-        SNS_LOG(LOG_ERR, "Failed ach_get: %s\n", ach_result_to_string(r) );
-    }
-    return 0;
-}
-
-/* static void rotate_ft( const double r_ft[4], const double *F_raw, double *F ) { */
-/*     // rotate */
-/*     aa_tf_qrot( r_ft, F_raw,   F); */
-/*     aa_tf_qrot( r_ft, F_raw+3, F+3 ); */
-
-/*     // subtract end-effector mass */
-/*     F[2] = F[2] - PIR_FT_WEIGHT - SDH_WEIGHT; */
-
-/*     // TODO: torque */
 /* } */
 
 
@@ -285,26 +627,49 @@ static void update(void) {
     if( clock_gettime( ACH_DEFAULT_CLOCK, &cx.now ) )
         SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
 
-    struct timespec timeout = sns_time_add_ns( cx.now, 1000 * 1000 * 1 );
-    int is_updated = 0;
-
-    // axes
-    int u_l = update_n(7, PIR_AXIS_L0, &cx.chan_state_left, &timeout);
-    int u_r = update_n(7, PIR_AXIS_R0, &cx.chan_state_right, &timeout);
-    is_updated = is_updated || u_l || u_r;
-
-    int u_sl = update_n(7, PIR_AXIS_SDH_L0, &cx.chan_sdhstate_left, &timeout);
-    int u_sr = update_n(7, PIR_AXIS_SDH_R0, &cx.chan_sdhstate_right, &timeout);
-
-    int u_t = update_n(1, PIR_AXIS_T, &cx.chan_state_torso, &timeout);
+    // wait for a sample from any input, sem_timedwait takes a realtime deadline
+    struct timespec now_rt;
+    if( clock_gettime( CLOCK_REALTIME, &now_rt ) )
+        SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
+    struct timespec timeout = sns_time_add_ns( now_rt, FILT_HEALTH_NS );
+    if( sem_timedwait( &cx.in_sem, &timeout ) ) {
+        if( ETIMEDOUT != errno && EINTR != errno )
+            SNS_LOG( LOG_ERR, "sem_timedwait failed: '%s'\n", strerror(errno) );
+        // nothing new, but consumers still need to see sources go stale
+        if( clock_gettime( ACH_DEFAULT_CLOCK, &cx.now ) )
+            SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
+        filt_health();
+        // interrupted waits return early, keep health-only frames to the wait period
+        if( PIR_TIMESPEC_NS(cx.now) - cx.pub_ns < FILT_HEALTH_NS ) return;
+        cx.pub_ns = PIR_TIMESPEC_NS(cx.now);
+        cx.msg_state->seq++;
+        pir_state_msg_pack( cx.msg_state, &cx.state, 0, cx.time_ns );
+        cx.msg_state->health = cx.health;
+        ach_status_t r = ach_put( &cx.chan_state_pir, cx.msg_state, pir_state_msg_size(0) );
+        if( ACH_OK != r ) {
+            SNS_LOG( LOG_ERR, "Couldn't put ach frame: %s\n", ach_result_to_string(r) );
+        }
+        if( cx.shm ) {
+            pir_shm_put( cx.shm, &cx.health, &cx.state, &cx.Q, cx.time_ns, 0 );
+        }
+        return;
+    }
+    while( 0 == sem_trywait( &cx.in_sem ) );
+    if( clock_gettime( ACH_DEFAULT_CLOCK, &cx.now ) )
+        SNS_LOG( LOG_ERR, "clock_gettime failed: '%s'\n", strerror(errno) );
 
-    is_updated = is_updated || u_sl || u_sr || u_t;
+    int u[IN_CNT];
+    for( size_t i = 0; i < IN_CNT; i ++ ) u[i] = filt_drain(i);
+    filt_health();
 
-    // force-torque
-    int u_fl = update_ft( cx.F_raw[PIR_LEFT], &cx.chan_ft_left, &timeout );
-    int u_fr = update_ft( cx.F_raw[PIR_RIGHT], &cx.chan_ft_right, &timeout );
+    int u_fl = u[IN_FT_LEFT], u_fr = u[IN_FT_RIGHT];
+    int u_q = u[IN_LEFT] || u[IN_RIGHT] || u[IN_SDH_LEFT] || u[IN_SDH_RIGHT] || u[IN_TORSO];
+    int is_updated = u_q || u_fl || u_fr;
+    if( u_q ) filt_align();
 
-    is_updated = is_updated || u_fl || u_fr;
+    // only F/T changes without new joint positions
+    unsigned shm_fields = u_q ? PIR_SHM_ALL : PIR_SHM_BIT(PIR_SHM_F);
+    unsigned sections = u_q ? PIR_STATE_SEC_ALL : PIR_STATE_SEC_BIT(PIR_STATE_SEC_FT);
 
     if( is_updated ) {
 
@@ -312,10 +677,7 @@ static void update(void) {
         pir_kin_arm( &cx.state );
 
         // copy state
-        AA_MEM_CPY( &cx.Q.q[PIR_TF_LEFT_Q_SHOULDER0], &cx.state.q[PIR_AXIS_L0], 7 );
-        AA_MEM_CPY( &cx.Q.q[PIR_TF_RIGHT_Q_SHOULDER0], &cx.state.q[PIR_AXIS_R0], 7 );
-        AA_MEM_CPY( &cx.Q.q[PIR_TF_LEFT_SDH_Q_AXIAL], &cx.state.q[PIR_AXIS_SDH_L0], 7 );
-        AA_MEM_CPY( &cx.Q.q[PIR_TF_RIGHT_SDH_Q_AXIAL], &cx.state.q[PIR_AXIS_SDH_R0], 7 );
+        pir_state_config( cx.state.q, &cx.Q );
 
         // Update Transforms
         double *tf_rel, *tf_abs;
@@ -348,8 +710,11 @@ static void update(void) {
             /* printf("nr: "); aa_dump_vec( stdout, E_eer_r, 7 ); */
         }
 
+        // twists of the poses just computed
+        pir_kin_twist( &cx.state );
+
         // update ft
-        pir_kin_ft( tf_abs, &cx.state, cx.F_raw, cx.r_ft);
+        filt_ft( tf_abs );
 
         /* // testing */
         /* double tf_abs_old[7]; */
@@ -366,47 +731,176 @@ static void update(void) {
         /* printf("b:   "); aa_dump_vec( stdout, E_eer_new_b, 7 ); */
 
 
-        // send
-        ach_status_t r = ach_put( &cx.chan_state_pir, &cx.state,
-                                  sizeof(cx.state) );
+        // send, kinematic sections follow the joints
+        cx.time_ns[PIR_STATE_SEC_WRIST] = cx.time_ns[PIR_STATE_SEC_JOINTS];
+        cx.time_ns[PIR_STATE_SEC_JACOBIAN] = cx.time_ns[PIR_STATE_SEC_JOINTS];
+        cx.time_ns[PIR_STATE_SEC_EER] = cx.time_ns[PIR_STATE_SEC_JOINTS];
+        cx.time_ns[PIR_STATE_SEC_TWIST] = cx.time_ns[PIR_STATE_SEC_EST];
+        cx.msg_state->seq++;
+        pir_state_msg_pack( cx.msg_state, &cx.state, sections, cx.time_ns );
+        cx.msg_state->health = cx.health;
+        ach_status_t r = ach_put( &cx.chan_state_pir, cx.msg_state,
+                                  pir_state_msg_size(sections) );
+        cx.pub_ns = PIR_TIMESPEC_NS(cx.now);
 
         if( ACH_OK != r ) {
             SNS_LOG( LOG_ERR, "Couldn't put ach frame: %s\n", ach_result_to_string(r) );
         }
 
+        filt_out_put( sections );
+
         r = ach_put( &cx.chan_config, &cx.Q,
                      sizeof(cx.Q) );
 
         if( ACH_OK != r ) {
             SNS_LOG( LOG_ERR, "Couldn't put ach frame: %s\n", ach_result_to_string(r) );
         }
+
+        if( cx.shm ) {
+            pir_shm_put( cx.shm, &cx.health, &cx.state, &cx.Q, cx.time_ns, shm_fields );
+        }
+
+        int u_f[2] = {u_fl, u_fr};
+        ident_update( u_f );
+        detect_contact( u_f );
     }
 }
 
+/* Mark each source without a sample in FILT_STALE_PERIODS expected periods */
+static void filt_health( void )
+{
+    int64_t now = PIR_TIMESPEC_NS(cx.now);
+    unsigned stale = 0, seen = 0;
+    for( size_t k = 0; k < IN_CNT; k ++ ) {
+        int64_t t = cx.in[k].t_ns;
+        int64_t max_ns = (int64_t)(FILT_STALE_PERIODS * 1e9 / in_desc[k].rate);
+        if( t ) seen |= PIR_SRC_BIT(k);
+        if( !t || now - t > max_ns ) stale |= PIR_SRC_BIT(k);
+    }
 
-static int bias_ft( void ) {
+    unsigned change = (stale ^ cx.health.stale) & seen;
+    for( size_t k = 0; k < IN_CNT; k ++ ) {
+        if( change & PIR_SRC_BIT(k) ) {
+            SNS_LOG( LOG_WARNING, "Source `%s' %s\n", in_desc[k].name,
+                     (stale & PIR_SRC_BIT(k)) ? "stale" : "recovered" );
+        }
+    }
+
+    unsigned anom = cx.anom.accepted & ~cx.health.anom;
+    for( size_t i = 0; i < PIR_AXIS_CNT; i ++ ) {
+        if( anom & (1u << i) ) {
+            SNS_LOG( LOG_ERR, "Axis %zu jumped and was accepted, flagged until SIGUSR2\n", i );
+        }
+    }
+
+    cx.health.time_ns = now;
+    cx.health.stale = stale;
+    cx.health.seen = seen;
+    cx.health.anom = cx.anom.accepted;
+}
+
+/* Parse "channel:rate[:section,...]" and open the stream */
+static void filt_out_open( const char *arg )
+{
+    static const char *names[PIR_STATE_SEC_CNT] = {
+        [PIR_STATE_SEC_JOINTS]   = "joints",
+        [PIR_STATE_SEC_FT]       = "ft",
+        [PIR_STATE_SEC_WRIST]    = "wrist",
+        [PIR_STATE_SEC_JACOBIAN] = "jacobian",
+        [PIR_STATE_SEC_EER]      = "eer",
+        [PIR_STATE_SEC_EST]      = "est",
+        [PIR_STATE_SEC_TWIST]    = "twist"
+    };
+
+    char *spec = strdup( arg );
+    char *name = strtok( spec, ":" );
+    char *rate = strtok( NULL, ":" );
+    char *secs = strtok( NULL, ":" );
+    SNS_REQUIRE( name && rate && atof(rate) > 0,
+                 "Invalid output stream `%s', expected channel:rate[:sections]\n", arg );
+
+    struct filt_out *out = &cx.out[cx.n_out++];
+    out->period_ns = (int64_t)(1e9 / atof(rate));
+    out->sections = secs ? 0 : PIR_STATE_SEC_ALL;
+    for( char *sec = secs ? strtok(secs, ",") : NULL; sec; sec = strtok(NULL, ",") ) {
+        size_t i = 0;
+        while( i < PIR_STATE_SEC_CNT && strcmp(sec, names[i]) ) i++;
+        SNS_REQUIRE( i < PIR_STATE_SEC_CNT, "Unknown state section `%s'\n", sec );
+        out->sections |= PIR_STATE_SEC_BIT(i);
+    }
+    out->msg = (struct pir_state_msg*)calloc( 1, pir_state_msg_size(PIR_STATE_SEC_ALL) );
+    sns_chan_open( &out->chan, name, NULL );
+    free( spec );
+}
+
+static void filt_out_put( unsigned sections )
+{
+    int64_t now = PIR_TIMESPEC_NS(cx.now);
+    for( size_t i = 0; i < cx.n_out; i ++ ) {
+        struct filt_out *out = &cx.out[i];
+        out->pending |= sections & out->sections;
+        if( 0 == out->pending || now < out->next_ns ) continue;
+
+        out->msg->seq++;
+        pir_state_msg_pack( out->msg, &cx.state, out->pending, cx.time_ns );
+        out->msg->health = cx.health;
+        ach_status_t r = ach_put( &out->chan, out->msg, pir_state_msg_size(out->pending) );
+        if( ACH_OK != r ) {
+            SNS_LOG( LOG_ERR, "Couldn't put ach frame: %s\n", ach_result_to_string(r) );
+        }
+
+        out->pending = 0;
+        out->next_ns += out->period_ns;
+        if( out->next_ns <= now ) out->next_ns = now + out->period_ns;
+    }
+}
+
+static void detect_contact( int u_f[2] ) {
+    struct pir_msg_contact *msg = &cx.msg_contact;
+    msg->sides = 0;
+    msg->time_ns = 0;
+    for( int side = 0; side < 2; side ++ ) {
+        // each sensor's rate is over its own sample times
+        int64_t t_ns = cx.in[PIR_LEFT == side ? IN_FT_LEFT : IN_FT_RIGHT].t_ns;
+        msg->cause[side] = u_f[side] ?
+            pir_contact_update( &cx.contact[side], &cx.contact_lim,
+                                cx.state.F[side], t_ns ) :
+            0;
+        if( msg->cause[side] ) {
+            msg->sides |= 1u << side;
+            msg->time_ns = AA_MAX( msg->time_ns, t_ns );
+            AA_MEM_CPY( msg->F[side], cx.state.F[side], 6 );
+        }
+    }
+    if( msg->sides ) {
+        msg->seq_no++;
+        ach_status_t r = ach_put( &cx.chan_contact, msg, sizeof(*msg) );
+        if( ACH_OK != r ) {
+            SNS_LOG( LOG_ERR, "Couldn't put contact frame: %s\n", ach_result_to_string(r) );
+        }
+    }
+}
+
+
+static int bias_ft( unsigned sides ) {
 
     SNS_LOG( LOG_NOTICE, "Re-biasing F/T\n");
 
-    // F = -weight * k
     size_t n_msg = sns_msg_vector_size_n(6);
     struct sns_msg_vector *msg = (struct sns_msg_vector*) alloca(n_msg);
     msg->header.n = 6;
     sns_msg_header_fill(&msg->header);
     //sns_msg_set_time( &msg->header, &t_actual, 2*period_ns );
 
-    // Expected force in absolute frame
-    double F[6] = {0};
-    F[2] = F[2] - PIR_FT_WEIGHT - SDH_WEIGHT;
-
-    // Rotate force to F/T frame
-    // F_abs = R_ft * F_ft  => R_ft^T * F_abs = F_ft
+    // Expected payload wrench in the F/T frame
+    double W[2][6];
+    pir_payload_wrench( cx.payload, cx.r_ft, W );
 
     for( size_t i = 0; i < 2; i ++ ) {
-        double r_ft_inv[4];
-        aa_tf_qconj(cx.r_ft[i], r_ft_inv);
-        aa_tf_qrot( r_ft_inv, F, msg->x );
-        aa_tf_qrot( r_ft_inv, F+3, msg->x+3 );
+        if( !(sides & (1u << i)) ) continue;
+        AA_MEM_CPY( msg->x, W[i], 6 );
+        // the sensor now absorbs any residual offset
+        AA_MEM_ZERO( cx.payload[i].bias, 6 );
 
         // send message
         ach_status_t r = ach_put( &cx.chan_ftbias[i], msg, n_msg );
@@ -415,12 +909,95 @@ static int bias_ft( void ) {
         }
     }
 
-    // reset bias flag
-    cx.rebias = 0;
-
     return 0;
 }
 
+/* Apply the newest payload change, if any */
+static void update_payload( void ) {
+    struct pir_msg_payload msg;
+    size_t frame_size;
+    ach_status_t r = ach_get( &cx.chan_payload, &msg, sizeof(msg), &frame_size,
+                              NULL, ACH_O_LAST );
+    switch(r) {
+    case ACH_OK:
+    case ACH_MISSED_FRAME:
+        if( sizeof(msg) != frame_size ) {
+            SNS_LOG( LOG_ERR, "Invalid payload message\n" );
+            return;
+        }
+        pir_payload_set( cx.payload, &msg );
+        if( msg.parts & PIR_PAYLOAD_IDENT ) ident_start( msg.sides );
+        for( size_t i = 0; i < 2; i ++ ) {
+            if( msg.sides & (1u << i) ) {
+                SNS_LOG( LOG_NOTICE, "Payload %s: hand %.3f kg, object %.3f kg\n",
+                         PIR_LEFT == i ? "left" : "right",
+                         cx.payload[i].hand.mass, cx.payload[i].object.mass );
+            }
+        }
+        break;
+    case ACH_STALE_FRAMES:
+        break;
+    default:
+        SNS_LOG( LOG_ERR, "Failed ach_get: %s\n", ach_result_to_string(r) );
+    }
+}
+
+/*
+ * Identification runs while the arms move through different
+ * orientations.  Once a side has converged, its payload and bias
+ * replace the model.  The bias is fit over every sample, so it is
+ * compensated here rather than re-biasing the sensor from one reading.
+ */
+static void ident_start( unsigned sides ) {
+    for( size_t i = 0; i < 2; i ++ ) {
+        if( sides & (1u << i) ) {
+            SNS_LOG( LOG_NOTICE, "Identifying %s payload\n", PIR_LEFT == i ? "left" : "right" );
+            pir_ftid_init( &cx.ftid[i] );
+            cx.ident |= 1u << i;
+        }
+    }
+}
+
+static void ident_update( int u_f[2] ) {
+    for( size_t i = 0; i < 2; i ++ ) {
+        if( !(cx.ident & (1u << i)) || !u_f[i] ) continue;
+        struct pir_ftid *E = &cx.ftid[i];
+        pir_ftid_update( E, cx.r_ft[i], cx.F_raw[i] );
+        if( !pir_ftid_converged(E) ) continue;
+
+        // the hand is whatever the object does not explain
+        struct pir_payload *P = &cx.payload[i];
+        struct pir_payload_body B;
+        double bias[6];
+        pir_ftid_get( E, &B, bias );
+        double m = B.mass - P->object.mass;
+        if( m <= 0 ) {
+            SNS_LOG( LOG_ERR, "Identified %s payload %.3f kg is lighter than the object\n",
+                     PIR_LEFT == i ? "left" : "right", B.mass );
+        } else {
+            AA_MEM_CPY( P->bias, bias, 6 );
+            for( size_t j = 0; j < 3; j ++ ) {
+                P->hand.com[j] = (B.mass*B.com[j] - P->object.mass*P->object.com[j]) / m;
+            }
+            P->hand.mass = m;
+            SNS_LOG( LOG_NOTICE, "Identified %s hand: %.3f kg at (%.3f, %.3f, %.3f), %"PRIu64" samples\n",
+                     PIR_LEFT == i ? "left" : "right", P->hand.mass,
+                     P->hand.com[0], P->hand.com[1], P->hand.com[2], E->n );
+        }
+        cx.ident &= ~(1u << i);
+    }
+}
+
+static void sighandler_usr1 ( int sig ) {
+    (void)sig;
+    cx.reident = 1;
+}
+
+static void sighandler_usr2 ( int sig ) {
+    (void)sig;
+    cx.reanom = 1;
+}
+
 static void sighandler_hup ( int sig ) {
     (void)sig;
     if( SNS_LOG_PRIORITY(LOG_DEBUG) ) {
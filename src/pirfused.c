@@ -0,0 +1,91 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+/** Author: Neil Dantam
+ */
+
+#include <sns.h>
+#include <pthread.h>
+#include <amino.h>
+#include "piranha.h"
+
+/*
+ * pirfilt and pirctrl as threads of one process:
+ *
+ *     pirfused [pirctrl options] -- [pirfilt options]
+ *
+ * pirfilt writes the state into an in-process seqlock snapshot, the
+ * same single-writer structure as the -s shared memory, and pirctrl
+ * reads it without copying through ach.  The channels are still
+ * published for other readers.
+ */
+
+int main( int argc, char **argv ) {
+    sns_init();
+
+    pirctrl_args( argc, argv );
+    // getopt stops after "--", the rest belongs to pirfilt
+    int filt_argc = argc - optind + 1;
+    char **filt_argv = argv + optind - 1;
+    filt_argv[0] = argv[0];
+    optind = 0;
+    pirfilt_args( filt_argc, filt_argv );
+
+    sns_start();
+
+    struct pir_shm *shm = (struct pir_shm*)calloc( 1, sizeof(*shm) );
+    SNS_REQUIRE( shm, "Could not allocate state\n" );
+    shm->size = sizeof(*shm);
+
+    pirfilt_init( shm );
+    pirctrl_init( shm );
+
+    pthread_t filt_thread;
+    int r = pthread_create( &filt_thread, NULL, pirfilt_run, NULL );
+    if( r ) SNS_DIE( "pthread_create failed: '%s'\n", strerror(r) );
+
+    pirctrl_run();
+    pthread_join( filt_thread, NULL );
+
+    free( shm );
+    sns_end();
+    return 0;
+}
@@ -0,0 +1,270 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <syslog.h>
+#include <sns.h>
+#include <amino.h>
+#include <reflex.h>
+#include "piranha.h"
+
+/*
+ * Velocity control as a box constrained QP.
+ *
+ * The workspace task min |J dq - dx|^2 + k |dq|^2 becomes
+ *
+ *      min 1/2 dq' H dq - g' dq,   H = J'J + k I,  g = J' dx
+ *
+ * with per-joint bounds from the position, velocity, and acceleration
+ * limits.  With only bound constraints, a primal-dual active set
+ * method needs one reduced Cholesky solve per iteration, and starting
+ * from the last cycle's bound set it usually finishes in one or two.
+ */
+
+/* In-place Cholesky factor of n*n A */
+static int chol( size_t n, double *A ) {
+    for( size_t j = 0; j < n; j ++ ) {
+        double d = AA_MATREF(A,n,j,j);
+        for( size_t k = 0; k < j; k ++ ) d -= AA_MATREF(A,n,j,k) * AA_MATREF(A,n,j,k);
+        if( !(d > 0) ) return -1;
+        d = sqrt(d);
+        AA_MATREF(A,n,j,j) = d;
+        for( size_t i = j+1; i < n; i ++ ) {
+            double s = AA_MATREF(A,n,i,j);
+            for( size_t k = 0; k < j; k ++ ) s -= AA_MATREF(A,n,i,k) * AA_MATREF(A,n,j,k);
+            AA_MATREF(A,n,i,j) = s / d;
+        }
+    }
+    return 0;
+}
+
+/* Solve L L' x = b in place */
+static void chol_solve( size_t n, const double *L, double *x ) {
+    for( size_t i = 0; i < n; i ++ ) {
+        double s = x[i];
+        for( size_t k = 0; k < i; k ++ ) s -= AA_MATREF(L,n,i,k) * x[k];
+        x[i] = s / AA_MATREF(L,n,i,i);
+    }
+    for( size_t i = n; i-- > 0; ) {
+        double s = x[i];
+        for( size_t k = i+1; k < n; k ++ ) s -= AA_MATREF(L,n,k,i) * x[k];
+        x[i] = s / AA_MATREF(L,n,i,i);
+    }
+}
+
+int pir_qp_box( size_t n, const double *H, const double *g,
+                const double *lb, const double *ub,
+                int8_t *active, double *x )
+{
+    assert( n <= PIR_QP_MAX );
+    const double eps = 1e-12;
+    size_t max_iter = 2*n + 2;
+
+    for( size_t iter = 0; iter < max_iter; iter ++ ) {
+        // fix bound variables, collect free ones
+        size_t F[PIR_QP_MAX], nf = 0;
+        for( size_t i = 0; i < n; i ++ ) {
+            if( active[i] < 0 )      x[i] = lb[i];
+            else if( active[i] > 0 ) x[i] = ub[i];
+            else                     F[nf++] = i;
+        }
+
+        // H_FF x_F = g_F - H_FB x_B
+        double A[PIR_QP_MAX*PIR_QP_MAX], b[PIR_QP_MAX];
+        for( size_t a = 0; a < nf; a ++ ) {
+            size_t i = F[a];
+            double s = g[i];
+            for( size_t j = 0; j < n; j ++ ) {
+                if( active[j] ) s -= AA_MATREF(H,n,i,j) * x[j];
+            }
+            b[a] = s;
+            for( size_t c = 0; c < nf; c ++ ) {
+                AA_MATREF(A,nf,a,c) = AA_MATREF(H,n,i,F[c]);
+            }
+        }
+        if( nf ) {
+            if( chol(nf, A) ) return -1;
+            chol_solve( nf, A, b );
+            for( size_t a = 0; a < nf; a ++ ) x[F[a]] = b[a];
+        }
+
+        // free variables leaving the box become bound, bound variables
+        // with the wrong multiplier sign become free
+        int changed = 0;
+        for( size_t i = 0; i < n; i ++ ) {
+            if( 0 == active[i] ) {
+                if( x[i] < lb[i] - eps )      { active[i] = -1; changed = 1; }
+                else if( x[i] > ub[i] + eps ) { active[i] =  1; changed = 1; }
+            } else {
+                double grad = -g[i];
+                for( size_t j = 0; j < n; j ++ ) grad += AA_MATREF(H,n,i,j) * x[j];
+                if( (active[i] < 0 && grad < -eps) ||
+                    (active[i] > 0 && grad >  eps) )
+                {
+                    active[i] = 0;
+                    changed = 1;
+                }
+            }
+        }
+        if( !changed ) return 0;
+    }
+
+    // cycling, settle for the feasible point
+    for( size_t i = 0; i < n; i ++ ) {
+        x[i] = AA_MAX( lb[i], AA_MIN( ub[i], x[i] ) );
+    }
+    return 1;
+}
+
+void pir_qp_bound( pirctrl_cx_t *cx, size_t axis, double dq_prev,
+                   double *lb, double *ub )
+{
+    double v = cx->dq_max[axis];
+    double a = cx->ddq_max[axis];
+    double q = cx->state.q[axis];
+
+    // keep the stopping distance inside the position limits
+    double d_lo = q - cx->q_min[axis];
+    double d_hi = cx->q_max[axis] - q;
+    double lo = AA_MAX( -v, d_lo > 0 ? -sqrt(2*a*d_lo) : 0 );
+    double hi = AA_MIN(  v, d_hi > 0 ?  sqrt(2*a*d_hi) : 0 );
+
+    // acceleration, yielding to position and velocity when they conflict
+    double a_lo = dq_prev - a*cx->dt;
+    double a_hi = dq_prev + a*cx->dt;
+    if( a_lo > hi ) {
+        lo = hi;
+    } else if( a_hi < lo ) {
+        hi = lo;
+    } else {
+        lo = AA_MAX( lo, a_lo );
+        hi = AA_MIN( hi, a_hi );
+    }
+
+    *lb = lo;
+    *ub = hi;
+}
+
+void pir_qp_reset( pirctrl_cx_t *cx )
+{
+    for( int side = 0; side < 2; side ++ ) {
+        int lwa, sdh;
+        PIR_SIDE_INDICES( side, lwa, sdh );
+        (void)sdh;
+        AA_MEM_ZERO( cx->qp[side].active, PIR_QP_MAX );
+        AA_MEM_CPY( cx->qp[side].dq, &cx->state.dq[lwa], 7 );
+    }
+    _Static_assert( PIR_AXIS_L0 + 7 == PIR_AXIS_R0, "Invalid axis ordering" );
+    AA_MEM_ZERO( cx->qp_body.active, PIR_QP_MAX );
+    AA_MEM_CPY( cx->qp_body.dq, &cx->state.dq[PIR_AXIS_L0], 14 );
+    cx->qp_body.dq[14] = cx->state.dq[PIR_AXIS_T];
+}
+
+void pir_qp_warn_limit( pirctrl_cx_t *cx, struct pir_qp_ws *W, const char *name )
+{
+    // the clamped iterate is still feasible, so this is only worth a note
+    int64_t now = PIR_TIMESPEC_NS(cx->now);
+    if( W->t_warn && now - W->t_warn < PIR_QP_WARN_NS ) {
+        W->n_quiet++;
+        return;
+    }
+    SNS_LOG( LOG_WARNING, "%s qp hit its iteration limit (%lu more since last warning)\n",
+             name, W->n_quiet );
+    W->t_warn = now;
+    W->n_quiet = 0;
+}
+
+static int ctrl_ws_qp( pirctrl_cx_t *cx, int side )
+{
+    rfx_ctrl_ws_t *G = &cx->G[side];
+    struct pir_qp_ws *W = &cx->qp[side];
+    int lwa, sdh;
+    PIR_SIDE_INDICES( side, lwa, sdh );
+    (void)sdh;
+
+    double dx[6];
+    pir_ctrl_pose_twist( G->act.S, G->ref.S, G->ref.dx, cx->Kx.p, dx );
+
+    // H = J'J + k I, g = J' dx
+    double H[7*7], g[7], lb[7], ub[7];
+    for( size_t i = 0; i < 7; i ++ ) {
+        const double *Ji = AA_MATCOL(G->J, 6, i);
+        for( size_t j = 0; j < 7; j ++ ) {
+            AA_MATREF(H,7,i,j) = aa_la_dot( 6, Ji, AA_MATCOL(G->J, 6, j) );
+        }
+        AA_MATREF(H,7,i,i) += cx->Kx.dls;
+        g[i] = aa_la_dot( 6, Ji, dx );
+        pir_qp_bound( cx, (size_t)lwa + i, W->dq[i], lb+i, ub+i );
+    }
+
+    int r = pir_qp_box( 7, H, g, lb, ub, W->active, W->dq );
+    if( r < 0 ) {
+        pir_qp_reset( cx );
+        AA_MEM_ZERO( G->ref.dq, 7 );
+        return r;
+    } else if( 1 == r ) {
+        pir_qp_warn_limit( cx, W, (PIR_LEFT == side) ? "ws left" : "ws right" );
+    }
+    AA_MEM_CPY( G->ref.dq, W->dq, 7 );
+    return 0;
+}
+
+int pir_ctrl_ws( pirctrl_cx_t *cx, int side )
+{
+    if( cx->mode && PIR_BACKEND_QP == cx->mode->backend ) {
+        int r = ctrl_ws_qp( cx, side );
+        if( r ) {
+            SNS_LOG( LOG_ERR, "ws qp error: %d\n", r );
+        }
+        return r;
+    } else {
+        rfx_ctrl_ws_t *G = &cx->G[side];
+        int r = rfx_ctrl_ws_lin_vfwd( G, &cx->Kx, G->ref.dq );
+        if( RFX_OK != r ) {
+            SNS_LOG( LOG_ERR, "ws error: %s\n",
+                     rfx_status_string((rfx_status_t)r) );
+        }
+        return r;
+    }
+}
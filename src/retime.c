@@ -0,0 +1,178 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <syslog.h>
+#include <sns.h>
+#include <amino.h>
+#include <reflex.h>
+#include "piranha.h"
+
+/*
+ * Automatic timing of Cartesian splines.
+ *
+ * Joint speeds along a Cartesian path follow from the Jacobian, so
+ * the spline is sampled and tracked by integrating damped least
+ * squares inverse kinematics from the start configuration.  A segment
+ * whose peak joint or Cartesian speed ratio is r runs at its limit
+ * when its duration is scaled by r.  Blending couples neighboring
+ * segments, so this repeats until the ratios settle.
+ */
+
+#define RETIME_ITER    8
+#define RETIME_H       .01     ///< sampling step, s
+#define RETIME_TOL     .05     ///< accepted ratio error
+#define RETIME_DT_MIN  .1      ///< shortest segment, s
+#define RETIME_K       10      ///< drift correction gain
+#define RETIME_DLS     1e-3    ///< damping
+
+struct rfx_trajx_seg_list *
+pir_trajx_spline( aa_mem_region_t *reg, size_t n_pts, const double *S, const double *dt )
+{
+    struct rfx_trajx_point_list *plist = rfx_trajx_point_list_alloc( reg );
+    double t = 0;
+    rfx_trajx_point_list_addb_duqu( plist, t, 1, S );
+    for( size_t k = 1; k < n_pts; k ++ ) {
+        t += dt[k];
+        rfx_trajx_point_list_addb_duqu( plist, t, 1, S + 8*k );
+    }
+    return rfx_trajx_splend_generate( plist, reg );
+}
+
+/* Peak limit ratio r[k] of each segment k, ending at point k */
+static void peak_ratio( int side, const double q0[7], const double See[8],
+                        struct rfx_trajx_seg_list *segs,
+                        size_t n_pts, const double *dt, const double dq_max[7],
+                        const double x_max[2], double *r )
+{
+    static const double k_fb[6] = {RETIME_K, RETIME_K, RETIME_K,
+                                   RETIME_K, RETIME_K, RETIME_K};
+    double q[7];
+    AA_MEM_CPY( q, q0, 7 );
+    AA_MEM_ZERO( r, n_pts );
+
+    double t_f = rfx_trajx_seg_list_get_t_f( segs );
+    size_t k = 1;
+    double t_k = dt[1];
+    for( double t = 0; t <= t_f; t += RETIME_H ) {
+        while( k+1 < n_pts && t > t_k ) t_k += dt[++k];
+
+        double S_ref[8], dx[6], S_act[8], J[6*7];
+        rfx_trajx_seg_list_get_dx_duqu( segs, t, S_ref, dx );
+        pir_kin_arm_side( side, q, See, S_act, J );
+
+        // feedforward for the ratio, corrected for integration
+        double dq[7], dx_fb[6], dq_fb[7];
+        aa_la_dls( 6, 7, RETIME_DLS, J, dx, dq );
+        pir_ctrl_pose_twist( S_act, S_ref, dx, k_fb, dx_fb );
+        aa_la_dls( 6, 7, RETIME_DLS, J, dx_fb, dq_fb );
+
+        double rt = AA_MAX( aa_la_norm(3, dx) / x_max[0],
+                            aa_la_norm(3, dx+3) / x_max[1] );
+        for( size_t i = 0; i < 7; i ++ ) {
+            rt = AA_MAX( rt, fabs(dq[i]) / dq_max[i] );
+            q[i] += RETIME_H * dq_fb[i];
+        }
+        r[k] = AA_MAX( r[k], rt );
+    }
+}
+
+struct rfx_trajx_seg_list *
+pir_trajx_gen_auto( aa_mem_region_t *reg, int side,
+                    const double q0[7], const double See[8],
+                    size_t n_pts, const double *S, double *dt,
+                    const double dq_max[7], const double x_max[2] )
+{
+    if( n_pts < 2 ) return pir_trajx_spline( reg, n_pts, S, dt );
+
+    static const double x_max_default[2] = {PIR_TRAJX_V_MAX, PIR_TRAJX_W_MAX};
+    if( NULL == x_max ) x_max = x_max_default;
+
+    int *is_auto = AA_MEM_REGION_NEW_N( reg, int, n_pts );
+    double *r = AA_MEM_REGION_NEW_N( reg, double, n_pts );
+
+    // start from the average Cartesian speed limits
+    for( size_t k = 1; k < n_pts; k ++ ) {
+        is_auto[k] = !(dt[k] > 0);
+        if( is_auto[k] ) {
+            double q_a[4], v_a[3], q_b[4], v_b[3], q_e[4], w[3], v[3];
+            aa_tf_duqu2qv( S + 8*(k-1), q_a, v_a );
+            aa_tf_duqu2qv( S + 8*k, q_b, v_b );
+            aa_tf_qmulc( q_b, q_a, q_e );
+            aa_tf_qminimize( q_e );
+            aa_tf_quat2rotvec( q_e, w );
+            for( size_t i = 0; i < 3; i ++ ) v[i] = v_b[i] - v_a[i];
+            dt[k] = AA_MAX( RETIME_DT_MIN,
+                            AA_MAX( aa_la_norm(3, v) / x_max[0],
+                                    aa_la_norm(3, w) / x_max[1] ) );
+        }
+    }
+
+    // r always holds the ratios of the current segs
+    struct rfx_trajx_seg_list *segs = pir_trajx_spline( reg, n_pts, S, dt );
+    peak_ratio( side, q0, See, segs, n_pts, dt, dq_max, x_max, r );
+    for( size_t iter = 0; iter < RETIME_ITER; iter ++ ) {
+        int done = 1;
+        for( size_t k = 1; k < n_pts; k ++ ) {
+            if( !is_auto[k] || fabs(r[k] - 1) < RETIME_TOL ) continue;
+            double dt_k = AA_MAX( RETIME_DT_MIN, dt[k] * r[k] );
+            if( dt_k != dt[k] ) {
+                dt[k] = dt_k;
+                done = 0;
+            }
+        }
+        if( done ) break;
+        segs = pir_trajx_spline( reg, n_pts, S, dt );
+        peak_ratio( side, q0, See, segs, n_pts, dt, dq_max, x_max, r );
+    }
+
+    for( size_t k = 1; k < n_pts; k ++ ) {
+        if( r[k] > 1 + RETIME_TOL ) {
+            SNS_LOG( LOG_WARNING, "trajx segment %zu %s limits by %.2f\n", k,
+                     is_auto[k] ? "did not settle, exceeds" : "exceeds", r[k] );
+        }
+    }
+
+    return segs;
+}
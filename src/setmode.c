@@ -60,6 +60,7 @@ void pir_zero_refs(pirctrl_cx_t *cx) {
         AA_MEM_SET( cx->G[side].ref.q,  0, cx->G[side].n_q );
         AA_MEM_SET( cx->G[side].ref.dq, 0, cx->G[side].n_q );
     }
+    pir_qp_reset(cx);
 }
 
 int set_mode_nop(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
@@ -107,6 +108,27 @@ int set_mode_k_f(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
     return 0;
 }
 
+/* One value for every arm and hand axis, or one value per axis */
+static int set_limits( const char *name, double *lim, struct pir_msg *msg_ctrl ) {
+    size_t n = msg_ctrl->n;
+    if( 1 != n && PIR_AXIS_CNT != n ) return -1;
+    for( size_t i = 0; i < n; i ++ ) {
+        if( !(msg_ctrl->x[i].f > 0) ) return -1;
+    }
+    for( size_t i = 0; i < PIR_AXIS_CNT; i ++ ) {
+        if( 1 == n && PIR_AXIS_T == i ) continue;
+        lim[i] = msg_ctrl->x[ 1 == n ? 0 : i ].f;
+    }
+    SNS_LOG( LOG_NOTICE, "%s: %lu values\n", name, n );
+    return 0;
+}
+int set_mode_lim_dq(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
+    return set_limits( "dq_max", cx->dq_max, msg_ctrl );
+}
+int set_mode_lim_ddq(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
+    return set_limits( "ddq_max", cx->ddq_max, msg_ctrl );
+}
+
 int set_mode_cpy(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
     printf("ctrl: %s\n", msg_ctrl->mode );
     memcpy( &cx->msg_ctrl, msg_ctrl, sizeof(cx->msg_ctrl) );
@@ -146,125 +168,272 @@ int set_mode_sin(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
     return 0;
 }
 
-int set_mode_trajx_side(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl, double S0[8] ) {
-    if( msg_ctrl->n < 9 ) return -1;
-    pir_zero_refs(cx);
+/*
+ * Generated trajectories are resampled into uniform pieces with
+ * precomputed coefficients, so each control cycle evaluates one
+ * piece instead of searching the generated segment list.
+ */
+static size_t tab_pieces( double t_f ) {
+    return AA_MAX( (size_t)1, (size_t)ceil( t_f / PIR_TRAJ_TAB_H ) );
+}
+
+static void trajx_tabulate( struct pir_mode_data *md, struct rfx_trajx_seg_list *segs ) {
+    struct pir_trajx_tab *T = AA_MEM_REGION_NEW( &md->reg, struct pir_trajx_tab );
+    pir_trajx_tab_init( T, &md->reg, segs );
+    md->mode_cx = T;
+}
+
+typedef void (*trajq_sample_fun)( void *, double, double *, double * );
+
+static void trajq_tabulate( struct pir_mode_data *md, size_t n_q, double t_f,
+                            trajq_sample_fun fun, void *arg )
+{
+    // a zero-length trajectory is a single hold at its end
+    size_t n = (t_f > 0) ? tab_pieces( t_f ) : 0;
+    double h = n ? t_f / (double)n : 0;
+    double *q = AA_MEM_REGION_NEW_N( &md->reg, double, n_q*(n+1) );
+    double *dq = AA_MEM_REGION_NEW_N( &md->reg, double, n_q*(n+1) );
+    for( size_t k = 0; k <= n; k ++ ) {
+        fun( arg, (k == n) ? t_f : h * (double)k, q + n_q*k, dq + n_q*k );
+    }
+
+    struct pir_trajq_tab *T = AA_MEM_REGION_NEW( &md->reg, struct pir_trajq_tab );
+    pir_trajq_tab_init( T, &md->reg, n_q, n, h, q, dq );
+    md->mode_cx = T;
+}
 
-    // free old stuff
-    aa_mem_region_release( &cx->modereg );
+static void trajq_sample_path( void *arg, double t, double *q, double *dq ) {
+    pir_trajq_path_get( (struct pir_trajq_path*)arg, t, q, dq );
+}
+
+/*
+ * Waypoints are dt and pose.  Segments with dt <= 0 are timed
+ * automatically to the joint and Cartesian speed limits.  The
+ * Cartesian limits, linear then angular, may precede the waypoints;
+ * limits that are not positive default to the PIR_TRAJX limits.
+ */
+static int gen_mode_trajx_side( struct pir_mode_data *md, int side, const double See[8] ) {
+    struct pir_msg *msg_ctrl = md->msg;
+    size_t off = (2 == msg_ctrl->n % 9) ? 2 : 0;
+    if( msg_ctrl->n < off + 9 ) return -1;
+
+    double x_max[2] = {PIR_TRAJX_V_MAX, PIR_TRAJX_W_MAX};
+    for( size_t i = 0; i < off; i ++ ) {
+        if( msg_ctrl->x[i].f > 0 ) x_max[i] = msg_ctrl->x[i].f;
+    }
 
-    // aloc
-    struct rfx_trajx_point_list *plist = rfx_trajx_point_list_alloc( &cx->modereg );
+    int lwa, sdh;
+    PIR_SIDE_INDICES( side, lwa, sdh );
+    (void)sdh;
 
     // initial point
-    double t = 0;
-    rfx_trajx_point_list_addb_duqu( plist, t, 1, S0 );
+    double S0[8];
+    aa_tf_duqu_mul( md->X.S_wp[side], See, S0 );
+
+    size_t n_pts = 1 + (msg_ctrl->n - off) / 9;
+    double *S = AA_MEM_REGION_NEW_N( &md->reg, double, 8*n_pts );
+    double *dt = AA_MEM_REGION_NEW_N( &md->reg, double, n_pts );
+    int is_auto = 0;
+    AA_MEM_CPY( S, S0, 8 );
+    dt[0] = 0;
+    for( size_t k = 1; k < n_pts; k ++ ) {
+        dt[k] = msg_ctrl->x[off + 9*(k-1)].f;
+        AA_MEM_CPY( S + 8*k, &msg_ctrl->x[off + 9*(k-1)+1].f, 8 );
+        is_auto = is_auto || !(dt[k] > 0);
+    }
 
-    // final point
-    for( size_t i = 0; i + 9 <= msg_ctrl->n; i += 9 ) {
-        double dt = msg_ctrl->x[i].f;
-        t += dt;
-        double *S = &msg_ctrl->x[i+1].f;
-        rfx_trajx_point_list_addb_duqu( plist, t, 1, S );
+    struct rfx_trajx_seg_list *segs;
+    if( is_auto ) {
+        segs = pir_trajx_gen_auto( &md->reg, side, md->X.q + lwa, See,
+                                   n_pts, S, dt, md->dq_max + lwa, x_max );
+    } else {
+        segs = pir_trajx_spline( &md->reg, n_pts, S, dt );
     }
 
-    // generate
-    cx->trajx_segs = rfx_trajx_splend_generate( plist, &cx->modereg );
+    trajx_tabulate( md, segs );
+    return 0;
+}
 
-    memcpy( &cx->t0, &cx->now, sizeof(cx->t0) );
 
+int gen_mode_trajx_left( struct pir_mode_data *md ) {
+    return gen_mode_trajx_side( md, PIR_LEFT, md->X.S_eer[PIR_LEFT] );
+}
+
+int gen_mode_trajx_right( struct pir_mode_data *md ) {
+    return gen_mode_trajx_side( md, PIR_RIGHT, md->X.S_eer[PIR_RIGHT] );
+}
+
+int gen_mode_trajx_w_left( struct pir_mode_data *md ) {
+    return gen_mode_trajx_side( md, PIR_LEFT, aa_tf_duqu_ident );
+}
+
+int gen_mode_trajx_w_right( struct pir_mode_data *md ) {
+    return gen_mode_trajx_side( md, PIR_RIGHT, aa_tf_duqu_ident );
+}
+
+static int trajx_stream_add( pirctrl_cx_t *cx, struct pir_msg *msg_ctrl,
+                             struct pir_trajx_stream *T )
+{
+    double t = aa_tm_timespec2sec( aa_tm_sub( cx->now, cx->t0 ) );
+    for( size_t i = 0; i + 9 <= msg_ctrl->n; i += 9 ) {
+        if( pir_trajx_stream_add( T, t, msg_ctrl->x[i].f, &msg_ctrl->x[i+1].f ) ) {
+            SNS_LOG( LOG_ERR, "Invalid stream waypoint or stream full\n" );
+            return -1;
+        }
+    }
     return 0;
 }
 
+static int set_mode_trajx_stream_side( pirctrl_cx_t *cx, struct pir_msg *msg_ctrl, int side ) {
+    if( msg_ctrl->n % 9 ) return -1;
+    pir_zero_refs(cx);
+
+    struct pir_mode_data *md = cx->md_init;
 
-int set_mode_trajx_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
+    // start at the current E.E. pose
     double S0[8];
-    aa_tf_duqu_mul( cx->state.S_wp[PIR_LEFT], cx->state.S_eer[PIR_LEFT], S0 );
-    return set_mode_trajx_side( cx, msg_ctrl, S0 );
+    aa_tf_duqu_mul( cx->state.S_wp[side], cx->state.S_eer[side], S0 );
+
+    struct pir_trajx_stream *T = AA_MEM_REGION_NEW( &md->reg, struct pir_trajx_stream );
+    pir_trajx_stream_init( T, S0 );
+    T->side = side;
+    md->mode_cx = T;
+
+    memcpy( &cx->t0, &cx->now, sizeof(cx->t0) );
+
+    return trajx_stream_add( cx, msg_ctrl, T );
 }
 
-int set_mode_trajx_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
-    double S0[8];
-    aa_tf_duqu_mul( cx->state.S_wp[PIR_RIGHT], cx->state.S_eer[PIR_RIGHT], S0 );
-    return set_mode_trajx_side( cx, msg_ctrl, S0 );
+static int set_mode_trajx_append_side( pirctrl_cx_t *cx, struct pir_msg *msg_ctrl, int side ) {
+    if( msg_ctrl->n % 9 ) return -1;
+    pir_mode_run_fun_t run = (PIR_LEFT == side) ? ctrl_trajx_stream_left : ctrl_trajx_stream_right;
+    if( NULL == cx->mode || run != cx->mode->run || NULL == cx->md ||
+        side != ((struct pir_trajx_stream*)cx->md->mode_cx)->side )
+    {
+        SNS_LOG( LOG_ERR, "No active stream to append to\n" );
+        return -1;
+    }
+    // extend the running stream in place
+    return trajx_stream_add( cx, msg_ctrl, (struct pir_trajx_stream*)cx->md->mode_cx );
 }
 
-int set_mode_trajx_w_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
-    return set_mode_trajx_side( cx, msg_ctrl, cx->state.S_wp[PIR_LEFT] );
+int set_mode_trajx_stream_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
+    return set_mode_trajx_stream_side( cx, msg_ctrl, PIR_LEFT );
 }
 
-int set_mode_trajx_w_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
-    return set_mode_trajx_side( cx, msg_ctrl, cx->state.S_wp[PIR_RIGHT]);
+int set_mode_trajx_stream_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
+    return set_mode_trajx_stream_side( cx, msg_ctrl, PIR_RIGHT );
 }
 
-static int collect_trajq(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl, double *q0, size_t n ) {
-    if( msg_ctrl->n < n+1 ) return -1;
-    pir_zero_refs(cx);
+int set_mode_trajx_append_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
+    return set_mode_trajx_append_side( cx, msg_ctrl, PIR_LEFT );
+}
 
-    // free old stuff
-    aa_mem_region_release( &cx->modereg );
+int set_mode_trajx_append_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
+    return set_mode_trajx_append_side( cx, msg_ctrl, PIR_RIGHT );
+}
 
-    struct rfx_trajq_points *points = rfx_trajq_points_alloc( &cx->modereg, n );
+/*
+ * Joint trajectories through each waypoint, timed over the whole path
+ * under the controller limits.  Each waypoint is dt and q; the sum of
+ * dt is a minimum duration, reached by slowing the whole motion.
+ */
+static int collect_trajq( struct pir_mode_data *md, size_t off, size_t n ) {
+    struct pir_msg *msg_ctrl = md->msg;
+    if( msg_ctrl->n < n+1 || msg_ctrl->n % (n+1) ) return -1;
+
+    size_t n_pts = 1 + msg_ctrl->n / (n+1);
+    double *q = AA_MEM_REGION_NEW_N( &md->reg, double, n*n_pts );
+    AA_MEM_CPY( q, md->X.q + off, n );
+    double t_min = 0;
+    for( size_t j = 1; j < n_pts; j ++ ) {
+        size_t k = (n+1)*(j-1);
+        t_min += msg_ctrl->x[k].f;
+        for( size_t i = 0; i < n; i ++ ) {
+            q[n*j + i] = msg_ctrl->x[k+1+i].f;
+        }
+    }
 
-    double t = 0;
-    rfx_trajq_points_add( points, t, q0 );
-    for( size_t i = 0; i + (n+1) <= msg_ctrl->n; i += (n+1) ) {
-        t +=  msg_ctrl->x[i].f;
-        rfx_trajq_points_add( points, t, &msg_ctrl->x[i+1].f );
-        printf("t: ");
-        aa_dump_vec(stdout, &msg_ctrl->x[i+1].f, n );
+    struct pir_trajq_path *T = AA_MEM_REGION_NEW( &md->reg, struct pir_trajq_path );
+    if( pir_trajq_path_gen( T, &md->reg, n, n_pts, q,
+                            md->dq_max + off, md->ddq_max + off ) ) {
+        return -1;
     }
+    double t_f = pir_trajq_path_t_f( T );
+    if( t_f > 0 && t_min > t_f ) T->t_scale = t_min / t_f;
 
-    cx->trajq_segs = rfx_trajq_gen_pblend_tm1( &cx->modereg, points, 1.0 );
+    trajq_tabulate( md, n, pir_trajq_path_t_f(T), trajq_sample_path, T );
 
-    memcpy( &cx->t0, &cx->now, sizeof(cx->t0) );
     return 0;
 }
 
-int set_mode_trajq_left(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
-    return collect_trajq(cx, msg_ctrl, cx->state.q + PIR_AXIS_L0, 7 );
+int gen_mode_trajq_left( struct pir_mode_data *md ) {
+    return collect_trajq( md, PIR_AXIS_L0, 7 );
 }
 
-int set_mode_trajq_right(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
-    return collect_trajq(cx, msg_ctrl, cx->state.q + PIR_AXIS_R0, 7 );
+int gen_mode_trajq_right( struct pir_mode_data *md ) {
+    return collect_trajq( md, PIR_AXIS_R0, 7 );
 }
 
-int set_mode_trajq_lr(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
+int gen_mode_trajq_lr( struct pir_mode_data *md ) {
     _Static_assert(  PIR_AXIS_L0 + 7 == PIR_AXIS_R0, "Invalid axis ordering" );
-    return collect_trajq(cx, msg_ctrl, cx->state.q + PIR_AXIS_L0, 14 );
+    return collect_trajq( md, PIR_AXIS_L0, 14 );
 }
 
-int set_mode_trajq_torso(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
-    if( msg_ctrl->n != 2 ) return -1;
-    pir_zero_refs(cx);
-
-    // free old stuff
-    aa_mem_region_release( &cx->modereg );
-
-    // aloc
-    rfx_trajq_trapvel_t *T = AA_MEM_REGION_NEW( &cx->modereg, rfx_trajq_trapvel_t );
-    rfx_trajq_trapvel_init( T, &cx->modereg, 1 );
+int gen_mode_trajq_torso( struct pir_mode_data *md ) {
+    return collect_trajq( md, PIR_AXIS_T, 1 );
+}
 
-    for( size_t i = 0; i < 1; i ++ ) {
-        T->dq_max[i] = 10.0;
-        T->ddq_max[i] = 10.0;
+/*
+ * Joint trajectories that stop at each waypoint, each segment in
+ * minimum time.  The payload is n velocity limits, n acceleration
+ * limits, then the waypoints.  Limits that are not positive default to
+ * the controller limits.
+ */
+static int collect_trajq_topt( struct pir_mode_data *md, size_t off, size_t n ) {
+    struct pir_msg *msg_ctrl = md->msg;
+    if( msg_ctrl->n < 2*n || (msg_ctrl->n - 2*n) % n ) return -1;
+
+    double dq_max[PIR_QP_MAX], ddq_max[PIR_QP_MAX];
+    assert( n <= PIR_QP_MAX );
+    for( size_t i = 0; i < n; i ++ ) {
+        double v = msg_ctrl->x[i].f;
+        double a = msg_ctrl->x[n+i].f;
+        dq_max[i]  = v > 0 ? v : md->dq_max[off+i];
+        ddq_max[i] = a > 0 ? a : md->ddq_max[off+i];
     }
 
-    // initial point
-    rfx_trajq_add( &T->traj, 0, cx->state.q + PIR_AXIS_T );
-    rfx_trajq_add( &T->traj, msg_ctrl->x[0].f, &msg_ctrl->x[1].f );
+    size_t n_pts = 1 + (msg_ctrl->n - 2*n) / n;
+    double *q = AA_MEM_REGION_NEW_N( &md->reg, double, n*n_pts );
+    AA_MEM_CPY( q, md->X.q + off, n );
+    for( size_t j = 1; j < n_pts; j ++ ) {
+        for( size_t i = 0; i < n; i ++ ) {
+            q[n*j + i] = msg_ctrl->x[2*n + n*(j-1) + i].f;
+        }
+    }
 
-    rfx_trajq_generate( &T->traj );
+    struct pir_trajq_topt *T = AA_MEM_REGION_NEW( &md->reg, struct pir_trajq_topt );
+    if( pir_trajq_topt_gen( T, &md->reg, n, n_pts, q, dq_max, ddq_max ) ) return -1;
 
-    //printf( "torso: %f, %f\n", msg_ctrl->x[0].f, msg_ctrl->x[1].f );
+    md->mode_cx = T;
+    return 0;
+}
 
-    memcpy( &cx->t0, &cx->now, sizeof(cx->t0) );
+int gen_mode_trajq_topt_left( struct pir_mode_data *md ) {
+    return collect_trajq_topt( md, PIR_AXIS_L0, 7 );
+}
 
-    //rfx_trajq_plot( &T->traj, .001 );
+int gen_mode_trajq_topt_right( struct pir_mode_data *md ) {
+    return collect_trajq_topt( md, PIR_AXIS_R0, 7 );
+}
 
-    cx->trajq = &T->traj;
+int gen_mode_trajq_topt_lr( struct pir_mode_data *md ) {
+    _Static_assert(  PIR_AXIS_L0 + 7 == PIR_AXIS_R0, "Invalid axis ordering" );
+    return collect_trajq_topt( md, PIR_AXIS_L0, 14 );
+}
 
-    return 0;
+int gen_mode_trajq_topt_torso( struct pir_mode_data *md ) {
+    return collect_trajq_topt( md, PIR_AXIS_T, 1 );
 }
 
 
@@ -273,12 +442,11 @@ int set_mode_servo_cam(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl )
     pir_zero_refs(cx);
     if( msg_ctrl->n*sizeof(double) != sizeof( struct servo_cam_cx) ) return -1;
 
-    // free old stuff
-    aa_mem_region_release( &cx->modereg );
-
-    // copy target pose
-    cx->mode_cx = aa_mem_region_dup( &cx->modereg,
-                                     &msg_ctrl->x[0].f, sizeof(struct servo_cam_cx) );
+    // copy target pose, the filter starts at the first tick
+    struct servo_cam_mode *S = AA_MEM_REGION_NEW( &cx->md_init->reg, struct servo_cam_mode );
+    memcpy( &S->p, &msg_ctrl->x[0].f, sizeof(S->p) );
+    S->started = 0;
+    cx->md_init->mode_cx = S;
 
     return 0;
 }
@@ -287,11 +455,8 @@ int set_mode_biservo_rel(pirctrl_cx_t *cx, struct pir_msg *msg_ctrl ) {
     pir_zero_refs(cx);
     if( msg_ctrl->n*sizeof(double) != sizeof( struct biservo_rel_cx) ) return -1;
 
-    // free old stuff
-    aa_mem_region_release( &cx->modereg );
-
     // copy target pose
-    cx->mode_cx = aa_mem_region_dup( &cx->modereg,
+    cx->md_init->mode_cx = aa_mem_region_dup( &cx->md_init->reg,
                                      &msg_ctrl->x[0].f, sizeof(struct biservo_rel_cx) );
 
     return 0;
@@ -0,0 +1,212 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <syslog.h>
+#include <inttypes.h>
+#include <sns.h>
+#include <amino.h>
+#include "piranha.h"
+
+#define SHM_READ_NS (200 * 1000)   ///< longest wait for a put to finish
+
+struct shm_field {
+    int config;       ///< field is in pir_config rather than pir_state
+    size_t offset;
+    size_t size;
+    enum pir_state_section sec;     ///< section whose time the field carries
+};
+
+#define SHM_STATE_FIELD(name, sec)                                      \
+    { 0, offsetof(struct pir_state, name), sizeof(((struct pir_state*)0)->name), \
+      PIR_STATE_SEC_ ## sec }
+
+static const struct shm_field shm_fields[PIR_SHM_FIELD_CNT] = {
+    SHM_STATE_FIELD(q, JOINTS),
+    SHM_STATE_FIELD(dq, JOINTS),
+    SHM_STATE_FIELD(F, FT),
+    SHM_STATE_FIELD(S_wp, WRIST),
+    SHM_STATE_FIELD(J_wp, JACOBIAN),
+    SHM_STATE_FIELD(S_eer, EER),
+    { 1, 0, sizeof(struct pir_config), PIR_STATE_SEC_JOINTS },
+    SHM_STATE_FIELD(est, EST),
+    SHM_STATE_FIELD(dx_wp, TWIST),
+    SHM_STATE_FIELD(dx_ee, TWIST)
+};
+
+static void *shm_field_ptr( size_t i, const struct pir_state *X, const struct pir_config *Q ) {
+    return (shm_fields[i].config ? (char*)Q : (char*)X) + shm_fields[i].offset;
+}
+
+struct pir_shm *pir_shm_open( const char *name, int create ) {
+    int fd = shm_open( name, create ? (O_RDWR | O_CREAT) : O_RDONLY, 0666 );
+    if( fd < 0 ) {
+        SNS_LOG( LOG_ERR, "shm_open `%s' failed: '%s'\n", name, strerror(errno) );
+        return NULL;
+    }
+    if( create && ftruncate( fd, sizeof(struct pir_shm) ) ) {
+        SNS_LOG( LOG_ERR, "ftruncate `%s' failed: '%s'\n", name, strerror(errno) );
+        close(fd);
+        return NULL;
+    }
+
+    void *ptr = mmap( NULL, sizeof(struct pir_shm),
+                      create ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                      MAP_SHARED, fd, 0 );
+    close(fd);
+    if( MAP_FAILED == ptr ) {
+        SNS_LOG( LOG_ERR, "mmap `%s' failed: '%s'\n", name, strerror(errno) );
+        return NULL;
+    }
+
+    struct pir_shm *shm = (struct pir_shm*)ptr;
+    if( create ) {
+        shm->size = sizeof(*shm);
+    } else if( sizeof(*shm) != shm->size ) {
+        SNS_LOG( LOG_ERR, "Invalid shared state size: %"PRIu64"\n", shm->size );
+        pir_shm_close( shm );
+        return NULL;
+    }
+
+    return shm;
+}
+
+void pir_shm_close( struct pir_shm *shm ) {
+    munmap( shm, sizeof(*shm) );
+}
+
+void pir_shm_put( struct pir_shm *shm, const struct pir_health *H,
+                  const struct pir_state *X, const struct pir_config *Q,
+                  const int64_t time_ns[PIR_STATE_SEC_CNT], unsigned fields )
+{
+    // single writer, only it changes seq
+    uint64_t seq = shm->seq;
+    __atomic_store_n( &shm->seq, seq+1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+
+    shm->health = *H;
+    uint64_t gen = (seq+2) / 2;
+    for( size_t i = 0; i < PIR_SHM_FIELD_CNT; i ++ ) {
+        if( fields & PIR_SHM_BIT(i) ) {
+            memcpy( shm_field_ptr(i, &shm->state, &shm->config),
+                    shm_field_ptr(i, X, Q), shm_fields[i].size );
+            shm->time_ns[i] = time_ns[shm_fields[i].sec];
+            __atomic_store_n( &shm->gen[i], gen, __ATOMIC_RELAXED );
+        }
+    }
+
+    __atomic_store_n( &shm->seq, seq+2, __ATOMIC_RELEASE );
+}
+
+/* Let the writer's core run while we spin */
+static inline void shm_relax( void ) {
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static int64_t shm_now_ns( void ) {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return PIR_TIMESPEC_NS(now);
+}
+
+int pir_shm_get( const struct pir_shm *shm, struct pir_health *H,
+                 struct pir_state *X, struct pir_config *Q,
+                 int64_t time_ns[PIR_STATE_SEC_CNT], unsigned fields,
+                 uint64_t gen[PIR_SHM_FIELD_CNT] )
+{
+    // copy into a snapshot so a torn read never reaches X and Q
+    struct pir_state X_s;
+    struct pir_config Q_s;
+    int64_t t_end = 0;
+    for(;;) {
+        uint64_t seq = __atomic_load_n( &shm->seq, __ATOMIC_ACQUIRE );
+        if( !(seq & 1) ) {
+            struct pir_health health = shm->health;
+            unsigned updated = 0;
+            uint64_t gen_new[PIR_SHM_FIELD_CNT];
+            int64_t t_new[PIR_SHM_FIELD_CNT];
+            for( size_t i = 0; i < PIR_SHM_FIELD_CNT; i ++ ) {
+                gen_new[i] = __atomic_load_n( &shm->gen[i], __ATOMIC_RELAXED );
+                if( (fields & PIR_SHM_BIT(i)) && gen_new[i] != gen[i] ) {
+                    memcpy( shm_field_ptr(i, &X_s, &Q_s),
+                            shm_field_ptr(i, &shm->state, &shm->config),
+                            shm_fields[i].size );
+                    t_new[i] = shm->time_ns[i];
+                    updated |= PIR_SHM_BIT(i);
+                }
+            }
+
+            __atomic_thread_fence( __ATOMIC_ACQUIRE );
+            if( seq == __atomic_load_n( &shm->seq, __ATOMIC_RELAXED ) ) {
+                // consistent, commit health and the copied fields
+                *H = health;
+                for( size_t i = 0; i < PIR_SHM_FIELD_CNT; i ++ ) {
+                    if( updated & PIR_SHM_BIT(i) ) {
+                        memcpy( shm_field_ptr(i, X, Q), shm_field_ptr(i, &X_s, &Q_s),
+                                shm_fields[i].size );
+                        gen[i] = gen_new[i];
+                        time_ns[shm_fields[i].sec] = t_new[i];
+                    }
+                }
+                return (int)updated;
+            }
+        }
+
+        // the writer is in the middle of a put, wait for it to finish
+        if( 0 == t_end ) {
+            t_end = shm_now_ns() + SHM_READ_NS;
+        } else if( shm_now_ns() > t_end ) {
+            return -1;
+        }
+        shm_relax();
+    }
+}
@@ -0,0 +1,139 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <stddef.h>
+#include <amino.h>
+#include <ach.h>
+#include "piranha.h"
+
+/* Each section is a contiguous range of struct pir_state */
+struct state_section {
+    size_t offset;
+    size_t n;       ///< number of doubles
+};
+
+#define STATE_SECTION(first, last)                                      \
+    { offsetof(struct pir_state, first),                                \
+      (offsetof(struct pir_state, last) + sizeof(((struct pir_state*)0)->last) \
+       - offsetof(struct pir_state, first)) / sizeof(double) }
+
+static const struct state_section state_sections[PIR_STATE_SEC_CNT] = {
+    STATE_SECTION(q, dq),
+    STATE_SECTION(F, F),
+    STATE_SECTION(S_wp, S_wp),
+    STATE_SECTION(J_wp, J_wp),
+    STATE_SECTION(S_eer, S_eer),
+    STATE_SECTION(est, est),
+    STATE_SECTION(dx_wp, dx_ee)
+};
+
+static size_t state_msg_count( unsigned sections ) {
+    size_t n = 0;
+    for( size_t i = 0; i < PIR_STATE_SEC_CNT; i ++ ) {
+        if( sections & PIR_STATE_SEC_BIT(i) ) n += state_sections[i].n;
+    }
+    return n;
+}
+
+size_t pir_state_msg_size( unsigned sections ) {
+    return offsetof(struct pir_state_msg, data) +
+        sizeof(double) * state_msg_count(sections);
+}
+
+void pir_state_msg_pack( struct pir_state_msg *msg, const struct pir_state *X,
+                         unsigned sections,
+                         const int64_t time_ns[PIR_STATE_SEC_CNT] )
+{
+    msg->version = PIR_STATE_MSG_VERSION;
+    msg->sections = sections & PIR_STATE_SEC_ALL;
+    double *ptr = msg->data;
+    for( size_t i = 0; i < PIR_STATE_SEC_CNT; i ++ ) {
+        if( sections & PIR_STATE_SEC_BIT(i) ) {
+            msg->time_ns[i] = time_ns[i];
+            AA_MEM_CPY( ptr, (const double*)((const char*)X + state_sections[i].offset),
+                        state_sections[i].n );
+            ptr += state_sections[i].n;
+        } else {
+            msg->time_ns[i] = 0;
+        }
+    }
+}
+
+int pir_state_msg_check( const struct pir_state_msg *msg, size_t frame_size ) {
+    if( frame_size < offsetof(struct pir_state_msg, data) ||
+        PIR_STATE_MSG_VERSION != msg->version ||
+        (msg->sections & ~PIR_STATE_SEC_ALL) ||
+        frame_size != pir_state_msg_size(msg->sections) )
+    {
+        return -1;
+    }
+    return 0;
+}
+
+const double *pir_state_msg_section( const struct pir_state_msg *msg,
+                                     enum pir_state_section sec )
+{
+    if( !(msg->sections & PIR_STATE_SEC_BIT(sec)) ) return NULL;
+    return msg->data + state_msg_count( msg->sections & (PIR_STATE_SEC_BIT(sec) - 1) );
+}
+
+unsigned pir_state_msg_unpack( const struct pir_state_msg *msg, struct pir_state *X ) {
+    const double *ptr = msg->data;
+    for( size_t i = 0; i < PIR_STATE_SEC_CNT; i ++ ) {
+        if( msg->sections & PIR_STATE_SEC_BIT(i) ) {
+            AA_MEM_CPY( (double*)((char*)X + state_sections[i].offset), ptr,
+                        state_sections[i].n );
+            ptr += state_sections[i].n;
+        }
+    }
+    return msg->sections;
+}
+
+void pir_state_config( const double q[PIR_AXIS_CNT], struct pir_config *Q ) {
+    AA_MEM_CPY( &Q->q[PIR_TF_LEFT_Q_SHOULDER0], &q[PIR_AXIS_L0], 7 );
+    AA_MEM_CPY( &Q->q[PIR_TF_RIGHT_Q_SHOULDER0], &q[PIR_AXIS_R0], 7 );
+    AA_MEM_CPY( &Q->q[PIR_TF_LEFT_SDH_Q_AXIAL], &q[PIR_AXIS_SDH_L0], 7 );
+    AA_MEM_CPY( &Q->q[PIR_TF_RIGHT_SDH_Q_AXIAL], &q[PIR_AXIS_SDH_R0], 7 );
+}
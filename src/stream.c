@@ -0,0 +1,200 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <argp.h>
+#include <syslog.h>
+#include <sns.h>
+#include <inttypes.h>
+#include <amino.h>
+#include <reflex.h>
+#include "piranha.h"
+
+/*
+ * Streamed Cartesian trajectories.
+ *
+ * Each waypoint appends one cubic Hermite segment to a fixed ring.
+ * Segments behind the cursor are done and their slots are reused, so
+ * appending costs the same and uses no memory no matter how long the
+ * motion has been running, and evaluation only advances a cursor.
+ * At most PIR_TRAJX_STREAM_RING segments may be queued ahead.
+ *
+ * Each segment interpolates translation and the rotation vector of
+ * the orientation relative to the segment start.  The velocity at
+ * the end of a segment is the secant velocity of that segment, and
+ * the next segment starts from it.  To come to rest, repeat the final
+ * waypoint.
+ */
+
+#define STREAM_SEG(T,k) (&(T)->seg[(k) % PIR_TRAJX_STREAM_RING])
+
+static struct pir_trajx_seg *
+stream_seg_alloc( struct pir_trajx_stream *T )
+{
+    if( T->n - T->cur >= PIR_TRAJX_STREAM_RING ) return NULL;
+    return STREAM_SEG(T, T->n++);
+}
+
+void pir_trajx_seg_fill( struct pir_trajx_seg *seg,
+                         double t0, const double E0[7], const double dx0[6],
+                         double t1, const double E1[7], const double dx1[6] )
+{
+    double T = t1 - t0;
+    seg->t0 = t0;
+    seg->t1 = t1;
+    AA_MEM_CPY( seg->r0, E0, 4 );
+
+    // displacement: translation and world-frame rotation vector
+    double d[6];
+    for( size_t i = 0; i < 3; i ++ ) d[i] = E1[4+i] - E0[4+i];
+    {
+        double r_rel[4];
+        aa_tf_qmulc( E1, E0, r_rel );
+        aa_tf_qminimize( r_rel );
+        aa_tf_quat2rotvec( r_rel, d+3 );
+    }
+
+    for( size_t i = 0; i < 6; i ++ ) {
+        seg->c[0][i] = (i < 3) ? E0[4+i] : 0;
+        seg->c[1][i] = dx0[i];
+        seg->c[2][i] = (3*d[i] - (2*dx0[i] + dx1[i])*T) / (T*T);
+        seg->c[3][i] = (-2*d[i] + (dx0[i] + dx1[i])*T) / (T*T*T);
+    }
+}
+
+void pir_trajx_seg_get( const struct pir_trajx_seg *seg, double t,
+                        double E[7], double dx[6] )
+{
+    double tau = t - seg->t0;
+    double p[6];
+    for( size_t i = 0; i < 6; i ++ ) {
+        p[i] = seg->c[0][i] + tau*(seg->c[1][i] + tau*(seg->c[2][i] + tau*seg->c[3][i]));
+        dx[i] = seg->c[1][i] + tau*(2*seg->c[2][i] + tau*3*seg->c[3][i]);
+    }
+    double r_rel[4];
+    aa_tf_rotvec2quat( p+3, r_rel );
+    aa_tf_qmul( r_rel, seg->r0, E );
+    AA_MEM_CPY( E+4, p, 3 );
+}
+
+/* Append a segment from the current end to E1, dx1 at t1 */
+static int
+stream_push( struct pir_trajx_stream *T, double t1,
+             const double E1[7], const double dx1[6] )
+{
+    struct pir_trajx_seg *seg = stream_seg_alloc(T);
+    if( NULL == seg ) return -1;
+    pir_trajx_seg_fill( seg, T->t_f, T->E_f, T->dx_f, t1, E1, dx1 );
+
+    T->t_f = t1;
+    AA_MEM_CPY( T->E_f, E1, 7 );
+    AA_MEM_CPY( T->dx_f, dx1, 6 );
+    return 0;
+}
+
+void pir_trajx_stream_init( struct pir_trajx_stream *T, const double S0[8] )
+{
+    memset( T, 0, sizeof(*T) );
+    T->t_f = 0;
+    aa_tf_duqu2qutr( S0, T->E_f );
+    AA_MEM_ZERO( T->dx_f, 6 );
+}
+
+int pir_trajx_stream_add( struct pir_trajx_stream *T, double t_now,
+                          double dt, const double S[8] )
+{
+    if( !(dt > 0) || T->n - T->cur >= PIR_TRAJX_STREAM_RING ) return -1;
+
+    // stream ran dry, restart from rest at the current time
+    if( t_now > T->t_f ) {
+        T->t_f = t_now;
+        AA_MEM_ZERO( T->dx_f, 6 );
+    }
+
+    double t1 = T->t_f + dt;
+    double E1[7];
+    aa_tf_duqu2qutr( S, E1 );
+
+    // secant velocity at the new waypoint
+    double dx1[6];
+    for( size_t i = 0; i < 3; i ++ ) dx1[i] = (E1[4+i] - T->E_f[4+i]) / dt;
+    {
+        double r_rel[4];
+        aa_tf_qmulc( E1, T->E_f, r_rel );
+        aa_tf_qminimize( r_rel );
+        aa_tf_quat2rotvec( r_rel, dx1+3 );
+        for( size_t i = 3; i < 6; i ++ ) dx1[i] /= dt;
+    }
+
+    return stream_push( T, t1, E1, dx1 );
+}
+
+int pir_trajx_stream_push( struct pir_trajx_stream *T, double t1,
+                           const double S[8], const double dx[6] )
+{
+    if( !(t1 > T->t_f) ) return -1;
+
+    double E1[7];
+    aa_tf_duqu2qutr( S, E1 );
+    return stream_push( T, t1, E1, dx );
+}
+
+int pir_trajx_stream_get( struct pir_trajx_stream *T, double t,
+                          double S[8], double dx[6] )
+{
+    // advance cursor, segments are only ever added at the end
+    while( T->cur + 1 < T->n && t > STREAM_SEG(T, T->cur)->t1 ) T->cur++;
+
+    if( T->cur >= T->n || t > T->t_f ) {
+        // past the end, hold final waypoint
+        aa_tf_qutr2duqu( T->E_f, S );
+        AA_MEM_ZERO( dx, 6 );
+        return 1;
+    }
+
+    double E[7];
+    pir_trajx_seg_get( STREAM_SEG(T, T->cur), t, E, dx );
+    aa_tf_qutr2duqu( E, S );
+    return 0;
+}
@@ -0,0 +1,138 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <amino.h>
+#include <ach.h>
+#include <reflex.h>
+#include "piranha.h"
+
+void pir_trajx_tab_init( struct pir_trajx_tab *T, aa_mem_region_t *reg,
+                         struct rfx_trajx_seg_list *segs )
+{
+    double t_f = rfx_trajx_seg_list_get_t_f( segs );
+    size_t n = AA_MAX( (size_t)1, (size_t)ceil( t_f / PIR_TRAJ_TAB_H ) );
+    T->n = n;
+    T->t_f = t_f;
+    T->h = t_f / (double)n;
+    T->seg = AA_MEM_REGION_NEW_N( reg, struct pir_trajx_seg, n );
+
+    double S[8], dx0[6], E0[7], dx1[6], E1[7];
+    rfx_trajx_seg_list_get_dx_duqu( segs, 0, S, dx0 );
+    aa_tf_duqu2qutr( S, E0 );
+    for( size_t k = 1; k <= n; k ++ ) {
+        double t = (k == n) ? t_f : T->h * (double)k;
+        rfx_trajx_seg_list_get_dx_duqu( segs, t, S, dx1 );
+        aa_tf_duqu2qutr( S, E1 );
+        pir_trajx_seg_fill( &T->seg[k-1], T->h * (double)(k-1), E0, dx0, t, E1, dx1 );
+        AA_MEM_CPY( E0, E1, 7 );
+        AA_MEM_CPY( dx0, dx1, 6 );
+    }
+    AA_MEM_CPY( T->E_f, E0, 7 );
+}
+
+int pir_trajx_tab_get( const struct pir_trajx_tab *T, double t,
+                       double S[8], double dx[6] )
+{
+    if( !(t < T->t_f) ) {
+        aa_tf_qutr2duqu( T->E_f, S );
+        AA_MEM_ZERO( dx, 6 );
+        return 1;
+    }
+
+    t = AA_MAX( 0, t );
+    size_t i = AA_MIN( (size_t)(t / T->h), T->n - 1 );
+    double E[7];
+    pir_trajx_seg_get( &T->seg[i], t, E, dx );
+    aa_tf_qutr2duqu( E, S );
+    return 0;
+}
+
+void pir_trajq_tab_init( struct pir_trajq_tab *T, aa_mem_region_t *reg,
+                         size_t n_q, size_t n, double h,
+                         const double *q, const double *dq )
+{
+    T->n_q = n_q;
+    T->n = n;
+    T->h = h;
+    T->t_f = h * (double)n;
+    T->c = AA_MEM_REGION_NEW_N( reg, double, 4*n_q*AA_MAX(n,(size_t)1) );
+    T->q_f = AA_MEM_REGION_NEW_N( reg, double, n_q );
+    AA_MEM_CPY( T->q_f, q + n_q*n, n_q );
+
+    for( size_t i = 0; i < n; i ++ ) {
+        const double *q0 = q + n_q*i, *q1 = q0 + n_q;
+        const double *d0 = dq + n_q*i, *d1 = d0 + n_q;
+        double *c = T->c + 4*n_q*i;
+        for( size_t j = 0; j < n_q; j ++ ) {
+            double d = q1[j] - q0[j];
+            c[j]         = q0[j];
+            c[n_q + j]   = d0[j];
+            c[2*n_q + j] = (3*d - (2*d0[j] + d1[j])*h) / (h*h);
+            c[3*n_q + j] = (-2*d + (d0[j] + d1[j])*h) / (h*h*h);
+        }
+    }
+}
+
+int pir_trajq_tab_get( const struct pir_trajq_tab *T, double t,
+                       double *q, double *dq )
+{
+    size_t n_q = T->n_q;
+    if( 0 == T->n || t >= T->t_f ) {
+        AA_MEM_CPY( q, T->q_f, n_q );
+        AA_MEM_ZERO( dq, n_q );
+        return 1;
+    }
+
+    t = AA_MAX( 0, t );
+    size_t i = AA_MIN( (size_t)(t / T->h), T->n - 1 );
+    double tau = t - T->h * (double)i;
+    const double *c = T->c + 4*n_q*i;
+    for( size_t j = 0; j < n_q; j ++ ) {
+        double c0 = c[j], c1 = c[n_q+j], c2 = c[2*n_q+j], c3 = c[3*n_q+j];
+        q[j]  = c0 + tau*(c1 + tau*(c2 + tau*c3));
+        dq[j] = c1 + tau*(2*c2 + tau*3*c3);
+    }
+    return 0;
+}
@@ -1,10 +1,497 @@
 #include <assert.h>
+#include <pthread.h>
 #include <amino.h>
 #include <ach.h>
 #include <reflex.h>
 #include "piranha.h"
 
+static int n_fail = 0;
 
+#define CHECK( cond, ... )                      \
+    do {                                        \
+        if( !(cond) ) {                         \
+            printf( "FAIL: " __VA_ARGS__ );     \
+            n_fail++;                           \
+        }                                       \
+    } while(0)
+
+static double rand_unit( void ) {
+    return 2*drand48() - 1;
+}
+
+static double elapsed_us( struct timespec t0, struct timespec t1 ) {
+    return aa_tm_timespec2sec( aa_tm_sub( t1, t0 ) ) * 1e6;
+}
+
+/* Box QP: KKT conditions at the solution, and solve time */
+static void check_qp( size_t n ) {
+    const size_t N = 1000;
+    double A[PIR_QP_MAX*PIR_QP_MAX], H[PIR_QP_MAX*PIR_QP_MAX];
+    double g[PIR_QP_MAX], lb[PIR_QP_MAX], ub[PIR_QP_MAX], x[PIR_QP_MAX];
+    int8_t active[PIR_QP_MAX];
+
+    // H = A'A + k I, bounds tight enough that some bind
+    for( size_t i = 0; i < n*n; i ++ ) A[i] = rand_unit();
+    for( size_t i = 0; i < n; i ++ ) {
+        for( size_t j = 0; j < n; j ++ ) {
+            AA_MATREF(H,n,i,j) = aa_la_dot( n, AA_MATCOL(A,n,i), AA_MATCOL(A,n,j) );
+        }
+        AA_MATREF(H,n,i,i) += 1e-2;
+        g[i] = 10*rand_unit();
+        lb[i] = -.5;
+        ub[i] = .5;
+    }
+
+    AA_MEM_ZERO( active, n );
+    AA_MEM_ZERO( x, n );
+    int r = pir_qp_box( n, H, g, lb, ub, active, x );
+    CHECK( 0 == r, "qp-%zu returned %d\n", n, r );
+    for( size_t i = 0; i < n; i ++ ) {
+        double grad = -g[i];
+        for( size_t j = 0; j < n; j ++ ) grad += AA_MATREF(H,n,i,j) * x[j];
+        const double tol = 1e-8;
+        CHECK( x[i] >= lb[i] - tol && x[i] <= ub[i] + tol, "qp-%zu x[%zu] out of bounds\n", n, i );
+        // bound variables push against their bound, free ones are stationary
+        double kkt = (active[i] < 0) ? -grad : (active[i] > 0) ? grad : fabs(grad);
+        CHECK( kkt <= tol, "qp-%zu multiplier %zu: %g\n", n, i, grad );
+    }
+
+    // cold start is the worst case for the active set
+    struct timespec t0, t1;
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    for( size_t k = 0; k < N; k ++ ) {
+        AA_MEM_ZERO( active, n );
+        pir_qp_box( n, H, g, lb, ub, active, x );
+    }
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+    double us = elapsed_us( t0, t1 ) / (double)N;
+    printf( "qp-%zu: %.2f us\n", n, us );
+    CHECK( us < 100, "qp-%zu took %.2f us\n", n, us );
+}
+
+/* Path timing: limits hold, waypoints are passed without stopping */
+static void check_topt( size_t n_q, size_t n_pts ) {
+    const double h = 1e-3, tol = 1.05;
+    double q[PIR_QP_MAX*8], v[PIR_QP_MAX], a[PIR_QP_MAX];
+    assert( n_pts <= 8 );
+    for( size_t i = 0; i < n_q; i ++ ) {
+        v[i] = .5 + drand48();
+        a[i] = 1 + 4*drand48();
+    }
+    for( size_t j = 0; j < n_q*n_pts; j ++ ) q[j] = rand_unit();
+
+    aa_mem_region_t reg;
+    aa_mem_region_init( &reg, 64*1024 );
+    struct pir_trajq_path T;
+    int r = pir_trajq_path_gen( &T, &reg, n_q, n_pts, q, v, a );
+    CHECK( 0 == r, "topt-%zu returned %d\n", n_q, r );
+    if( r ) goto END;
+
+    double t_f = pir_trajq_path_t_f( &T );
+    double qt[PIR_QP_MAX], dq[PIR_QP_MAX], dq0[PIR_QP_MAX];
+    pir_trajq_path_get( &T, 0, qt, dq0 );
+    for( double t = h; t < t_f; t += h ) {
+        pir_trajq_path_get( &T, t, qt, dq );
+        for( size_t i = 0; i < n_q; i ++ ) {
+            CHECK( fabs(dq[i]) <= tol*v[i], "topt-%zu velocity %zu at %f\n", n_q, i, t );
+            CHECK( fabs(dq[i] - dq0[i]) <= tol*a[i]*h,
+                   "topt-%zu acceleration %zu at %f\n", n_q, i, t );
+        }
+        AA_MEM_CPY( dq0, dq, n_q );
+    }
+
+    r = pir_trajq_path_get( &T, t_f, qt, dq );
+    CHECK( r && aa_la_ssd( n_q, qt, q + n_q*(n_pts-1) ) < 1e-12,
+           "topt-%zu missed the final waypoint\n", n_q );
+
+    // interior knots are crossed in motion
+    for( size_t j = 1; j + 1 < T.n_k; j ++ ) {
+        size_t k = (size_t)(T.s_k[j] / T.ds + .5);
+        CHECK( T.x[k] > 0, "topt-%zu stopped at waypoint %zu\n", n_q, j );
+    }
+    printf( "topt-%zu: %.3f s\n", n_q, t_f );
+
+END:
+    aa_mem_region_destroy( &reg );
+}
+
+/* Automatic Cartesian timing stays within the speed limits */
+static void check_retime( const double q0[7] ) {
+    static const double x_max[2] = {PIR_TRAJX_V_MAX, PIR_TRAJX_W_MAX};
+    const double tol = 1.1;
+    double dq_max[7];
+    for( size_t i = 0; i < 7; i ++ ) dq_max[i] = 1;
+
+    // a translation, then a turn about z with a smaller translation
+    double S[8*3], dt[3] = {0, 0, 0};
+    double r[4], v[3], r_z[4], r_2[4], w[3] = {0, 0, .3};
+    pir_kin_arm_side( PIR_LEFT, q0, aa_tf_duqu_ident, S, NULL );
+    aa_tf_duqu2qv( S, r, v );
+    v[0] += .1;
+    aa_tf_qv2duqu( r, v, S + 8 );
+    aa_tf_rotvec2quat( w, r_z );
+    aa_tf_qmul( r_z, r, r_2 );
+    v[1] += .05;
+    v[2] -= .1;
+    aa_tf_qv2duqu( r_2, v, S + 16 );
+
+    aa_mem_region_t reg;
+    aa_mem_region_init( &reg, 64*1024 );
+    struct rfx_trajx_seg_list *segs =
+        pir_trajx_gen_auto( &reg, PIR_LEFT, q0, aa_tf_duqu_ident, 3, S, dt, dq_max, x_max );
+    CHECK( dt[1] > 0 && dt[2] > 0, "retime dt %f %f\n", dt[1], dt[2] );
+
+    double t_f = rfx_trajx_seg_list_get_t_f( segs );
+    for( double t = 0; t <= t_f; t += .01 ) {
+        double S_t[8], dx[6];
+        rfx_trajx_seg_list_get_dx_duqu( segs, t, S_t, dx );
+        CHECK( aa_la_norm(3, dx) <= tol*x_max[0] && aa_la_norm(3, dx+3) <= tol*x_max[1],
+               "retime speed at %f\n", t );
+    }
+    printf( "retime: %.3f s\n", t_f );
+
+    aa_mem_region_destroy( &reg );
+}
+
+/* Jump detection: logging, rejection, and acceptance after persisting */
+static void check_anom( double jump ) {
+    static struct pir_anom A;
+    memset( &A, 0, sizeof(A) );
+    A.lim.jump = jump;
+    A.lim.reject = .5;
+    struct pir_anom_event e;
+
+    CHECK( 0 == pir_anom_check( &A, 1, 0, 0, .05 ), "anom small deviation rejected\n" );
+    CHECK( 0 == pir_anom_check( &A, 2, 0, 0, .2 ), "anom jump rejected\n" );
+    CHECK( (jump > 0) == (int)A.n_jump[0], "anom jump count %lu\n", (unsigned long)A.n_jump[0] );
+    if( jump > 0 ) {
+        CHECK( pir_anom_pop( &A, &e ) && 0 == e.axis && !e.rejected, "anom jump not queued\n" );
+    }
+
+    for( size_t k = 0; k < PIR_ANOM_PERSIST; k ++ ) {
+        CHECK( 1 == pir_anom_check( &A, 3, 1, 0, 1 ), "anom outlier %zu accepted\n", k );
+        CHECK( pir_anom_pop( &A, &e ) && 1 == e.axis && e.rejected, "anom outlier not queued\n" );
+    }
+    CHECK( 0 == pir_anom_check( &A, 4, 1, 0, 1 ), "anom persistent jump rejected\n" );
+    CHECK( A.accepted == (1u << 1), "anom accepted 0x%x\n", A.accepted );
+    CHECK( PIR_ANOM_PERSIST == A.n_reject[1], "anom reject count\n" );
+}
+
+static void rand_quat( double r[4] ) {
+    for( size_t i = 0; i < 4; i ++ ) r[i] = rand_unit();
+    aa_tf_qnormalize( r );
+}
+
+/* Payload identification recovers mass, center of mass, and bias */
+static void check_ftid( void ) {
+    struct pir_payload P[2];
+    memset( P, 0, sizeof(P) );
+    P[0].hand.mass = 1 + drand48();
+    for( size_t i = 0; i < 3; i ++ ) P[0].hand.com[i] = .1*rand_unit();
+    for( size_t i = 0; i < 6; i ++ ) P[0].bias[i] = 5*rand_unit();
+
+    struct pir_ftid E;
+    pir_ftid_init( &E );
+    for( size_t k = 0; k < 10*PIR_FTID_MIN && !pir_ftid_converged(&E); k ++ ) {
+        double r_ft[2][4], W[2][6], F_raw[6];
+        rand_quat( r_ft[0] );
+        AA_MEM_CPY( r_ft[1], r_ft[0], 4 );
+        pir_payload_wrench( P, r_ft, W );
+        for( size_t i = 0; i < 6; i ++ ) F_raw[i] = P[0].bias[i] - W[0][i];
+        pir_ftid_update( &E, r_ft[0], F_raw );
+    }
+    CHECK( pir_ftid_converged(&E), "ftid did not converge\n" );
+
+    struct pir_payload_body B;
+    double bias[6];
+    pir_ftid_get( &E, &B, bias );
+    const double tol = 1e-3;
+    CHECK( fabs(B.mass - P[0].hand.mass) < tol, "ftid mass %f, expected %f\n", B.mass, P[0].hand.mass );
+    CHECK( aa_la_ssd(3, B.com, P[0].hand.com) < tol*tol, "ftid center of mass\n" );
+    CHECK( aa_la_ssd(6, bias, P[0].bias) < tol*tol, "ftid bias\n" );
+}
+
+/* Joint estimator: tracks constant acceleration, restarts after a gap */
+static void check_abg( void ) {
+    static struct pir_abg E;
+    memset( &E, 0, sizeof(E) );
+    double z_q[PIR_AXIS_CNT] = {0}, z_dq[PIR_AXIS_CNT] = {0};
+    int64_t z_t[PIR_AXIS_CNT] = {0};
+    const double q0 = .1, v = .5, a = -2;
+    const int64_t t0 = 1000000000, h = 10000000;
+
+    int64_t t = t0;
+    for( size_t k = 0; k < 200; k ++ ) {
+        t = t0 + (int64_t)k*h;
+        double s = (double)(t - t0) / 1e9;
+        z_q[0] = q0 + v*s + a*s*s/2;
+        z_dq[0] = v + a*s;
+        z_t[0] = t;
+        pir_abg_update( &E, z_q, z_dq, z_t );
+    }
+
+    struct pir_joint_est X;
+    double s = (double)(t + h - t0) / 1e9;
+    pir_abg_get( &E, t + h, &X );
+    CHECK( fabs(X.q[0] - (q0 + v*s + a*s*s/2)) < 1e-6, "abg q %f\n", X.q[0] );
+    CHECK( fabs(X.dq[0] - (v + a*s)) < 1e-4, "abg dq %f\n", X.dq[0] );
+    CHECK( fabs(X.ddq[0] - a) < 1e-3, "abg ddq %f\n", X.ddq[0] );
+    CHECK( 0 == X.q[1] && 0 == E.t_ns[1], "abg moved an axis without samples\n" );
+
+    // after a gap the raw sample is taken as is
+    z_q[0] = 3;
+    z_dq[0] = 1;
+    z_t[0] = t + (int64_t)(2*PIR_ABG_GAP*1e9);
+    pir_abg_update( &E, z_q, z_dq, z_t );
+    CHECK( 3 == E.q[0] && 1 == E.dq[0] && 0 == E.ddq[0], "abg did not restart\n" );
+}
+
+/* Compensation leaves only the external wrench, in the base frame */
+static void check_payload( void ) {
+    struct pir_payload P[2];
+    double r_ft[2][4], W[2][6], F_raw[2][6], F[2][6], F_ext[2][6];
+    for( size_t i = 0; i < 2; i ++ ) {
+        pir_payload_default( &P[i] );
+        P[i].object.mass = drand48();
+        for( size_t k = 0; k < 3; k ++ ) P[i].object.com[k] = .1*rand_unit();
+        for( size_t k = 0; k < 6; k ++ ) {
+            P[i].bias[k] = rand_unit();
+            F_ext[i][k] = 10*rand_unit();
+        }
+        rand_quat( r_ft[i] );
+    }
+    pir_payload_wrench( P, r_ft, W );
+    for( size_t i = 0; i < 2; i ++ ) {
+        double r_inv[4], e[6];
+        aa_tf_qconj( r_ft[i], r_inv );
+        aa_tf_qrot( r_inv, F_ext[i], e );
+        aa_tf_qrot( r_inv, F_ext[i]+3, e+3 );
+        for( size_t k = 0; k < 6; k ++ ) F_raw[i][k] = P[i].bias[k] - W[i][k] + e[k];
+    }
+    pir_payload_comp( P, r_ft, F_raw, F );
+    for( size_t i = 0; i < 2; i ++ ) {
+        CHECK( aa_la_ssd(6, F[i], F_ext[i]) < 1e-18, "payload side %zu\n", i );
+    }
+}
+
+/* Contact detection with hysteresis */
+static void check_contact( void ) {
+    const struct pir_contact_limits lim = {.F_max = 10, .M_max = 2, .dF_max = 0};
+    struct pir_contact C;
+    memset( &C, 0, sizeof(C) );
+    double F[6] = {0};
+    int64_t t = 1000000000, h = 2000000;
+
+    F[0] = 8;
+    CHECK( 0 == pir_contact_update( &C, &lim, F, t += h ), "contact under the limit\n" );
+    F[0] = 12;
+    CHECK( PIR_CONTACT_FORCE == pir_contact_update( &C, &lim, F, t += h ), "contact force\n" );
+    F[3] = 3;
+    CHECK( 0 == pir_contact_update( &C, &lim, F, t += h ), "contact reported twice\n" );
+    F[0] = 6;
+    F[3] = 0;
+    CHECK( 0 == pir_contact_update( &C, &lim, F, t += h ) && C.active,
+           "contact ended above half the limit\n" );
+    F[0] = 4;
+    CHECK( 0 == pir_contact_update( &C, &lim, F, t += h ) && !C.active, "contact did not end\n" );
+    F[3] = 3;
+    CHECK( PIR_CONTACT_TORQUE == pir_contact_update( &C, &lim, F, t += h ), "contact torque\n" );
+}
+
+/* Partial state messages round trip their sections and nothing else */
+static void check_state_msg( void ) {
+    static struct pir_state X, Y;
+    for( size_t i = 0; i < PIR_AXIS_CNT; i ++ ) X.q[i] = rand_unit();
+    for( size_t i = 0; i < 6; i ++ ) X.F[PIR_RIGHT][i] = rand_unit();
+    memset( &Y, 0, sizeof(Y) );
+    Y.S_wp[0][0] = 42;
+
+    int64_t time_ns[PIR_STATE_SEC_CNT] = {0};
+    time_ns[PIR_STATE_SEC_JOINTS] = 10;
+    time_ns[PIR_STATE_SEC_FT] = 20;
+    unsigned sections = PIR_STATE_SEC_BIT(PIR_STATE_SEC_JOINTS) | PIR_STATE_SEC_BIT(PIR_STATE_SEC_FT);
+    size_t size = pir_state_msg_size( sections );
+    struct pir_state_msg *msg = (struct pir_state_msg*)calloc( 1, pir_state_msg_size(PIR_STATE_SEC_ALL) );
+    pir_state_msg_pack( msg, &X, sections, time_ns );
+
+    CHECK( 0 == pir_state_msg_check(msg, size), "state_msg rejected\n" );
+    CHECK( 0 != pir_state_msg_check(msg, size + sizeof(double)), "state_msg wrong size accepted\n" );
+    CHECK( NULL == pir_state_msg_section(msg, PIR_STATE_SEC_WRIST), "state_msg absent section\n" );
+    const double *F = pir_state_msg_section( msg, PIR_STATE_SEC_FT );
+    CHECK( F && 0 == memcmp(F, X.F, sizeof(X.F)), "state_msg F/T section\n" );
+    CHECK( 20 == msg->time_ns[PIR_STATE_SEC_FT] && 0 == msg->time_ns[PIR_STATE_SEC_WRIST],
+           "state_msg section times\n" );
+
+    CHECK( sections == pir_state_msg_unpack(msg, &Y), "state_msg unpacked sections\n" );
+    CHECK( 0 == memcmp(X.q, Y.q, sizeof(X.q)) && 0 == memcmp(X.F, Y.F, sizeof(X.F)),
+           "state_msg values\n" );
+    CHECK( 42 == Y.S_wp[0][0], "state_msg overwrote an absent section\n" );
+
+    msg->version++;
+    CHECK( 0 != pir_state_msg_check(msg, size), "state_msg wrong version accepted\n" );
+    free( msg );
+}
+
+/* Seqlock writer: every put sets all of q to the put count */
+struct shm_writer {
+    struct pir_shm *shm;
+    size_t n;
+};
+
+static void *shm_write( void *arg ) {
+    struct shm_writer *w = (struct shm_writer*)arg;
+    static struct pir_state X;
+    static struct pir_config Q;
+    struct pir_health H = {0};
+    int64_t time_ns[PIR_STATE_SEC_CNT] = {0};
+    for( size_t k = 1; k <= w->n; k ++ ) {
+        for( size_t i = 0; i < PIR_AXIS_CNT; i ++ ) X.q[i] = (double)k;
+        time_ns[PIR_STATE_SEC_JOINTS] = (int64_t)k;
+        pir_shm_put( w->shm, &H, &X, &Q, time_ns, PIR_SHM_ALL );
+    }
+    return NULL;
+}
+
+/* Shared state: changed fields only, no torn reads, bounded waits */
+static void check_shm( void ) {
+    struct pir_shm *shm = (struct pir_shm*)calloc( 1, sizeof(*shm) );
+    static struct pir_state X, Y;
+    static struct pir_config Q;
+    struct pir_health H = {0};
+    int64_t time_ns[PIR_STATE_SEC_CNT] = {0}, t_get[PIR_STATE_SEC_CNT] = {0};
+    uint64_t gen[PIR_SHM_FIELD_CNT] = {0};
+
+    X.q[0] = 1;
+    time_ns[PIR_STATE_SEC_JOINTS] = 5;
+    pir_shm_put( shm, &H, &X, &Q, time_ns, PIR_SHM_ALL );
+    int r = pir_shm_get( shm, &H, &Y, &Q, t_get, PIR_SHM_JOINTS, gen );
+    CHECK( (int)PIR_SHM_JOINTS == r && 1 == Y.q[0] && 5 == t_get[PIR_STATE_SEC_JOINTS],
+           "shm first read %d\n", r );
+    r = pir_shm_get( shm, &H, &Y, &Q, t_get, PIR_SHM_JOINTS, gen );
+    CHECK( 0 == r, "shm reread %d\n", r );
+
+    pir_shm_put( shm, &H, &X, &Q, time_ns, PIR_SHM_BIT(PIR_SHM_F) );
+    r = pir_shm_get( shm, &H, &Y, &Q, t_get, PIR_SHM_ALL, gen );
+    CHECK( (int)(PIR_SHM_ALL & ~PIR_SHM_JOINTS) == r, "shm fields 0x%x\n", (unsigned)r );
+
+    // a put that never finishes times out and leaves the copy alone
+    shm->seq++;
+    X.q[0] = 2;
+    memset( gen, 0, sizeof(gen) );
+    r = pir_shm_get( shm, &H, &Y, &Q, t_get, PIR_SHM_ALL, gen );
+    CHECK( -1 == r && 1 == Y.q[0] && 0 == gen[PIR_SHM_Q], "shm unfinished put %d\n", r );
+    shm->seq++;
+
+    // concurrent writer, every read must be one whole put
+    struct shm_writer w = {shm, 20000};
+    pthread_t thread;
+    pthread_create( &thread, NULL, shm_write, &w );
+    size_t n_read = 0, n_torn = 0;
+    for( double last = 0; last < (double)w.n; ) {
+        r = pir_shm_get( shm, &H, &Y, &Q, t_get, PIR_SHM_BIT(PIR_SHM_Q), gen );
+        if( r <= 0 ) continue;
+        n_read++;
+        for( size_t i = 0; i < PIR_AXIS_CNT; i ++ ) {
+            if( Y.q[i] != Y.q[0] ) { n_torn++; break; }
+        }
+        CHECK( Y.q[0] >= last, "shm went back from %f to %f\n", last, Y.q[0] );
+        last = Y.q[0];
+    }
+    pthread_join( thread, NULL );
+    CHECK( 0 == n_torn, "shm %zu torn reads of %zu\n", n_torn, n_read );
+
+    free( shm );
+}
+
+/* Whole-body DLS satisfies the normal equations (A'A + kI) dq = A' dx */
+static void check_body( void ) {
+    double J[2][6*7], t[12], dx[12], dq[15], A[12*15] = {0};
+    const double k = 1e-3;
+    for( size_t side = 0; side < 2; side ++ ) {
+        for( size_t i = 0; i < 6*7; i ++ ) J[side][i] = rand_unit();
+        for( size_t r = 0; r < 6; r ++ ) {
+            for( size_t c = 0; c < 7; c ++ ) {
+                AA_MATREF(A, 12, 6*side + r, 7*side + c) = AA_MATREF(J[side], 6, r, c);
+            }
+        }
+    }
+    for( size_t r = 0; r < 12; r ++ ) {
+        t[r] = rand_unit();
+        dx[r] = rand_unit();
+        AA_MATREF(A, 12, r, 14) = t[r];
+    }
+
+    int r = pir_body_solve( J, t, k, dx, dq );
+    CHECK( 0 == r, "body returned %d\n", r );
+
+    double e[12];
+    for( size_t i = 0; i < 12; i ++ ) {
+        e[i] = -dx[i];
+        for( size_t j = 0; j < 15; j ++ ) e[i] += AA_MATREF(A, 12, i, j) * dq[j];
+    }
+    for( size_t j = 0; j < 15; j ++ ) {
+        double res = k * dq[j] + aa_la_dot( 12, AA_MATCOL(A, 12, j), e );
+        CHECK( fabs(res) < 1e-9, "body residual %zu: %g\n", j, res );
+    }
+}
+
+/* Streams pass their waypoints, refuse a full ring, and reuse slots */
+static void check_stream( void ) {
+    static struct pir_trajx_stream T;
+    const double dt = .1, h = .01;
+    double S[8], dx[6], v[3] = {0, 0, 0};
+    aa_tf_qv2duqu( aa_tf_quat_ident, v, S );
+    pir_trajx_stream_init( &T, S );
+
+    int r = 0;
+    for( size_t k = 1; k <= PIR_TRAJX_STREAM_RING; k ++ ) {
+        v[0] = h * (double)k;
+        aa_tf_qv2duqu( aa_tf_quat_ident, v, S );
+        r |= pir_trajx_stream_add( &T, 0, dt, S );
+    }
+    CHECK( 0 == r, "stream refused a waypoint\n" );
+    CHECK( 0 != pir_trajx_stream_add( &T, 0, dt, S ), "stream overfilled\n" );
+
+    for( size_t k = 1; k <= PIR_TRAJX_STREAM_RING / 2; k ++ ) {
+        double x[3];
+        pir_trajx_stream_get( &T, dt * (double)k, S, dx );
+        aa_tf_duqu_trans( S, x );
+        CHECK( fabs(x[0] - h*(double)k) < 1e-9, "stream waypoint %zu at %f\n", k, x[0] );
+    }
+    CHECK( 0 == pir_trajx_stream_add( &T, 0, dt, S ), "stream did not reuse slots\n" );
+
+    double t_end = dt * (PIR_TRAJX_STREAM_RING + 2);
+    r = pir_trajx_stream_get( &T, t_end, S, dx );
+    CHECK( r && 0 == aa_la_norm(6, dx), "stream did not stop at the end\n" );
+}
+
+/* Tabulated joint trajectories reproduce cubics and hold at the end */
+static void check_tab( void ) {
+    const size_t n = 50;
+    const double h = PIR_TRAJ_TAB_H;
+    double q[51], dq[51], q_t, dq_t;
+    for( size_t i = 0; i <= n; i ++ ) {
+        double t = h * (double)i;
+        q[i] = t*t*t - t;
+        dq[i] = 3*t*t - 1;
+    }
+    aa_mem_region_t reg;
+    aa_mem_region_init( &reg, 16*1024 );
+    struct pir_trajq_tab T;
+    pir_trajq_tab_init( &T, &reg, 1, n, h, q, dq );
+    for( double t = 0; t < h * (double)n; t += h / 7 ) {
+        int r = pir_trajq_tab_get( &T, t, &q_t, &dq_t );
+        CHECK( 0 == r && fabs(q_t - (t*t*t - t)) < 1e-12 && fabs(dq_t - (3*t*t - 1)) < 1e-10,
+               "tab at %f: %f, %f\n", t, q_t, dq_t );
+    }
+    int r = pir_trajq_tab_get( &T, 1, &q_t, &dq_t );
+    CHECK( r && q_t == q[n] && 0 == dq_t, "tab did not hold at the end\n" );
+
+    pir_trajq_tab_init( &T, &reg, 1, 0, 0, q + 3, dq + 3 );
+    r = pir_trajq_tab_get( &T, 0, &q_t, &dq_t );
+    CHECK( r && q_t == q[3] && 0 == dq_t, "tab hold\n" );
+    aa_mem_region_destroy( &reg );
+}
 
 int main(void) {
 
@@ -38,5 +525,26 @@ int main(void) {
     printf("q0:  ");aa_dump_vec( stdout, q0, 7 );
     printf("q1:  ");aa_dump_vec( stdout, q1, 7 );
     printf("dot: %f\n", aa_la_dot(7, q1, q1 ) );
-    return 0;
+
+    srand48(1);
+    check_qp( 7 );
+    check_qp( 14 );
+    check_qp( 15 );
+    check_topt( 1, 2 );
+    check_topt( 7, 5 );
+    check_topt( 14, 8 );
+    check_retime( q0 );
+    check_anom( .1 );
+    check_anom( 0 );
+    check_ftid();
+    check_abg();
+    check_payload();
+    check_contact();
+    check_state_msg();
+    check_shm();
+    check_body();
+    check_stream();
+    check_tab();
+
+    return n_fail ? -1 : 0;
 }
@@ -0,0 +1,411 @@
+/* -*- mode: C; c-basic-offset: 4  -*- */
+/* ex: set shiftwidth=4 expandtab: */
+/*
+ * Copyright (c) 2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@gatech.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/** Author: Neil Dantam
+ */
+
+#include <amino.h>
+#include <ach.h>
+#include <reflex.h>
+#include "piranha.h"
+
+/*
+ * Along q(s) = q0 + s (q1 - q0), joint i needs |ds| <= v_i / |dq_i|
+ * and |dds| <= a_i / |dq_i|, so the tightest joint bounds the path
+ * velocity and acceleration.  The minimum time motion from rest to
+ * rest over s in [0,1] is bang-coast-bang at those bounds, or
+ * bang-bang when the peak velocity is not reached.
+ */
+
+int pir_trajq_topt_gen( struct pir_trajq_topt *T, aa_mem_region_t *reg,
+                        size_t n_q, size_t n_pts, const double *q,
+                        const double *dq_max, const double *ddq_max )
+{
+    for( size_t i = 0; i < n_q; i ++ ) {
+        if( !(dq_max[i] > 0 && ddq_max[i] > 0) ) return -1;
+    }
+    if( n_pts < 1 ) return -1;
+
+    size_t n_seg = n_pts - 1;
+    T->n_q = n_q;
+    T->n_seg = n_seg;
+    T->cur = 0;
+    T->q = AA_MEM_REGION_NEW_N( reg, double, n_q*n_pts );
+    T->t = AA_MEM_REGION_NEW_N( reg, double, n_pts );
+    T->t_a = AA_MEM_REGION_NEW_N( reg, double, n_seg + 1 );
+    T->a = AA_MEM_REGION_NEW_N( reg, double, n_seg + 1 );
+    AA_MEM_CPY( T->q, q, n_q*n_pts );
+
+    T->t[0] = 0;
+    for( size_t j = 0; j < n_seg; j ++ ) {
+        const double *q0 = q + n_q*j;
+        const double *q1 = q0 + n_q;
+
+        // path limits from the tightest joint
+        double v = INFINITY, a = INFINITY;
+        for( size_t i = 0; i < n_q; i ++ ) {
+            double d = fabs( q1[i] - q0[i] );
+            if( d > 0 ) {
+                v = AA_MIN( v, dq_max[i] / d );
+                a = AA_MIN( a, ddq_max[i] / d );
+            }
+        }
+
+        double t_a, dt;
+        if( isinf(a) ) {
+            // no motion
+            t_a = 0;
+            dt = 0;
+            a = 0;
+        } else if( v*v >= a ) {
+            // velocity limit not reached, bang-bang
+            t_a = sqrt( 1 / a );
+            dt = 2 * t_a;
+        } else {
+            t_a = v / a;
+            dt = 1 / v + t_a;
+        }
+        T->t_a[j] = t_a;
+        T->a[j] = a;
+        T->t[j+1] = T->t[j] + dt;
+    }
+
+    return 0;
+}
+
+int pir_trajq_topt_get( struct pir_trajq_topt *T, double t,
+                        double *q, double *dq )
+{
+    size_t n_q = T->n_q;
+    if( 0 == T->n_seg || t >= T->t[T->n_seg] ) {
+        AA_MEM_CPY( q, T->q + n_q*T->n_seg, n_q );
+        AA_MEM_ZERO( dq, n_q );
+        return 1;
+    }
+
+    // time only moves forward
+    if( t < T->t[T->cur] ) T->cur = 0;
+    while( t >= T->t[T->cur+1] ) T->cur++;
+
+    size_t j = T->cur;
+    double tau = t - T->t[j];
+    double dt = T->t[j+1] - T->t[j];
+    double a = T->a[j], t_a = T->t_a[j];
+    double s, ds;
+    if( tau < t_a ) {
+        s = a*tau*tau/2;
+        ds = a*tau;
+    } else if( tau < dt - t_a ) {
+        s = a*t_a*t_a/2 + a*t_a*(tau - t_a);
+        ds = a*t_a;
+    } else {
+        double r = AA_MAX( 0, dt - tau );
+        s = 1 - a*r*r/2;
+        ds = a*r;
+    }
+
+    const double *q0 = T->q + n_q*j;
+    const double *q1 = q0 + n_q;
+    for( size_t i = 0; i < n_q; i ++ ) {
+        double d = q1[i] - q0[i];
+        q[i] = q0[i] + s*d;
+        dq[i] = ds*d;
+    }
+
+    return 0;
+}
+
+/*
+ * Whole-path parameterization.  A natural cubic spline q(s) through the
+ * waypoints, with chord length knots, fixes the geometry.  Along it,
+ * with x = ds/dt^2 and u = dds,
+ *
+ *   |q'_i(s)| sqrt(x) <= v_i
+ *   |q'_i(s) u + q''_i(s) x| <= a_i
+ *
+ * On a grid in s, a backward pass finds the largest x at each point
+ * from which the path can still stop at the end, and a forward pass
+ * from rest takes the largest u that stays below it.  The path only
+ * slows where a limit requires, so interior waypoints are passed
+ * through without stopping.  Each step holds u constant, so x is
+ * linear in s across it, and the limits are checked at both ends and
+ * the middle of the step; checking only the start lets the path
+ * brake through a sharp turn in a single step.
+ */
+
+#define TOPP_DS       .005      // grid spacing in s
+#define TOPP_BISECT   60        // bisection steps for the backward pass
+#define TOPP_EPS      1e-9      // smallest path derivative or knot spacing
+
+/* Natural spline second derivatives for each joint */
+static void topp_spline( size_t n_q, size_t n_k, const double *s,
+                         const double *y, double *M, double *w )
+{
+    AA_MEM_ZERO( M, n_q*n_k );
+    if( n_k < 3 ) return;
+    double *c = w, *d = w + n_k;
+    for( size_t i = 0; i < n_q; i ++ ) {
+        // Thomas algorithm over the interior knots
+        c[0] = 0;
+        d[0] = 0;
+        for( size_t j = 1; j + 1 < n_k; j ++ ) {
+            double h0 = s[j] - s[j-1], h1 = s[j+1] - s[j];
+            double r = 6 * ( (y[n_q*(j+1)+i] - y[n_q*j+i]) / h1 -
+                             (y[n_q*j+i] - y[n_q*(j-1)+i]) / h0 );
+            double b = 2*(h0 + h1) - h0*c[j-1];
+            c[j] = h1 / b;
+            d[j] = (r - h0*d[j-1]) / b;
+        }
+        for( size_t j = n_k - 2; j > 0; j -- ) {
+            M[n_q*j+i] = d[j] - c[j]*M[n_q*(j+1)+i];
+        }
+    }
+}
+
+/* Spline value and derivatives at s, knot found from the cursor */
+static void topp_eval( const struct pir_trajq_path *T, size_t *kn, double s,
+                       double *q, double *d1, double *d2 )
+{
+    size_t n_q = T->n_q;
+    size_t j = *kn;
+    if( s < T->s_k[j] ) j = 0;
+    while( j + 2 < T->n_k && s > T->s_k[j+1] ) j++;
+    *kn = j;
+
+    double h = T->s_k[j+1] - T->s_k[j];
+    double A = (T->s_k[j+1] - s) / h;
+    double B = 1 - A;
+    const double *y0 = T->q_k + n_q*j, *y1 = y0 + n_q;
+    const double *M0 = T->M_k + n_q*j, *M1 = M0 + n_q;
+    for( size_t i = 0; i < n_q; i ++ ) {
+        if( q ) q[i] = A*y0[i] + B*y1[i] +
+                    ((A*A*A - A)*M0[i] + (B*B*B - B)*M1[i]) * h*h/6;
+        if( d1 ) d1[i] = (y1[i] - y0[i]) / h +
+                     ( (1 - 3*A*A)*M0[i] + (3*B*B - 1)*M1[i] ) * h/6;
+        if( d2 ) d2[i] = A*M0[i] + B*M1[i];
+    }
+}
+
+/*
+ * Bounds on u over the step starting at x, with d1 and d2 at the start,
+ * middle, and end of the step.  Returns nonzero when no u is feasible.
+ */
+static int topp_u( size_t n_q, const double *d1, const double *d2,
+                   const double *ddq_max, double ds, double x,
+                   double *lo, double *hi )
+{
+    *lo = -INFINITY;
+    *hi = INFINITY;
+    for( size_t m = 0; m < 3; m ++ ) {
+        // at the fraction m/2 of the step, x is x + m ds u
+        double r = ds * (double)m;
+        for( size_t i = 0; i < n_q; i ++ ) {
+            double e = d1[n_q*m+i] + r*d2[n_q*m+i];
+            double a = ddq_max[i], c = d2[n_q*m+i]*x;
+            if( fabs(e) > TOPP_EPS ) {
+                double u0 = (-a - c) / e, u1 = (a - c) / e;
+                *lo = AA_MAX( *lo, AA_MIN(u0, u1) );
+                *hi = AA_MIN( *hi, AA_MAX(u0, u1) );
+            } else if( fabs(c) > a ) {
+                return -1;
+            }
+        }
+    }
+    return *lo > *hi;
+}
+
+int pir_trajq_path_gen( struct pir_trajq_path *T, aa_mem_region_t *reg,
+                        size_t n_q, size_t n_pts, const double *q,
+                        const double *dq_max, const double *ddq_max )
+{
+    for( size_t i = 0; i < n_q; i ++ ) {
+        if( !(dq_max[i] > 0 && ddq_max[i] > 0) ) return -1;
+    }
+    if( n_pts < 1 ) return -1;
+
+    T->n_q = n_q;
+    T->cur = 0;
+    T->kn = 0;
+    T->t_scale = 1;
+
+    // knots by chord length, dropping repeated waypoints
+    T->q_k = AA_MEM_REGION_NEW_N( reg, double, n_q*n_pts );
+    T->s_k = AA_MEM_REGION_NEW_N( reg, double, n_pts );
+    AA_MEM_CPY( T->q_k, q, n_q );
+    T->s_k[0] = 0;
+    size_t n_k = 1;
+    for( size_t j = 1; j < n_pts; j ++ ) {
+        const double *qj = q + n_q*j;
+        double d = 0;
+        for( size_t i = 0; i < n_q; i ++ ) {
+            double e = qj[i] - T->q_k[n_q*(n_k-1) + i];
+            d += e*e;
+        }
+        if( sqrt(d) > TOPP_EPS ) {
+            AA_MEM_CPY( T->q_k + n_q*n_k, qj, n_q );
+            T->s_k[n_k] = T->s_k[n_k-1] + sqrt(d);
+            n_k++;
+        }
+    }
+    T->n_k = n_k;
+
+    if( n_k < 2 ) {
+        // nothing to move, hold at the start
+        T->n_grid = 0;
+        T->ds = 0;
+        T->M_k = NULL;
+        T->x = T->t = NULL;
+        return 0;
+    }
+
+    T->M_k = AA_MEM_REGION_NEW_N( reg, double, n_q*n_k );
+    double *w = AA_MEM_REGION_NEW_N( reg, double, 2*n_k );
+    topp_spline( n_q, n_k, T->s_k, T->q_k, T->M_k, w );
+
+    double s_f = T->s_k[n_k-1];
+    size_t N = AA_MAX( (size_t)16, (size_t)ceil( s_f / TOPP_DS ) );
+    double ds = s_f / (double)N;
+    T->n_grid = N;
+    T->ds = ds;
+
+    // path derivatives at the grid and its midpoints
+    double *d1 = AA_MEM_REGION_NEW_N( reg, double, n_q*(2*N+1) );
+    double *d2 = AA_MEM_REGION_NEW_N( reg, double, n_q*(2*N+1) );
+    double *K = AA_MEM_REGION_NEW_N( reg, double, N+1 );
+    for( size_t m = 0; m <= 2*N; m ++ ) {
+        double s = (m == 2*N) ? s_f : ds * (double)m / 2;
+        topp_eval( T, &T->kn, s, NULL, d1 + n_q*m, d2 + n_q*m );
+    }
+    T->kn = 0;
+
+    // velocity limit, covering the neighboring midpoints
+    for( size_t k = 0; k <= N; k ++ ) {
+        K[k] = INFINITY;
+        for( size_t m = (k ? 2*k-1 : 0); m <= AA_MIN(2*k+1, 2*N); m ++ ) {
+            for( size_t i = 0; i < n_q; i ++ ) {
+                double d = fabs( d1[n_q*m + i] );
+                if( d > TOPP_EPS ) {
+                    double r = dq_max[i] / d;
+                    K[k] = AA_MIN( K[k], r*r );
+                }
+            }
+        }
+    }
+
+    // backward: largest x that can still stop at the end
+    K[N] = 0;
+    for( size_t k = N; k-- > 0; ) {
+        const double *a1 = d1 + 2*n_q*k, *a2 = d2 + 2*n_q*k;
+        double lo, hi;
+        double x1 = K[k];
+        if( !topp_u(n_q, a1, a2, ddq_max, ds, x1, &lo, &hi) && x1 + 2*ds*lo <= K[k+1] ) {
+            continue;
+        }
+        // feasible at rest, so bisect toward the bound
+        double x0 = 0;
+        if( isinf(x1) ) x1 = K[k+1] + 1;
+        for( int b = 0; b < TOPP_BISECT; b ++ ) {
+            double xm = (x0 + x1) / 2;
+            if( !topp_u(n_q, a1, a2, ddq_max, ds, xm, &lo, &hi) && xm + 2*ds*lo <= K[k+1] ) {
+                x0 = xm;
+            } else {
+                x1 = xm;
+            }
+        }
+        K[k] = x0;
+    }
+
+    // forward: accelerate as hard as the backward bound allows
+    T->x = AA_MEM_REGION_NEW_N( reg, double, N+1 );
+    T->t = AA_MEM_REGION_NEW_N( reg, double, N+1 );
+    T->x[0] = 0;
+    T->t[0] = 0;
+    for( size_t k = 0; k < N; k ++ ) {
+        double xk = T->x[k], lo, hi;
+        topp_u( n_q, d1 + 2*n_q*k, d2 + 2*n_q*k, ddq_max, ds, xk, &lo, &hi );
+        double u = AA_MIN( hi, (K[k+1] - xk) / (2*ds) );
+        double x1 = AA_MAX( 0, xk + 2*ds*u );
+        T->x[k+1] = x1;
+
+        double v = sqrt(xk) + sqrt(x1);
+        if( !(v > 0) ) return -1;
+        T->t[k+1] = T->t[k] + 2*ds / v;
+    }
+
+    return 0;
+}
+
+double pir_trajq_path_t_f( const struct pir_trajq_path *T )
+{
+    return T->n_grid ? T->t_scale * T->t[T->n_grid] : 0;
+}
+
+int pir_trajq_path_get( struct pir_trajq_path *T, double t,
+                        double *q, double *dq )
+{
+    size_t n_q = T->n_q;
+    size_t N = T->n_grid;
+    if( 0 == N || t >= pir_trajq_path_t_f(T) ) {
+        AA_MEM_CPY( q, T->q_k + n_q*(T->n_k-1), n_q );
+        AA_MEM_ZERO( dq, n_q );
+        return 1;
+    }
+
+    // time only moves forward
+    double tp = t / T->t_scale;
+    if( tp < T->t[T->cur] ) T->cur = 0;
+    while( T->cur + 1 < N && tp >= T->t[T->cur+1] ) T->cur++;
+
+    size_t k = T->cur;
+    double tau = AA_MAX( 0, tp - T->t[k] );
+    double v0 = sqrt( T->x[k] );
+    double u = (T->x[k+1] - T->x[k]) / (2*T->ds);
+    double s = AA_MIN( T->ds*(double)(k+1), T->ds*(double)k + v0*tau + u*tau*tau/2 );
+    double v = AA_MAX( 0, v0 + u*tau );
+
+    topp_eval( T, &T->kn, s, q, dq, NULL );
+    for( size_t i = 0; i < n_q; i ++ ) {
+        dq[i] *= v / T->t_scale;
+    }
+
+    return 0;
+}